@@ -93,6 +93,18 @@ LINK32=link.exe
 # PROP Default_Filter ".h"
 # Begin Source File
 
+SOURCE=.\mempool.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\qsplat_blockcache.h
+# End Source File
+# Begin Source File
+
+SOURCE=.\qsplat_bytesource.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_colorquant.h
 # End Source File
 # Begin Source File
@@ -109,6 +121,10 @@ SOURCE=.\qsplat_guimain.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\qsplat_lz.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_model.h
 # End Source File
 # Begin Source File
@@ -117,6 +133,10 @@ SOURCE=.\qsplat_normquant.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\qsplat_pagein.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_spherequant.h
 # End Source File
 # Begin Source File
@@ -125,6 +145,10 @@ SOURCE=.\qsplat_traverse_v11.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\qsplat_traverse_v13.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_util.h
 # End Source File
 # Begin Source File
@@ -137,6 +161,18 @@ SOURCE=.\resource.h
 # PROP Default_Filter ".cpp"
 # Begin Source File
 
+SOURCE=.\mempool.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\qsplat_blockcache.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=.\qsplat_bytesource.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_colorquant.cpp
 # End Source File
 # Begin Source File
@@ -173,6 +209,10 @@ SOURCE=.\qsplat_guimain.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\qsplat_lz.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_main.cpp
 # End Source File
 # Begin Source File
@@ -185,6 +225,10 @@ SOURCE=.\qsplat_normquant.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\qsplat_pagein.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\qsplat_spherequant.cpp
 # End Source File
 # End Group
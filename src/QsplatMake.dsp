@@ -86,10 +86,22 @@ LINK32=link.exe
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=..\mempool.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\qsplat_colorquant.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\qsplat_lz.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\qsplat_make_convert.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\qsplat_make_from_mesh.cpp
 # End Source File
 # Begin Source File
@@ -98,6 +110,14 @@ SOURCE=..\qsplat_make_main.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=..\qsplat_make_outofcore.cpp
+# End Source File
+# Begin Source File
+
+SOURCE=..\qsplat_make_ply.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=..\qsplat_make_qtree_v11.cpp
 # End Source File
 # Begin Source File
@@ -108,6 +128,10 @@ SOURCE=..\qsplat_normquant.cpp
 
 SOURCE=..\qsplat_spherequant.cpp
 # End Source File
+# Begin Source File
+
+SOURCE=..\qsplat_threads.cpp
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -122,10 +146,22 @@ SOURCE=..\qsplat_colorquant.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\qsplat_lz.h
+# End Source File
+# Begin Source File
+
+SOURCE=..\qsplat_make_convert.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\qsplat_make_from_mesh.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\qsplat_make_outofcore.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\qsplat_make_qtree_v11.h
 # End Source File
 # Begin Source File
@@ -138,6 +174,10 @@ SOURCE=..\qsplat_spherequant.h
 # End Source File
 # Begin Source File
 
+SOURCE=..\qsplat_threads.h
+# End Source File
+# Begin Source File
+
 SOURCE=..\qsplat_util.h
 # End Source File
 # End Group
@@ -0,0 +1,161 @@
+/*
+Szymon Rusinkiewicz
+
+mempool.cpp
+Arena allocation.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mempool.h"
+
+#ifdef WIN32
+# include <windows.h>
+#elif defined(__linux__)
+# include <sys/mman.h>
+#endif
+
+
+Arena::Arena(size_t _blocksize /* = ARENA_BLOCK */, bool _huge /* = false */) :
+	cur(-1), next(NULL), blocksize(_blocksize), huge(_huge)
+{
+#if !defined(WIN32) && !defined(__linux__)
+	huge = false;
+#endif
+	if (huge && blocksize < ARENA_HUGE_BLOCK)
+		blocksize = ARENA_HUGE_BLOCK;
+	memset(&st, 0, sizeof(st));
+}
+
+
+// The current block is full - move on to the next one that's big enough,
+// or get a new one
+void *Arena::alloc_slow(size_t n)
+{
+	while (++cur < blocks.size()) {
+		next = blocks[cur].begin;
+		if (n <= (size_t)(blocks[cur].end - next))
+			break;
+	}
+
+	if (cur == blocks.size()) {
+		Block b;
+		b.size = (n > blocksize) ? n : blocksize;
+		b.begin = (char *) alloc_block(b.size, huge);
+		b.end = b.begin + b.size;
+		blocks.push_back(b);
+		st.blocks++;
+		st.reserved += b.size;
+		next = b.begin;
+	}
+
+	if (st.used > st.peak)
+		st.peak = st.used;
+	void *p = next;
+	next += n;
+	return p;
+}
+
+
+void Arena::reset()
+{
+	if (st.used > st.peak)
+		st.peak = st.used;
+	st.used = 0;
+	st.resets++;
+	cur = blocks.empty() ? -1 : 0;
+	next = blocks.empty() ? NULL : blocks[0].begin;
+}
+
+
+void Arena::release()
+{
+	for (int i = 0; i < blocks.size(); i++)
+		free_block(blocks[i].begin, blocks[i].size, huge);
+	blocks.clear();
+	st.blocks = 0;
+	st.reserved = 0;
+	reset();
+}
+
+
+const Arena::Stats &Arena::stats()
+{
+	if (st.used > st.peak)
+		st.peak = st.used;
+	return st;
+}
+
+
+// Get a block from the system.  Huge blocks get rounded up to a multiple of
+// the large page size, and we ask the OS to use large pages for them if it
+// can.
+void *Arena::alloc_block(size_t &size, bool huge)
+{
+	void *p = NULL;
+#ifdef WIN32
+	if (huge) {
+		size_t large = GetLargePageMinimum();
+		if (large) {
+			size_t s = (size + large - 1) / large * large;
+			p = VirtualAlloc(NULL, s, MEM_RESERVE | MEM_COMMIT |
+					 MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (p) {
+				size = s;
+				return p;
+			}
+		}
+		// No privilege for large pages - use ordinary ones
+		p = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT,
+				 PAGE_READWRITE);
+	}
+#elif defined(__linux__)
+	if (huge) {
+		size = (size + ARENA_HUGE_BLOCK - 1) & ~(size_t)(ARENA_HUGE_BLOCK - 1);
+		// Over-allocate so that we can trim to a large-page boundary
+		size_t s = size + ARENA_HUGE_BLOCK;
+		char *q = (char *) mmap(NULL, s, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (q != (char *) MAP_FAILED) {
+			char *a = (char *) (((size_t)q + ARENA_HUGE_BLOCK - 1) &
+					    ~(size_t)(ARENA_HUGE_BLOCK - 1));
+			if (a != q)
+				munmap(q, a - q);
+			munmap(a + size, (q + s) - (a + size));
+# ifdef MADV_HUGEPAGE
+			madvise(a, size, MADV_HUGEPAGE);
+# endif
+			p = a;
+		}
+	}
+#endif
+	if (!p && !huge)
+		p = malloc(size);
+	if (!p) {
+		fprintf(stderr, "Out of memory allocating %lu bytes\n",
+			(unsigned long) size);
+		exit(1);
+	}
+	return p;
+}
+
+
+void Arena::free_block(void *p, size_t size, bool huge)
+{
+#ifdef WIN32
+	if (huge) {
+		VirtualFree(p, 0, MEM_RELEASE);
+		return;
+	}
+#elif defined(__linux__)
+	if (huge) {
+		munmap(p, size);
+		return;
+	}
+#endif
+	free(p);
+}
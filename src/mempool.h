@@ -4,83 +4,86 @@
 Szymon Rusinkiewicz
 
 mempool.h
-Replacement memory management for a class using a memory pool.
+Arena allocation: memory is handed out from big blocks by bumping a pointer,
+and is only given back all at once.
 
 Sample usage:
-	class MyClass {
-	private:
-		static PoolAlloc memPool;
-	public:
-		void *operator new(size_t n) { return memPool.alloc(n); }
-		void operator delete(void *p, size_t n) { memPool.free(p,n); }
-		// ...
-	};
-
-	PoolAlloc MyClass::memPool(sizeof(MyClass));
+	Arena a;
+	float *f = a.alloc<float>(n);
+	...
+	a.reset();	// Everything allocated so far is gone, but the
+			// blocks are kept around for the next round
 
-Does *no* error checking.  Make sure itemsize is larger than sizeof(void *).
+alloc() is a handful of instructions unless a new block is needed, and
+reset() takes constant time.  Requests bigger than the block size get a
+block of their own.  Blocks of huge arenas are allocated so that the OS can
+back them with large pages, which saves TLB misses on big arrays.
 
-Based on the description of the Pool class in _Effective C++_ by Scott Meyers
+An Arena does no locking.  Threads that need scratch memory should each
+have their own.
 */
 
+#include <stddef.h>
 #include <vector>
-#include <algorithm>
 
-#define POOL_MEMBLOCK 4088
+#define ARENA_BLOCK (1 << 20)
+#define ARENA_HUGE_BLOCK (1 << 21)
+#define ARENA_ALIGN 8
+
 
+class Arena {
+public:
+	struct Stats {
+		size_t allocs;		// Number of alloc() calls
+		size_t used;		// Bytes handed out since reset()
+		size_t peak;		// Most bytes ever handed out at once
+		size_t reserved;	// Bytes in all blocks
+		int blocks;		// Number of blocks
+		int resets;		// Number of reset() calls
+	};
 
-class PoolAlloc {
 private:
-	size_t itemsize;
-	void *freelist;
-	void grow_freelist()
-	{
-		int n = POOL_MEMBLOCK / itemsize;
-		freelist = ::operator new(n * itemsize);
-		for (int i=0; i < n-1; i++)
-			* (void **)((char *)freelist+itemsize*i) = (char *)freelist + itemsize*(i+1);
-		* (void **)((char *)freelist+itemsize*(n-1)) = 0;
-	}
+	struct Block {
+		char *begin, *end;
+		size_t size;		// As allocated, for freeing
+	};
+	std::vector<Block> blocks;
+	int cur;			// Block we're allocating from
+	char *next;
+	size_t blocksize;
+	bool huge;
+	Stats st;
+
+	void *alloc_slow(size_t n);
+	static void *alloc_block(size_t &size, bool huge);
+	static void free_block(void *p, size_t size, bool huge);
 
 public:
-	PoolAlloc(size_t size) : itemsize(size), freelist(0) {}
+	Arena(size_t _blocksize = ARENA_BLOCK, bool _huge = false);
+	~Arena() { release(); }
+
 	void *alloc(size_t n)
 	{
-		if (n != itemsize)
-			return ::operator new(n);
-		if (!freelist)
-			grow_freelist();
-		void *next = freelist;
-		freelist = * (void **)next;
-		return next;
-	}
-	void free(void *p, size_t n)
-	{
-		if (!p)
-			return;
-		else if (n != itemsize)
-			::operator delete(p);
-		else {
-			* (void **)p = freelist;
-			freelist = p;
+		n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+		st.allocs++;
+		st.used += n;
+		if (cur >= 0 && n <= (size_t)(blocks[cur].end - next)) {
+			void *p = next;
+			next += n;
+			return p;
 		}
+		return alloc_slow(n);
 	}
-	void sort_freelist()
-	{
-		if (!freelist)
-			return;
-		std::vector<void *> v;
-		void *p;
-		for (p = freelist; * (void **)p; p = * (void **)p)
-			v.push_back(p);
-		std::sort(v.begin(), v.end());
-		p = freelist = v[0];
-		for (int i=1; i < v.size(); i++) {
-			* (void **)p = v[i];
-			p = * (void **)p;
-		}
-		* (void **)p = NULL;
-	}
+	template <class T> T *alloc(size_t n)
+		{ return (T *) alloc(n * sizeof(T)); }
+
+	// Forget everything allocated so far, but keep the blocks
+	void reset();
+
+	// Give all the memory back to the system
+	void release();
+
+	const Stats &stats();
 };
 
 #endif
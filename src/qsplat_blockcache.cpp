@@ -0,0 +1,96 @@
+/*
+qsplat_blockcache.cpp
+A cache of blocks of the trees of fragments.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "qsplat_blockcache.h"
+#include "qsplat_lz.h"
+
+
+QSplat_BlockCache::~QSplat_BlockCache()
+{
+	for (int i = 0; i < slots.size(); i++)
+		delete [] slots[i].buf;
+}
+
+
+int QSplat_BlockCache::AddBlock(long long offset, int datalen, int len,
+				bool compressed)
+{
+	Block b;
+	b.offset = offset;
+	b.datalen = datalen;
+	b.len = len;
+	b.compressed = compressed;
+	b.slot = -1;
+	blocks.push_back(b);
+	return blocks.size() - 1;
+}
+
+
+// Read block b into a slot, and return the slot.  While there's room,
+// each block gets a new slot; after that, the one used longest ago that
+// isn't locked gets thrown out.
+int QSplat_BlockCache::Load(int b)
+{
+	Block &block = blocks[b];
+	int s = -1;
+	if (used + block.len > budget) {
+		for (int i = 0; i < slots.size(); i++) {
+			if (slots[i].locks)
+				continue;
+			if (s < 0 || clock - slots[i].lastuse >
+				     clock - slots[s].lastuse)
+				s = i;
+		}
+	}
+	if (s < 0) {
+		Slot slot;
+		slot.buf = NULL;
+		slot.size = 0;
+		slot.block = -1;
+		slot.locks = 0;
+		slot.lastuse = clock;
+		slots.push_back(slot);
+		s = slots.size() - 1;
+	}
+
+	Slot &slot = slots[s];
+	if (slot.block >= 0)
+		blocks[slot.block].slot = -1;
+	if (slot.size < block.len) {
+		delete [] slot.buf;
+		used += block.len - slot.size;
+		slot.buf = new unsigned char[block.len + QSPLAT_BLOCKCACHE_SLACK];
+		slot.size = block.len;
+	}
+	memset(slot.buf + block.len, 0, QSPLAT_BLOCKCACHE_SLACK);
+	slot.block = b;
+	block.slot = s;
+	loads++;
+
+	// A block that can't be read or won't decompress comes out as
+	// zeros, which read as nodes with no children
+	bool ok;
+	if (block.compressed) {
+		const unsigned char *data = source->Get(block.offset,
+							block.datalen, scratch);
+		ok = data && qsplat_lz_decompress(data, block.datalen,
+						  slot.buf, block.len);
+	} else {
+		ok = source->Read(block.offset, block.len, slot.buf);
+	}
+	if (!ok) {
+		memset(slot.buf, 0, block.len);
+		if (!complained) {
+			fprintf(stderr, "Couldn't read part of the model\n");
+			complained = true;
+		}
+	}
+	return s;
+}
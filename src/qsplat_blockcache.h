@@ -0,0 +1,94 @@
+#ifndef QSPLAT_BLOCKCACHE_H
+#define QSPLAT_BLOCKCACHE_H
+/*
+qsplat_blockcache.h
+A cache of blocks of the trees of fragments that aren't read straight out
+of a mapped file: the compressed blocks of version 14 fragments, and
+pieces of all the others when the file is being read with pread().
+Blocks are read (and decompressed) the first time they're used, and once
+the cache is full, the least recently used blocks make way for new ones.
+The traversal locks each block while it's reading from it, so it doesn't
+go away in the middle.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stddef.h>
+#include <vector>
+#include "qsplat_bytesource.h"
+
+
+// How much memory the blocks can use, unless told otherwise.  The cache only
+// goes over this if every block in it is locked.
+#define QSPLAT_BLOCKCACHE_BUDGET (64 << 20)
+
+// Each block is followed by this many zeros, so that a group that starts
+// near the end of it can always be read
+#define QSPLAT_BLOCKCACHE_SLACK 64
+
+
+class QSplat_BlockCache {
+private:
+	struct Block {
+		long long offset;		// In the file
+		int datalen, len;
+		bool compressed;
+		int slot;			// -1 if not in the cache
+	};
+	struct Slot {
+		unsigned char *buf;
+		int size;
+		int block;
+		int locks;
+		unsigned lastuse;
+	};
+	std::vector<Block> blocks;
+	std::vector<Slot> slots;
+	QSplat_ByteSource *source;
+	size_t budget, used;
+	unsigned clock;
+	bool complained;
+	std::vector<unsigned char> scratch;
+
+	int Load(int b);
+
+public:
+	QSplat_BlockCache(size_t _budget = QSPLAT_BLOCKCACHE_BUDGET) :
+		source(NULL), budget(_budget), used(0), clock(0),
+		complained(false), loads(0)
+		{}
+	~QSplat_BlockCache();
+
+	// Where the blocks come from, and how much memory they may use
+	void SetSource(QSplat_ByteSource *_source) { source = _source; }
+	void SetBudget(size_t _budget) { budget = _budget; }
+
+	// Add a block whose datalen bytes of data are at offset in the file.
+	// Compressed blocks decompress to len bytes; otherwise len must be
+	// the same as datalen.  Returns its number.
+	int AddBlock(long long offset, int datalen, int len, bool compressed);
+	int NumBlocks() { return blocks.size(); }
+
+	// The (decompressed) data of block b, which stays in the cache until
+	// it's unlocked (as many times as it was locked)
+	inline const unsigned char *Lock(int b)
+	{
+		int s = blocks[b].slot;
+		if (s < 0)
+			s = Load(b);
+		Slot &slot = slots[s];
+		slot.locks++;
+		slot.lastuse = ++clock;
+		return slot.buf;
+	}
+	inline void Unlock(int b)
+	{
+		slots[blocks[b].slot].locks--;
+	}
+
+	// How many blocks have been read
+	long long loads;
+};
+
+#endif
@@ -0,0 +1,55 @@
+/*
+qsplat_bytesource.cpp
+Where the bytes of a .qs file come from.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <string.h>
+#include "qsplat_bytesource.h"
+#ifndef WIN32
+# include <unistd.h>
+# include <errno.h>
+#endif
+
+
+bool QSplat_MappedBytes::Read(long long offset, size_t len, unsigned char *buf)
+{
+	memcpy(buf, map + offset, len);
+	return true;
+}
+
+
+bool QSplat_FileBytes::Read(long long offset, size_t len, unsigned char *buf)
+{
+	while (len) {
+#ifdef WIN32
+		OVERLAPPED o;
+		memset(&o, 0, sizeof(o));
+		o.Offset = (DWORD) offset;
+		o.OffsetHigh = (DWORD) (offset >> 32);
+		DWORD n = 0;
+		if (!ReadFile(fd, buf, (DWORD) len, &n, &o) || !n)
+			return false;
+#else
+		ssize_t n = pread(fd, buf, len, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+#endif
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+
+const unsigned char *QSplat_FileBytes::Get(long long offset, size_t len,
+					   std::vector<unsigned char> &buf)
+{
+	buf.resize(len ? len : 1);
+	return Read(offset, len, &buf[0]) ? &buf[0] : NULL;
+}
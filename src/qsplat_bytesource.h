@@ -0,0 +1,66 @@
+#ifndef QSPLAT_BYTESOURCE_H
+#define QSPLAT_BYTESOURCE_H
+/*
+qsplat_bytesource.h
+Where the bytes of a .qs file come from.  Normally the whole file is
+mapped into memory, and reading from it is just a matter of pointing at
+it.  It can also be read piece by piece with pread(), so that the only
+parts of it in memory are the ones in the model's block cache - which
+gives a fixed limit on how much memory a model uses, and doesn't depend on
+the mmap behaving itself (over NFS, say, or on IRIX).
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#ifdef WIN32
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+#else
+# define HANDLE int
+#endif
+#include <stddef.h>
+#include <vector>
+
+
+class QSplat_ByteSource {
+public:
+	virtual ~QSplat_ByteSource() {}
+
+	// Read the len bytes at offset into buf.  Returns false if they
+	// couldn't all be read.
+	virtual bool Read(long long offset, size_t len, unsigned char *buf) = 0;
+
+	// Returns a pointer to the len bytes at offset - either into the
+	// file itself or, if it isn't mapped, into buf, after reading them
+	// into it.  Returns NULL if they couldn't be read.
+	virtual const unsigned char *Get(long long offset, size_t len,
+					 std::vector<unsigned char> &buf) = 0;
+};
+
+
+// A file that's mapped into memory at map
+class QSplat_MappedBytes : public QSplat_ByteSource {
+private:
+	const unsigned char *map;
+public:
+	QSplat_MappedBytes(const unsigned char *map_) : map(map_) {}
+	bool Read(long long offset, size_t len, unsigned char *buf);
+	const unsigned char *Get(long long offset, size_t len,
+				 std::vector<unsigned char> &buf)
+		{ return map + offset; }
+};
+
+
+// A file that's read as needed
+class QSplat_FileBytes : public QSplat_ByteSource {
+private:
+	HANDLE fd;
+public:
+	QSplat_FileBytes(HANDLE fd_) : fd(fd_) {}
+	bool Read(long long offset, size_t len, unsigned char *buf);
+	const unsigned char *Get(long long offset, size_t len,
+				 std::vector<unsigned char> &buf);
+};
+
+#endif
@@ -22,8 +22,13 @@ public:
 
 	static inline const float *lookup(const unsigned char *q)
 	{
-		unsigned index = (unsigned(*q) << 8) | unsigned(*(q+1));
-		return colorquant_table + 3*index;
+		return lookup((unsigned(*q) << 8) | unsigned(*(q+1)));
+	}
+
+	// The same, given the 16 bits as a number
+	static inline const float *lookup(unsigned index)
+	{
+		return colorquant_table + 3*(index & 0xffffu);
 	}
 };
 
@@ -11,6 +11,7 @@ Leland Stanford Junior University.  All Rights Reserved.
 */
 
 #include "qsplat_guimain.h"
+#include "mempool.h"
 #include <GL/gl.h>
 #include <float.h>
 #include <vector>
@@ -40,33 +41,11 @@ struct quadrangle
 		}
 	};
 
-	class quadrangle_mempool
-	{
-	private:
-		enum { chunksize = 10000 };
-		std::vector<quadrangle *> v;
-		int n;
-	public:
-		quadrangle *next()
-		{
-			if (v.empty() || n == chunksize) {
-				v.push_back(new quadrangle[chunksize]);
-				n = 0;
-			}
-			return v.back() + (n++);
-		}
-		void release()
-		{
-			for (int i=0; i < v.size(); i++)
-				delete [] v[i];
-			v.clear();
-		}
-	};
-
-	static quadrangle_mempool qpool;
+	// All the quadrangles of a frame are thrown away together
+	static Arena qpool;
 };
 
-quadrangle::quadrangle_mempool quadrangle::qpool;
+Arena quadrangle::qpool;
 
 
 // Words with 0 through 32 bits set, starting with the lsb
@@ -242,7 +221,7 @@ void drawpoint_software_tiles(float cx, float cy, float cz, float rad, float spl
 		int ytile_index = ytile * horz_tiles;
 		for (int xtile = x_tile_start; xtile<=x_tile_end; xtile++)
 		{
-			quadrangle* q = quadrangle::qpool.next();
+			quadrangle* q = quadrangle::qpool.alloc<quadrangle>(1);
 			q->startx = (xtile == x_tile_start) ? (startx & 31) : 0;
 			q->endx   = (xtile == x_tile_end)   ? (endx   & 31) : 31;
 			q->starty = tile_starty;
@@ -268,7 +247,7 @@ static void cleanup()
 #endif
 	if (framebuffer)
 		delete[] framebuffer;
-	quadrangle::qpool.release();
+	quadrangle::qpool.reset();
 	delete[] quadQueue;
 }
 
@@ -29,6 +29,7 @@ Leland Stanford Junior University.  All Rights Reserved.
 #define REFINE_DELAY	0.5f
 #define SHOWLIGHT_TIME	2.5f
 #define SHOWPROG_TIME	1.5f
+#define PREDICT_TIME	0.5f
 
 
 // The GUI global variable
@@ -106,6 +107,9 @@ void QSplatGUI::redraw()
 	pts_splatted = 0;
 	bool bailed = theQSplat_Model->draw();
 
+	// ... and start reading what we'll need to draw next
+	predict();
+
 
 	// Examine what happened
 	if (bailed) {
@@ -421,8 +425,16 @@ bool QSplatGUI::idle()
 	}
 
 	if (dorefine && !theQSplat_Model->can_refine()) {
+		// Draw again if parts of the model we had to skip have
+		// been read in, and keep checking until they all have
+		if (theQSplat_Model->pages_arrived()) {
+			need_redraw();
+			updatestatus("Loading");
+			return false;
+		}
 		updatestatus("Done refining");
-		if (showlight == SHOWLIGHT_ON || showprogressbar == PROGRESS_ON) {
+		if (showlight == SHOWLIGHT_ON || showprogressbar == PROGRESS_ON ||
+		    theQSplat_Model->paging()) {
 			usleep(10000);
 			return false;
 		} else {
@@ -461,6 +473,9 @@ void QSplatGUI::resetviewer(bool splatsize_only /* = false */)
 		return;
 
 	thecamera.GoHome();
+	for (int i = 0; i < 3; i++)
+		last_drawn_pos[i] = thecamera.pos[i];
+	get_timestamp(last_drawn_time);
 
 	rot_depth = surface_depth =
 		Dist(thecamera.pos, theQSplat_Model->center);
@@ -655,6 +670,67 @@ void QSplatGUI::update_depth(bool update_rot_depth /* = false */,
 }
 
 
+// Guess where the camera will be PREDICT_TIME from now, and have the model
+// start reading in what it will need to draw from there, so that it's in
+// memory by the time we get there.  Rotation (while dragging or spinning)
+// is carried on using the spin parameters, the same way idle() spins.
+// Panning and zooming are carried on at the speed the camera moved since
+// the last frame.
+void QSplatGUI::predict()
+{
+	timestamp now;
+	get_timestamp(now);
+	float dt = now - last_drawn_time;
+	point pos = { thecamera.pos[0], thecamera.pos[1], thecamera.pos[2] };
+	last_drawn_time = now;
+
+	Camera ahead = thecamera;
+	bool moving = false;
+	if ((dospin || last_button == ROT_BUTTON) && spinspeed != 0.0f) {
+		float q[4];
+		RotAndAxis2Q(spinspeed*PREDICT_TIME, spinaxis, q);
+		if (rot_depth == 0) {
+			q[1] = -q[1];
+			q[2] = -q[2];
+		}
+		ahead.Rotate(q, rot_depth);
+		moving = true;
+	} else if (dt > 0.0f && dt < PREDICT_TIME) {
+		float ahead_frames = PREDICT_TIME / dt;
+		for (int i = 0; i < 3; i++) {
+			float d = pos[i] - last_drawn_pos[i];
+			ahead.pos[i] += ahead_frames * d;
+			if (d != 0.0f)
+				moving = true;
+		}
+	}
+	for (int i = 0; i < 3; i++)
+		last_drawn_pos[i] = pos[i];
+	if (!moving)
+		return;
+
+	// Set up the matrices for the predicted camera, and read them back
+	float P[16], M[16], V[4];
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	Camera current = thecamera;
+	thecamera = ahead;
+	setup_matrices(false);
+	thecamera = current;
+	glGetFloatv(GL_PROJECTION_MATRIX, P);
+	glGetFloatv(GL_MODELVIEW_MATRIX, M);
+	glGetFloatv(GL_VIEWPORT, V);
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+	glPopMatrix();
+
+	theQSplat_Model->predict(P, M, V);
+}
+
+
 // Mouse event helper function - rotate
 void QSplatGUI::rotate(float ox, float oy, float nx, float ny)
 {
@@ -57,6 +57,7 @@ private:
 	void mouse_i2f(int, int, float *, float *);
 	void draw_light();
 	void draw_progressbar();
+	void predict();
 
 	// GUI modes and internal state
 	bool dorefine;
@@ -77,6 +78,11 @@ private:
 	float spinspeed;
 	vec spinaxis;
 
+	// Where the camera was when we last drew, for guessing where it's
+	// going next
+	point last_drawn_pos;
+	timestamp last_drawn_time;
+
 public:
 	// These are things that system-specific subclasses must implement
 
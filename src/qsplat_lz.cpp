@@ -0,0 +1,455 @@
+/*
+qsplat_lz.cpp
+A small, fast compressor for the blocks of compressed .qs fragments.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <string.h>
+#include "qsplat_lz.h"
+#include <vector>
+
+
+// Matches are found through a hash table of the last place each 4-byte
+// string was seen
+#define HASH_BITS 13
+#define HASH_SIZE (1 << HASH_BITS)
+#define MAX_OFFSET 65535
+
+// Ways of compressing a block
+#define METHOD_STORED 0
+#define METHOD_LZ 1
+#define METHOD_LZ_HUFFMAN 2
+#define METHOD_PAIRED_HUFFMAN 3
+#define HUFFMAN_HEADER(ntables) (128 * (ntables) + 4)
+
+
+static inline unsigned read4(const unsigned char *p)
+{
+	return unsigned(p[0]) | (unsigned(p[1]) << 8) |
+	       (unsigned(p[2]) << 16) | (unsigned(p[3]) << 24);
+}
+
+static inline unsigned hash4(const unsigned char *p)
+{
+	return (read4(p) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+
+// Write the rest of a length that didn't fit in its 4 bits
+static inline unsigned char *put_length(unsigned char *out, int n)
+{
+	while (n >= 255) {
+		*out++ = 255;
+		n -= 255;
+	}
+	*out++ = (unsigned char) n;
+	return out;
+}
+
+
+// Write a sequence: nlit literals, then (if matchlen isn't 0) a match
+static inline unsigned char *put_sequence(unsigned char *out,
+					  const unsigned char *lit, int nlit,
+					  int offset, int matchlen)
+{
+	unsigned char *token = out++;
+	*token = (unsigned char) ((nlit < 15 ? nlit : 15) << 4);
+	if (nlit >= 15)
+		out = put_length(out, nlit - 15);
+	memcpy(out, lit, nlit);
+	out += nlit;
+	if (!matchlen)
+		return out;
+
+	*out++ = (unsigned char) (offset & 0xff);
+	*out++ = (unsigned char) (offset >> 8);
+	int m = matchlen - QSPLAT_LZ_MINMATCH;
+	*token |= (unsigned char) (m < 15 ? m : 15);
+	if (m >= 15)
+		out = put_length(out, m - 15);
+	return out;
+}
+
+
+// LZ77-compress len bytes from in to out.  This is greedy: at each position
+// we take whatever match the hash table gives us, if it checks out.
+static int lz_compress(const unsigned char *in, int len, unsigned char *out)
+{
+	int table[HASH_SIZE];
+	for (int i = 0; i < HASH_SIZE; i++)
+		table[i] = -1;
+
+	unsigned char *start = out;
+	int anchor = 0;		// First byte not yet written
+	int i = 0;
+	while (i + QSPLAT_LZ_MINMATCH <= len) {
+		unsigned h = hash4(in + i);
+		int candidate = table[h];
+		table[h] = i;
+		if (candidate < 0 || i - candidate > MAX_OFFSET ||
+		    read4(in + candidate) != read4(in + i)) {
+			i++;
+			continue;
+		}
+
+		// The first QSPLAT_LZ_MINMATCH bytes were checked above
+		int matchlen = QSPLAT_LZ_MINMATCH;
+		while (i + matchlen < len &&
+		       in[candidate + matchlen] == in[i + matchlen])
+			matchlen++;
+		out = put_sequence(out, in + anchor, i - anchor,
+				   i - candidate, matchlen);
+		i += matchlen;
+		anchor = i;
+	}
+
+	out = put_sequence(out, in + anchor, len - anchor, 0, 0);
+	return out - start;
+}
+
+
+// Read the rest of a length that didn't fit in its 4 bits
+static inline bool get_length(const unsigned char *&in,
+			      const unsigned char *end, int &n)
+{
+	unsigned char b;
+	do {
+		if (in == end)
+			return false;
+		b = *in++;
+		n += b;
+	} while (b == 255);
+	return true;
+}
+
+
+// Undo lz_compress()
+static bool lz_decompress(const unsigned char *in, int inlen,
+			  unsigned char *out, int outlen)
+{
+	const unsigned char *end = in + inlen;
+	unsigned char *o = out, *oend = out + outlen;
+	while (in < end) {
+		unsigned token = *in++;
+		int nlit = token >> 4;
+		if (nlit == 15 && !get_length(in, end, nlit))
+			return false;
+		if (nlit > end - in || nlit > oend - o)
+			return false;
+		memcpy(o, in, nlit);
+		in += nlit;
+		o += nlit;
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return false;
+		int offset = in[0] | (in[1] << 8);
+		in += 2;
+		int matchlen = token & 15;
+		if (matchlen == 15 && !get_length(in, end, matchlen))
+			return false;
+		matchlen += QSPLAT_LZ_MINMATCH;
+		if (!offset || offset > o - out || matchlen > oend - o)
+			return false;
+
+		// The match can overlap what it's making, so this goes a
+		// byte at a time
+		const unsigned char *from = o - offset;
+		for (int j = 0; j < matchlen; j++)
+			o[j] = from[j];
+		o += matchlen;
+	}
+	return o == oend;
+}
+
+
+// Work out the lengths of the Huffman codes for bytes with the given
+// frequencies.  If the longest code comes out longer than
+// QSPLAT_LZ_MAXCODE, the frequencies are flattened and we try again.
+static void huffman_lengths(const int *freq, unsigned char *codelen)
+{
+	int f[512], parent[512];
+	int nsyms = 0;
+	for (int i = 0; i < 256; i++) {
+		codelen[i] = 0;
+		if (freq[i])
+			nsyms++;
+	}
+	if (nsyms == 1) {
+		for (int i = 0; i < 256; i++)
+			if (freq[i])
+				codelen[i] = 1;
+		return;
+	}
+	if (!nsyms)
+		return;
+
+	for (int i = 0; i < 256; i++)
+		f[i] = freq[i];
+	for (;;) {
+		// Repeatedly join the two least frequent trees
+		int n = 256;
+		bool active[512];
+		for (int i = 0; i < 256; i++)
+			active[i] = (f[i] != 0);
+		for (int k = 1; k < nsyms; k++) {
+			int a = -1, b = -1;
+			for (int i = 0; i < n; i++) {
+				if (!active[i])
+					continue;
+				if (a < 0 || f[i] < f[a]) {
+					b = a;
+					a = i;
+				} else if (b < 0 || f[i] < f[b]) {
+					b = i;
+				}
+			}
+			f[n] = f[a] + f[b];
+			active[a] = active[b] = false;
+			active[n] = true;
+			parent[a] = parent[b] = n;
+			n++;
+		}
+
+		int maxlen = 0;
+		for (int i = 0; i < 256; i++) {
+			if (!f[i])
+				continue;
+			int l = 0;
+			for (int j = i; j != n - 1; j = parent[j])
+				l++;
+			codelen[i] = l;
+			if (l > maxlen)
+				maxlen = l;
+		}
+		if (maxlen <= QSPLAT_LZ_MAXCODE)
+			return;
+		for (int i = 0; i < 256; i++)
+			if (f[i])
+				f[i] = (f[i] >> 1) | 1;
+	}
+}
+
+
+// Make canonical codes from their lengths, with the bits reversed since
+// they're packed starting from the low bit.  Returns false if the lengths
+// don't make sense.
+static bool huffman_codes(const unsigned char *codelen, unsigned *code)
+{
+	int count[QSPLAT_LZ_MAXCODE + 1], next[QSPLAT_LZ_MAXCODE + 1];
+	for (int l = 0; l <= QSPLAT_LZ_MAXCODE; l++)
+		count[l] = 0;
+	for (int i = 0; i < 256; i++) {
+		if (codelen[i] > QSPLAT_LZ_MAXCODE)
+			return false;
+		count[codelen[i]]++;
+	}
+	count[0] = 0;
+
+	// Kraft inequality: the codes can't overflow the code space
+	int space = 1 << QSPLAT_LZ_MAXCODE, used = 0;
+	for (int l = 1; l <= QSPLAT_LZ_MAXCODE; l++)
+		used += count[l] << (QSPLAT_LZ_MAXCODE - l);
+	if (used > space)
+		return false;
+
+	int c = 0;
+	for (int l = 1; l <= QSPLAT_LZ_MAXCODE; l++) {
+		c = (c + count[l-1]) << 1;
+		next[l] = c;
+	}
+	for (int i = 0; i < 256; i++) {
+		int l = codelen[i];
+		if (!l)
+			continue;
+		unsigned v = next[l]++, r = 0;
+		for (int j = 0; j < l; j++, v >>= 1)
+			r = (r << 1) | (v & 1);
+		code[i] = r;
+	}
+	return true;
+}
+
+// Huffman-code len bytes from in to out, using table i % ntables for
+// byte i.  Returns the size of the header and codes.
+static int huffman_compress(const unsigned char *in, int len, int ntables,
+			    const unsigned char (*codelen)[256],
+			    unsigned char *out)
+{
+	unsigned code[2][256];
+	for (int t = 0; t < ntables; t++) {
+		huffman_codes(codelen[t], code[t]);
+		for (int i = 0; i < 128; i++)
+			*out++ = codelen[t][2*i] | (codelen[t][2*i+1] << 4);
+	}
+	*out++ = len & 0xff;
+	*out++ = (len >> 8) & 0xff;
+	*out++ = (len >> 16) & 0xff;
+	*out++ = (len >> 24) & 0xff;
+
+	unsigned char *o = out;
+	unsigned long long bits = 0;
+	int nbits = 0;
+	for (int i = 0; i < len; i++) {
+		int t = i % ntables;
+		bits |= (unsigned long long) code[t][in[i]] << nbits;
+		nbits += codelen[t][in[i]];
+		while (nbits >= 8) {
+			*o++ = (unsigned char) (bits & 0xff);
+			bits >>= 8;
+			nbits -= 8;
+		}
+	}
+	if (nbits)
+		*o++ = (unsigned char) bits;
+	return o - out + HUFFMAN_HEADER(ntables);
+}
+
+
+// Undo huffman_compress()
+static bool huffman_decompress(const unsigned char *in, int inlen, int ntables,
+			       std::vector<unsigned char> &out)
+{
+	if (inlen < HUFFMAN_HEADER(ntables))
+		return false;
+
+	// Every string of QSPLAT_LZ_MAXCODE bits starts with exactly one
+	// code, so a table says which byte it is and how long it is
+	static const int TABLESIZE = 1 << QSPLAT_LZ_MAXCODE;
+	std::vector<unsigned short> table(ntables * TABLESIZE);
+	for (int t = 0; t < ntables; t++) {
+		unsigned char codelen[256];
+		for (int i = 0; i < 128; i++) {
+			codelen[2*i] = in[128*t+i] & 15;
+			codelen[2*i+1] = in[128*t+i] >> 4;
+		}
+		unsigned code[256];
+		if (!huffman_codes(codelen, code))
+			return false;
+		for (int i = 0; i < 256; i++) {
+			int l = codelen[i];
+			if (!l)
+				continue;
+			for (unsigned j = code[i]; j < TABLESIZE; j += 1u << l)
+				table[t*TABLESIZE+j] = (unsigned short) (i | (l << 8));
+		}
+	}
+	const unsigned char *p = in + 128 * ntables;
+	int len = int(unsigned(p[0]) | (unsigned(p[1]) << 8) |
+		      (unsigned(p[2]) << 16) | (unsigned(p[3]) << 24));
+	if (len < 0 || len > QSPLAT_LZ_BOUND(8 * inlen))
+		return false;
+
+	out.resize(len);
+	p += 4;
+	const unsigned char *end = in + inlen;
+	unsigned long long bits = 0;
+	int nbits = 0;
+	long long bitsleft = 8LL * (end - p);
+	for (int i = 0; i < len; i++) {
+		while (nbits <= 56) {
+			if (p < end)
+				bits |= (unsigned long long) *p++ << nbits;
+			nbits += 8;
+		}
+		unsigned t = table[(i % ntables) * TABLESIZE +
+				   (bits & (TABLESIZE - 1))];
+		int l = t >> 8;
+		if (!l || (bitsleft -= l) < 0)
+			return false;
+		out[i] = (unsigned char) (t & 0xff);
+		bits >>= l;
+		nbits -= l;
+	}
+	return true;
+}
+
+
+// Work out the Huffman codes for len bytes from in, using table i % ntables
+// for byte i.  Returns the size huffman_compress() will come out to.
+static long long huffman_plan(const unsigned char *in, int len, int ntables,
+			      unsigned char (*codelen)[256])
+{
+	long long bits = 0;
+	for (int t = 0; t < ntables; t++) {
+		int freq[256];
+		memset(freq, 0, sizeof(freq));
+		for (int i = t; i < len; i += ntables)
+			freq[in[i]]++;
+		huffman_lengths(freq, codelen[t]);
+		for (int i = 0; i < 256; i++)
+			bits += (long long) freq[i] * codelen[t][i];
+	}
+	return HUFFMAN_HEADER(ntables) + (bits + 7) / 8;
+}
+
+
+// Compress len bytes from in to out, whichever way comes out smallest
+int qsplat_lz_compress(const unsigned char *in, int len, unsigned char *out)
+{
+	std::vector<unsigned char> lz(QSPLAT_LZ_BOUND(len));
+	int lzlen = lz_compress(in, len, &lz[0]);
+
+	unsigned char lzcodelen[1][256], pairedcodelen[2][256];
+	long long lzhufflen = huffman_plan(&lz[0], lzlen, 1, lzcodelen);
+	long long pairedlen = huffman_plan(in, len, 2, pairedcodelen);
+
+	long long best = len;
+	int method = METHOD_STORED;
+	if (lzlen < best)
+		best = lzlen, method = METHOD_LZ;
+	if (lzhufflen < best)
+		best = lzhufflen, method = METHOD_LZ_HUFFMAN;
+	if (pairedlen < best)
+		best = pairedlen, method = METHOD_PAIRED_HUFFMAN;
+
+	out[0] = method;
+	switch (method) {
+		case METHOD_LZ:
+			memcpy(out + 1, &lz[0], lzlen);
+			return 1 + lzlen;
+		case METHOD_LZ_HUFFMAN:
+			return 1 + huffman_compress(&lz[0], lzlen, 1,
+						    lzcodelen, out + 1);
+		case METHOD_PAIRED_HUFFMAN:
+			return 1 + huffman_compress(in, len, 2,
+						    pairedcodelen, out + 1);
+		default:
+			memcpy(out + 1, in, len);
+			return 1 + len;
+	}
+}
+
+
+// Decompress inlen bytes from in to out
+bool qsplat_lz_decompress(const unsigned char *in, int inlen,
+			  unsigned char *out, int outlen)
+{
+	if (inlen < 1)
+		return false;
+	std::vector<unsigned char> tmp;
+	switch (in[0]) {
+		case METHOD_STORED:
+			if (inlen - 1 != outlen)
+				return false;
+			memcpy(out, in + 1, outlen);
+			return true;
+		case METHOD_LZ:
+			return lz_decompress(in + 1, inlen - 1, out, outlen);
+		case METHOD_LZ_HUFFMAN:
+			if (!huffman_decompress(in + 1, inlen - 1, 1, tmp))
+				return false;
+			return lz_decompress(&tmp[0], tmp.size(), out, outlen);
+		case METHOD_PAIRED_HUFFMAN:
+			if (!huffman_decompress(in + 1, inlen - 1, 2, tmp) ||
+			    int(tmp.size()) != outlen)
+				return false;
+			memcpy(out, &tmp[0], outlen);
+			return true;
+		default:
+			return false;
+	}
+}
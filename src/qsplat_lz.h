@@ -0,0 +1,65 @@
+#ifndef QSPLAT_LZ_H
+#define QSPLAT_LZ_H
+/*
+qsplat_lz.h
+A small, fast compressor for the blocks of compressed .qs fragments.
+
+Compressed data starts with a byte saying how it was compressed:
+
+	0	Not at all: the rest is the data as it is
+	1	LZ77 (see below)
+	2	LZ77, followed by Huffman coding of the bytes that makes.
+		There are 128 bytes holding the lengths of the codes of all
+		256 bytes (4 bits each, low nibble first, 0 if the byte never
+		appears), then the length of the LZ77 data (4 bytes,
+		little-endian), then the codes, packed starting from the low
+		bit of each byte.  Codes are canonical, and at most
+		QSPLAT_LZ_MAXCODE bits long.
+	3	Huffman coding of the data itself, with one set of codes for
+		the even bytes and another for the odd ones.  This is laid out
+		like method 2, but there are two sets of 128 bytes of code
+		lengths (even bytes first), and no LZ77.
+
+The LZ77 data is a series of sequences, each of which is a token byte, some
+literal bytes, and then a match that copies bytes from earlier in the
+output:
+
+	 7 6 5 4 3 2 1 0
+	+-------+-------+
+	|   L   |   M   |  [more L]  literals...  offset (2 bytes)  [more M]
+	+-------+-------+
+
+L is the number of literals and M is the length of the match minus
+QSPLAT_LZ_MINMATCH.  If either is 15, it is continued in following bytes,
+each of which is added on, until one is less than 255.  The offset of the
+match (how far back it starts) is little-endian.  The last sequence has
+only literals, and no offset or match.
+
+Quantized nodes don't have many long repeats in them, so most of what we
+save comes from the Huffman codes.  Nodes are made of 16-bit words, and the
+high and low bytes of a word look nothing alike, which is what method 3 is
+for; the LZ77 methods win on blocks with long runs of similar nodes.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+
+#define QSPLAT_LZ_MINMATCH 4
+#define QSPLAT_LZ_MAXCODE 12
+
+// The most that len bytes can turn into when compressed
+#define QSPLAT_LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Compress len bytes from in to out, which must have room for
+// QSPLAT_LZ_BOUND(len) bytes, using whichever method comes out smallest.
+// Returns the compressed size.
+extern int qsplat_lz_compress(const unsigned char *in, int len,
+			      unsigned char *out);
+
+// Decompress inlen bytes from in, which must come out to exactly outlen
+// bytes.  Returns false if the data is corrupt.
+extern bool qsplat_lz_decompress(const unsigned char *in, int inlen,
+				 unsigned char *out, int outlen);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+qsplat_make_convert.cpp
+Rewriting existing .qs files with their nodes in a different byte order.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "qsplat_util.h"
+#include "qsplat_make_qtree_v11.h"
+#include "qsplat_make_convert.h"
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
+
+
+// Size of the buffer for reading the input
+#define INBUF_SIZE (4 << 20)
+
+
+// Is this a .qs file (as opposed to a .ply file)?
+bool is_qs_file(const char *filename)
+{
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	char magic[6];
+	bool qs = fread((void *)magic, 6, 1, f) &&
+		  !strncmp(magic, QSPLAT_MAGIC, 6);
+	fclose(f);
+	return qs;
+}
+
+
+// Copy len bytes from in to out
+static bool copy_bytes(FILE *in, FILE *out, long long len)
+{
+	unsigned char buf[65536];
+	while (len > 0) {
+		size_t n = (size_t) min(len, (long long) sizeof(buf));
+		if (!fread((void *)buf, n, 1, in) ||
+		    !fwrite((void *)buf, n, 1, out))
+			return false;
+		len -= n;
+	}
+	return true;
+}
+
+
+// A group of siblings we know about but haven't gotten to yet: where it is
+// in the tree, and the number of nodes in it (minus one), ORed with 4 if it
+// starts with a child offset
+typedef std::pair<long long, unsigned char> PendingGroup;
+
+
+// Rewrite the tree of one fragment, which is treelen bytes long (including
+// the padding at the end).  The groups of siblings always come after their
+// parents, whether they're in breadth-first or van Emde Boas order, so this
+// can be done in one pass: each group we read tells us where its children's
+// groups are, and the next group in the file is the first of those.
+static bool convert_tree(FILE *in, FILE *out, long long treelen,
+			 int numchildren, int nodesize, bool wide,
+			 bool fromlittle, bool tolittle)
+{
+	// The top-level group always starts with an offset
+	std::priority_queue< PendingGroup, std::vector<PendingGroup>,
+			     std::greater<PendingGroup> > groups;
+	if (numchildren > 0)
+		groups.push(PendingGroup(0, (numchildren - 1) | 4));
+
+	int offsetsize = wide ? 8 : 4;
+	int flagsbyte = fromlittle ? 0 : 1;
+	long long pos = 0;
+	unsigned char buf[8 + 4*6];
+	while (!groups.empty()) {
+		if (groups.top().first != pos)
+			return false;
+		unsigned char desc = groups.top().second;
+		groups.pop();
+		int groupsize = ((desc & 3) + 1) * nodesize;
+		int bytes = groupsize + ((desc & 4) ? offsetsize : 0);
+		if (bytes > treelen - pos || !fread((void *)buf, bytes, 1, in))
+			return false;
+
+		unsigned char *nodes = buf;
+		long long there = pos;
+		if (desc & 4) {
+			there += get_offset(buf, offsetsize, fromlittle);
+			if (fromlittle != tolittle)
+				std::reverse(buf, buf + offsetsize);
+			nodes += offsetsize;
+		}
+		for (int i = 0; i < groupsize; i += nodesize) {
+			unsigned char flags = nodes[i + flagsbyte];
+			if (!(flags & 3))
+				continue;
+			groups.push(PendingGroup(there, flags & 7));
+			there += ((flags & 3) + 1) * nodesize +
+				 ((flags & 4) ? offsetsize : 0);
+		}
+		if (fromlittle != tolittle)
+			swap_words(nodes, groupsize);
+		fwrite((void *)buf, bytes, 1, out);
+		pos += bytes;
+	}
+
+	// Whatever is left is padding
+	return copy_bytes(in, out, treelen - pos);
+}
+
+
+// Copy a .qs file, rewriting the tree of every fragment with little-endian
+// or big-endian nodes
+bool convert_qs_file(const char *infilename, const char *outfilename,
+		     bool little)
+{
+	FILE *in = fopen(infilename, "rb");
+	if (!in) {
+		fprintf(stderr, "Couldn't open %s\n", infilename);
+		return false;
+	}
+	setvbuf(in, NULL, _IOFBF, INBUF_SIZE);
+	std::string tmpname;
+	FILE *out = QTree::OpenOutput(outfilename, tmpname);
+	if (!out) {
+		fclose(in);
+		return false;
+	}
+	printf("Converting to %s-endian nodes... ", little ? "little" : "big");
+	fflush(stdout);
+
+	const char *error = NULL;
+	int fragments = 0;
+	unsigned char hdr[48];
+	while (!error && fread((void *)hdr, 8, 1, in)) {
+		if (strncmp((const char *)hdr, QSPLAT_MAGIC, 6)) {
+			error = "isn't a .qs file";
+			break;
+		}
+		int version = (hdr[6] - '0') * 10 + (hdr[7] - '0');
+		bool copy = (version == QSPLAT_FILE_VERSION_SIMD ||
+			     version == QSPLAT_FILE_VERSION_COMPRESSED);
+		bool wide = (version == QSPLAT_FILE_VERSION_WIDE || copy);
+		if (!wide && version != QSPLAT_FILE_VERSION) {
+			error = "has a version this doesn't know about";
+			break;
+		}
+
+		// Length and options.  Comments and indices don't have
+		// nodes, so they're copied as they are, and so are version
+		// 13 fragments, whose nodes are always little-endian, and
+		// version 14 fragments, whose nodes are compressed.
+		int headerlen = wide ? 28 : 20;
+		if (!fread((void *)(hdr+8), headerlen-8, 1, in)) {
+			error = "is truncated";
+			break;
+		}
+		long long fraglen;
+		if (wide) {
+			fraglen = * (long long *)(hdr+8);  FIX_LONGLONG(fraglen);
+		} else {
+			int len = * (int *)(hdr+8);  FIX_LONG(len);
+			fraglen = len;
+		}
+		int options = * (int *)(hdr+headerlen-4);  FIX_LONG(options);
+		if ((options & (QSPLAT_OPT_COMMENTS | QSPLAT_OPT_INDEX)) ||
+		    copy) {
+			if (fraglen < headerlen ||
+			    !fwrite((void *)hdr, headerlen, 1, out) ||
+			    !copy_bytes(in, out, fraglen - headerlen))
+				error = "is truncated";
+			if (copy)
+				fragments++;
+			continue;
+		}
+
+		// The rest of the header is the root sphere and the number of
+		// children of the root
+		if (fraglen < headerlen + 20 ||
+		    !fread((void *)(hdr+headerlen), 20, 1, in)) {
+			error = "is truncated";
+			break;
+		}
+		int numchildren = * (int *)(hdr+headerlen+16);
+		FIX_LONG(numchildren);
+		int nodesize = (options & QSPLAT_OPT_COLOR) ? 6 : 4;
+		bool fromlittle = !!(options & QSPLAT_OPT_LITTLE_ENDIAN);
+		if (little)
+			options |= QSPLAT_OPT_LITTLE_ENDIAN;
+		else
+			options &= ~QSPLAT_OPT_LITTLE_ENDIAN;
+		FIX_LONG(options);
+		memcpy(hdr+headerlen-4, &options, 4);
+		fwrite((void *)hdr, headerlen+20, 1, out);
+
+		if (!convert_tree(in, out, fraglen - headerlen - 20,
+				  numchildren, nodesize, wide,
+				  fromlittle, little))
+			error = "is truncated or corrupt";
+		fragments++;
+	}
+
+	if (!error && !fragments)
+		error = "has no fragments";
+	if (error || ferror(in)) {
+		fprintf(stderr, "\n%s %s\n", infilename,
+			error ? error : "couldn't be read");
+		fclose(in);
+		fclose(out);
+		remove(tmpname.c_str());
+		return false;
+	}
+	fclose(in);
+	if (!QTree::CloseOutput(out, outfilename, tmpname))
+		return false;
+	printf("Done.\n");
+	return true;
+}
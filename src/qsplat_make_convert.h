@@ -0,0 +1,21 @@
+#ifndef QSPLAT_MAKE_CONVERT_H
+#define QSPLAT_MAKE_CONVERT_H
+/*
+qsplat_make_convert.h
+Rewriting existing .qs files with their nodes in a different byte order.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+
+// Is this a .qs file (as opposed to a .ply file)?
+extern bool is_qs_file(const char *filename);
+
+// Copy a .qs file, rewriting the tree of every fragment with little-endian
+// or big-endian nodes.  Since this doesn't change the size of anything,
+// comments, indices and version 13 and 14 fragments are copied as they are.
+extern bool convert_qs_file(const char *infilename, const char *outfilename,
+			    bool little);
+
+#endif
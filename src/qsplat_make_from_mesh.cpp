@@ -3,267 +3,122 @@ Szymon Rusinkiewicz
 
 qsplat_make_from_mesh.cpp
 
-Code for reading in a triangle mesh from a ply file and initializing the
-QSplat data structure.
-
-This does not read and write general .ply files - only a very restricted
-subset.  In particular, only binary big-endian ply files with just vertices
-and faces or tstrips are supported.
+Code for initializing the QSplat data structure from a triangle mesh.
+The .ply reader is in qsplat_make_ply.cpp.
 
 Copyright (c) 1999-2000 The Board of Trustees of the
 Leland Stanford Junior University.  All Rights Reserved.
 */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <float.h>
 #include <vector>
+#include <atomic>
+#include <algorithm>
 #include "qsplat_make_from_mesh.h"
+#include "qsplat_make_outofcore.h"
+#include "qsplat_threads.h"
 
 #define BIGNUM FLT_MAX
 
+// Faces and vertices are handed out to threads in pieces at least this big
+#define GRAIN 65536
+
+
+// Whether reading and preparing meshes prints what it's doing
+bool qsplat_make_verbose = true;
 
-// Unpack tstrips into faces
-static void unpack_tstrips(int tstripdatalen, const int *tstrips,
-			   int &numfaces, face * &faces)
+void progress(const char *fmt, ...)
 {
-	int i;
-	if (!tstrips || tstripdatalen < 4)
+	if (!qsplat_make_verbose)
 		return;
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	fflush(stdout);
+}
 
-	printf("Unpacking triangle strips... "); fflush(stdout);
 
-	// Count number of faces
-	numfaces = 0;
-	int this_tstrip_len = 0;
-	for (i=0; i < tstripdatalen; i++) {
-		if (tstrips[i] == -1) {
-			this_tstrip_len = 0;
-			continue;
-		}
-		this_tstrip_len++;
-		if (this_tstrip_len >= 3)
-			numfaces++;
-	}
-	printf("%d triangles... ", numfaces); fflush(stdout);
+// For each vertex, the faces that touch it, in increasing order.  The faces
+// touching vertex i are facelist[start[i]] .. facelist[start[i+1]-1].
+// This lets us gather per-face values into each vertex in parallel, in the
+// same order the serial code would have added them up.
+struct VertexFaces {
+	int numleaves, numfaces;
+	const face *faces;
+	size_t *start;
+	int *facelist;
+	std::atomic<int> *count;
+};
 
-	faces = new face[numfaces];
 
-	int whichface = 0;
-	this_tstrip_len = 0;
-	for (i=0; i < tstripdatalen; i++) {
-		if (tstrips[i] == -1) {
-			this_tstrip_len = 0;
-			continue;
-		}
-		this_tstrip_len++;
-		if (this_tstrip_len < 3)
-			continue;
-		if (this_tstrip_len % 2) {
-			faces[whichface][0] = tstrips[i-2];
-			faces[whichface][1] = tstrips[i-1];
-		} else {
-			faces[whichface][0] = tstrips[i-1];
-			faces[whichface][1] = tstrips[i-2];
-		}
-		faces[whichface++][2] = tstrips[i];
-	}
-
-	printf("Done.\n");
+// Count the faces touching each vertex
+static void count_vertex_faces(void *arg, int begin, int end)
+{
+	VertexFaces *vf = (VertexFaces *) arg;
+	for (int i = begin; i < end; i++)
+		for (int j = 0; j < 3; j++)
+			vf->count[vf->faces[i][j]].fetch_add(1, std::memory_order_relaxed);
 }
 
-
-// Try to read a plyfile, returning vertices and faces
-bool read_ply(const char *plyfile,
-	      int &numleaves, QTree_Node * &leaves,
-	      int &numfaces, face * &faces,
-	      bool &have_colors,
-	      std::string &comments)
+// Put each face in the lists of its vertices
+static void fill_vertex_faces(void *arg, int begin, int end)
 {
-	bool have_faces=false, have_tstrips=false;
-	int tstripdatalen=0, *tstripdata = NULL;
-	int other_prop_len, color_offset;
-	char buf[255];
-	int i, result;
-
-	have_colors = false;  numleaves = numfaces = 0;
-	leaves = NULL;  faces = NULL;
-
-	FILE *f = fopen(plyfile, "r");
-	if (!f) {
-		fprintf(stderr, "Can't open plyfile %s\n", plyfile);
-		return false;
-	}
-	printf("Reading %s...\n", plyfile);
-
-
-	// Read header
-	if (!fgets(buf, 255, f) || strncmp(buf, "ply", 3)) {
-		fprintf(stderr, "Not a ply file.\n");
-		return false;
-	}
-
-#define GET_LINE() if (!fgets(buf, 255, f)) goto plyreaderror
-#define LINE_IS(text) !strncasecmp(buf, text, strlen(text))
-
-	GET_LINE();
-	if (!LINE_IS("format binary_big_endian 1.0")) {
-		fprintf(stderr, "Can only read binary big-endian ply files.\n");
-		return false;
-	}
-
-	while (1) {
-		GET_LINE();
-		if (LINE_IS("obj_info")) {
-			continue;
-		} else if (LINE_IS("comment")) {
-			comments += buf+8;
-			continue;
-		} else {
-			break;
-		}
-	}
-
-	result = sscanf(buf, "element vertex %d\n", &numleaves);
-	if (result != 1) {
-		fprintf(stderr, "Expected \"element vertex\"\n");
-		goto plyreaderror;
-	}
-
-	GET_LINE();
-	if (!LINE_IS("property float x")) {
-		fprintf(stderr, "Expected \"property float x\"\n");
-		goto plyreaderror;
-	}
-
-	GET_LINE();
-	if (!LINE_IS("property float y")) {
-		fprintf(stderr, "Expected \"property float y\"\n");
-		goto plyreaderror;
-	}
-
-	GET_LINE();
-	if (!LINE_IS("property float z")) {
-		fprintf(stderr, "Expected \"property float z\"\n");
-		goto plyreaderror;
-	}
-
-	other_prop_len = 0;
-	GET_LINE();
-	while (LINE_IS("property")) {
-		if (LINE_IS("property char") ||
-		    LINE_IS("property uchar")) {
-			other_prop_len += 1;
-		} else if (LINE_IS("property int") ||
-			   LINE_IS("property uint") ||
-			   LINE_IS("property float")) {
-			other_prop_len += 4;
-		} else {
-			fprintf(stderr, "Unsupported vertex property: %s\n", buf);
-			goto plyreaderror;
-		}
-
-		if (LINE_IS("property uchar diffuse_red")) {
-			have_colors = true;
-			color_offset = other_prop_len - 1;
+	VertexFaces *vf = (VertexFaces *) arg;
+	for (int i = begin; i < end; i++) {
+		for (int j = 0; j < 3; j++) {
+			int v = vf->faces[i][j];
+			int k = vf->count[v].fetch_add(1, std::memory_order_relaxed);
+			vf->facelist[vf->start[v] + k] = i;
 		}
-
-		GET_LINE();
-	}
-
-
-	result = sscanf(buf, "element face %d", &numfaces);
-	if (result == 1) {
-		have_faces = true;
-		GET_LINE();
-		if (!LINE_IS("property list uchar int vertex_indices"))
-			goto plyreaderror;
-		GET_LINE();
-	} else if (LINE_IS("element tristrips 1")) {
-		have_tstrips = true;
-		GET_LINE();
-		if (!LINE_IS("property list int int vertex_indices"))
-			goto plyreaderror;
-		GET_LINE();
-	}
-
-	if (!LINE_IS("end_header")) {
-		fprintf(stderr, "Expected \"end_header\"\n");
-		goto plyreaderror;
 	}
+}
 
-
-	// OK, we think we've parsed the header. Slurp in the actual data...
-	leaves = new QTree_Node[numleaves];
-
-	printf(" Reading %d vertices... ", numleaves); fflush(stdout);
-	for (i=0; i < numleaves; i++) {
-		if (!fread((void *)&(leaves[i].pos[0]), 12, 1, f))
-			goto plyreaderror;
-		FIX_FLOAT(leaves[i].pos[0]);
-		FIX_FLOAT(leaves[i].pos[1]);
-		FIX_FLOAT(leaves[i].pos[2]);
-
-		if (other_prop_len && !fread((void *)buf, other_prop_len, 1, f))
-			goto plyreaderror;
-
-		if (have_colors) {
-			memcpy((void *)&(leaves[i].col[0]),
-			       buf + color_offset,
-			       sizeof(color));
-		}
-	}
-	printf("Done.\n");
-
-	if (have_tstrips) {
-		printf(" Reading triangle strips... "); fflush(stdout);
-
-		if (!fread((void *)&tstripdatalen, 4, 1, f))
-			goto plyreaderror;
-		FIX_LONG(tstripdatalen);
-
-		tstripdata = new int[tstripdatalen];
-		if (!fread((void *)tstripdata, 4*tstripdatalen, 1, f))
-			goto plyreaderror;
-		for (int t=0; t < tstripdatalen; t++)
-			FIX_LONG(tstripdata[t]);
-	} else if (have_faces) {
-		printf(" Reading %d faces... ", numfaces); fflush(stdout);
-		faces = new face[numfaces];
-		for (i=0; i < numfaces; i++) {
-			if (!fread((void *)buf, 1, 1, f))
-				goto plyreaderror;
-			if (buf[0] != 3) {
-				fprintf(stderr, "Non-triangle found in mesh.\n");
-			}
-			if (!fread((void *)faces[i], 12, 1, f))
-				goto plyreaderror;
-			FIX_LONG(faces[i][0]);
-			FIX_LONG(faces[i][1]);
-			FIX_LONG(faces[i][2]);
-		}
-	}
-	printf("Done.\n");
-	if (tstripdatalen) {
-		unpack_tstrips(tstripdatalen, tstripdata, numfaces, faces);
-		delete [] tstripdata;
+// The threads put faces in the lists in random order, so sort them
+static void sort_vertex_faces(void *arg, int begin, int end)
+{
+	VertexFaces *vf = (VertexFaces *) arg;
+	for (int v = begin; v < end; v++) {
+		int *list = vf->facelist + vf->start[v];
+		int n = vf->start[v+1] - vf->start[v];
+		std::sort(list, list + n);
 	}
+}
 
-	fgets(buf, 2, f);
-	if (!feof(f)) {
-		fprintf(stderr, "Warning: ignored excess garbage at end of ply file.\n");
+static void build_vertex_faces(int numleaves, int numfaces, const face *faces,
+			       VertexFaces &vf)
+{
+	vf.numleaves = numleaves;
+	vf.numfaces = numfaces;
+	vf.faces = faces;
+	vf.start = OOC_New<size_t>(numleaves + 1);
+	vf.facelist = OOC_New<int>(3 * (size_t) numfaces);
+	vf.count = new std::atomic<int>[numleaves];
+	for (int i = 0; i < numleaves; i++)
+		vf.count[i] = 0;
+
+	QSplat_TaskPool::ParallelFor(0, numfaces, GRAIN, count_vertex_faces, &vf);
+	size_t total = 0;
+	for (int i = 0; i < numleaves; i++) {
+		vf.start[i] = total;
+		total += vf.count[i];
+		vf.count[i] = 0;
 	}
+	vf.start[numleaves] = total;
+	QSplat_TaskPool::ParallelFor(0, numfaces, GRAIN, fill_vertex_faces, &vf);
+	QSplat_TaskPool::ParallelFor(0, numleaves, GRAIN, sort_vertex_faces, &vf);
 
-	fclose(f);
-	return true;
+	delete [] vf.count;
+	vf.count = NULL;
+}
 
-plyreaderror:
-	fclose(f);
-	fprintf(stderr, "Error reading plyfile.\n");
-	if (leaves) delete [] leaves;
-	if (faces) delete [] faces;
-	if (tstripdata) delete [] tstripdata;
-	return false;
+static void free_vertex_faces(VertexFaces &vf)
+{
+	OOC_Delete(vf.start, vf.numleaves + 1);
+	OOC_Delete(vf.facelist, 3 * (size_t) vf.numfaces);
 }
 
 
@@ -278,12 +133,62 @@ static inline void FindNormal(const point &p1, const point &p2,
 }
 
 
+// State for computing normals in parallel
+struct NormalsTask {
+	QTree_Node *leaves;
+	const face *faces;
+	vec *facenormals;
+	VertexFaces *vf;
+};
+
+static void find_face_normals(void *arg, int begin, int end)
+{
+	NormalsTask *t = (NormalsTask *) arg;
+	for (int i = begin; i < end; i++)
+		FindNormal(t->leaves[t->faces[i][0]].pos,
+			   t->leaves[t->faces[i][1]].pos,
+			   t->leaves[t->faces[i][2]].pos,
+			   t->facenormals[i]);
+}
+
+static void sum_face_normals(void *arg, int begin, int end)
+{
+	NormalsTask *t = (NormalsTask *) arg;
+	for (int i = begin; i < end; i++) {
+		vec &n = t->leaves[i].norm;
+		n[0] = n[1] = n[2] = 0.0f;
+		for (size_t j = t->vf->start[i]; j < t->vf->start[i+1]; j++) {
+			const vec &facenormal = t->facenormals[t->vf->facelist[j]];
+			n[0] += facenormal[0];
+			n[1] += facenormal[1];
+			n[2] += facenormal[2];
+		}
+	}
+}
+
+
 // Find per-vertex normals
 void find_normals(int numleaves, QTree_Node *leaves,
 		  int numfaces, const face *faces)
 {
 	int i;
-	printf("Computing normals... "); fflush(stdout);
+	progress("Computing normals... ");
+
+	if (QSplat_TaskPool::NumThreads() > 1) {
+		// Find all the face normals, then have each vertex add up
+		// the normals of its faces
+		VertexFaces vf;
+		build_vertex_faces(numleaves, numfaces, faces, vf);
+		NormalsTask t = { leaves, faces, OOC_New<vec>(numfaces), &vf };
+		QSplat_TaskPool::ParallelFor(0, numfaces, GRAIN,
+					     find_face_normals, &t);
+		QSplat_TaskPool::ParallelFor(0, numleaves, GRAIN,
+					     sum_face_normals, &t);
+		OOC_Delete(t.facenormals, numfaces);
+		free_vertex_faces(vf);
+		progress("Done.\n");
+		return;
+	}
 
 	for (i=0; i < numleaves; i++)
 		leaves[i].norm[0] = leaves[i].norm[1] = leaves[i].norm[2] = 0.0f;
@@ -315,7 +220,7 @@ void find_normals(int numleaves, QTree_Node *leaves,
 		n2[2] += facenormal[2];
 	}
 
-	printf("Done.\n");
+	progress("Done.\n");
 }
 
 
@@ -377,12 +282,56 @@ static inline void TriBoundingSphere(const float *p1,
 }
 
 
+// State for computing splat sizes in parallel
+struct SplatSizeTask {
+	QTree_Node *leaves;
+	const face *faces;
+	float *faceradii;
+	VertexFaces *vf;
+};
+
+static void find_face_radii(void *arg, int begin, int end)
+{
+	SplatSizeTask *t = (SplatSizeTask *) arg;
+	for (int i = begin; i < end; i++)
+		TriBoundingSphere(t->leaves[t->faces[i][0]].pos,
+				  t->leaves[t->faces[i][1]].pos,
+				  t->leaves[t->faces[i][2]].pos,
+				  t->faceradii[i]);
+}
+
+static void max_face_radii(void *arg, int begin, int end)
+{
+	SplatSizeTask *t = (SplatSizeTask *) arg;
+	for (int i = begin; i < end; i++) {
+		float r = 0.0f;
+		for (size_t j = t->vf->start[i]; j < t->vf->start[i+1]; j++)
+			r = max(r, t->faceradii[t->vf->facelist[j]]);
+		t->leaves[i].r = r;
+	}
+}
+
+
 // Figure out how big the splat at each point has to be.
 void find_splat_sizes(int numleaves, QTree_Node *leaves,
 		      int numfaces, const face *faces)
 {
 	int i;
-	printf("Computing splat sizes... "); fflush(stdout);
+	progress("Computing splat sizes... ");
+
+	if (QSplat_TaskPool::NumThreads() > 1) {
+		VertexFaces vf;
+		build_vertex_faces(numleaves, numfaces, faces, vf);
+		SplatSizeTask t = { leaves, faces, OOC_New<float>(numfaces), &vf };
+		QSplat_TaskPool::ParallelFor(0, numfaces, GRAIN,
+					     find_face_radii, &t);
+		QSplat_TaskPool::ParallelFor(0, numleaves, GRAIN,
+					     max_face_radii, &t);
+		OOC_Delete(t.faceradii, numfaces);
+		free_vertex_faces(vf);
+		progress("Done.\n");
+		return;
+	}
 
 	for (i=0; i < numleaves; i++)
 		leaves[i].r = 0.0f;
@@ -400,11 +349,130 @@ void find_splat_sizes(int numleaves, QTree_Node *leaves,
 		leaves[i2].r = max(leaves[i2].r, r);
 		leaves[i3].r = max(leaves[i3].r, r);
 	}
-	printf("Done.\n");
+	progress("Done.\n");
+}
+
+
+// Disjoint sets, for merging vertices.  The serial version uses union by
+// rank and path halving.
+static inline int find_set(int *parent, int i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+static inline void union_sets(int *parent, unsigned char *rank, int i, int j)
+{
+	i = find_set(parent, i);
+	j = find_set(parent, j);
+	if (i == j)
+		return;
+	if (rank[i] < rank[j])
+		swap(i, j);
+	parent[j] = i;
+	if (rank[i] == rank[j])
+		rank[i]++;
 }
 
 
-// Find really short edges in the mesh and merge their endpoints
+// The lock-free version, for many threads at once.  Roots are always
+// linked below smaller roots, so the root of a set ends up being its
+// smallest member no matter what order the threads get there in.
+static inline int find_set(std::atomic<int> *parent, int i)
+{
+	while (1) {
+		int p = parent[i].load(std::memory_order_relaxed);
+		if (p == i)
+			return i;
+		int gp = parent[p].load(std::memory_order_relaxed);
+		if (gp != p)
+			parent[i].compare_exchange_weak(p, gp,
+				std::memory_order_relaxed);
+		i = gp;
+	}
+}
+
+static inline void union_sets(std::atomic<int> *parent, int i, int j)
+{
+	while (1) {
+		i = find_set(parent, i);
+		j = find_set(parent, j);
+		if (i == j)
+			return;
+		if (i > j)
+			swap(i, j);
+		int expected = j;
+		if (parent[j].compare_exchange_strong(expected, i))
+			return;
+	}
+}
+
+
+// State for merging vertices in parallel
+struct MergeTask {
+	QTree_Node *leaves;
+	face *faces;
+	float thresh;
+	bool havecolor;
+	std::atomic<int> *parent;
+};
+
+static void merge_short_edges(void *arg, int begin, int end)
+{
+	MergeTask *t = (MergeTask *) arg;
+	for (int i = begin; i < end; i++) {
+		for (int j = 0; j < 3; j++) {
+			int v1 = t->faces[i][j], v2 = t->faces[i][(j+1)%3];
+			if (Dist(t->leaves[v1].pos, t->leaves[v2].pos) < t->thresh)
+				union_sets(t->parent, v1, v2);
+		}
+	}
+}
+
+static void find_merged(void *arg, int begin, int end)
+{
+	MergeTask *t = (MergeTask *) arg;
+	for (int i = begin; i < end; i++)
+		t->leaves[i].m.remap = find_set(t->parent, i);
+}
+
+static void average_merged(void *arg, int begin, int end)
+{
+	MergeTask *t = (MergeTask *) arg;
+	for (int i = begin; i < end; i++) {
+		QTree_Node &l = t->leaves[i];
+		if (l.m.refcount < 2)
+			continue;
+		float x = 1.0f / l.m.refcount;
+		l.pos[0] *= x;
+		l.pos[1] *= x;
+		l.pos[2] *= x;
+		// Normal will get fixed later
+		if (t->havecolor) {
+			l.col[0] = min(max((unsigned char)(l.m.col_tmp[0] * x + 0.5), (unsigned char)0), (unsigned char)255);
+			l.col[1] = min(max((unsigned char)(l.m.col_tmp[1] * x + 0.5), (unsigned char)0), (unsigned char)255);
+			l.col[2] = min(max((unsigned char)(l.m.col_tmp[2] * x + 0.5), (unsigned char)0), (unsigned char)255);
+		}
+	}
+}
+
+static void remap_faces(void *arg, int begin, int end)
+{
+	MergeTask *t = (MergeTask *) arg;
+	for (int i = begin; i < end; i++) {
+		t->faces[i][0] = t->leaves[t->faces[i][0]].m.remap;
+		t->faces[i][1] = t->leaves[t->faces[i][1]].m.remap;
+		t->faces[i][2] = t->leaves[t->faces[i][2]].m.remap;
+	}
+}
+
+
+// Find really short edges in the mesh and merge their endpoints.  Each set
+// of vertices joined by short edges is replaced by its lowest-numbered
+// member, moved to the average position (and color) of the set.
 void merge_nodes(int &numleaves, QTree_Node *leaves,
 		 int &numfaces, face *faces,
 		 bool havecolor, float thresh)
@@ -414,37 +482,61 @@ void merge_nodes(int &numleaves, QTree_Node *leaves,
 		leaves[i].m.refcount = 0;
 		leaves[i].m.remap = i;
 	}
-
 	for (i=0; i < numfaces; i++) {
-		int v1 = faces[i][0], v2 = faces[i][1], v3 = faces[i][2];
-		leaves[v1].m.refcount = leaves[v2].m.refcount =
-			leaves[v3].m.refcount = 1;
-		if (thresh <= 0.0f)
-			continue;
-		while (v1 != leaves[v1].m.remap) v1 = leaves[v1].m.remap;
-		while (v2 != leaves[v2].m.remap) v2 = leaves[v1].m.remap;
-		while (v3 != leaves[v3].m.remap) v3 = leaves[v1].m.remap;
-
-		float d12 = Dist(leaves[v1].pos, leaves[v2].pos);
-		float d23 = Dist(leaves[v2].pos, leaves[v3].pos);
-		float d31 = Dist(leaves[v3].pos, leaves[v1].pos);
-
-		if ((d12 < thresh) + (d23 < thresh) + (d31 < thresh) >= 2) {
-			// This entire triangle goes away...
-			leaves[v1].m.remap = leaves[v2].m.remap =
-				leaves[v3].m.remap = min(min(v1, v2), v3);
-		} else if (d12 < thresh) {
-			leaves[v1].m.remap = leaves[v2].m.remap = min(v1,v2);
-		} else if (d23 < thresh) {
-			leaves[v2].m.remap = leaves[v3].m.remap = min(v2,v3);
-		} else if (d31 < thresh) {
-			leaves[v3].m.remap = leaves[v1].m.remap = min(v3,v1);
-		}
+		leaves[faces[i][0]].m.refcount = 1;
+		leaves[faces[i][1]].m.refcount = 1;
+		leaves[faces[i][2]].m.refcount = 1;
 	}
 
 	if (thresh <= 0.0f)
 		return;
 
+	progress("Merging vertices... ");
+
+	// Find the sets of vertices to be merged, and point each vertex at
+	// the smallest member of its set
+	MergeTask t = { leaves, faces, thresh, havecolor, NULL };
+	if (QSplat_TaskPool::NumThreads() > 1) {
+		t.parent = new std::atomic<int>[numleaves];
+		for (i=0; i < numleaves; i++)
+			t.parent[i] = i;
+		QSplat_TaskPool::ParallelFor(0, numfaces, GRAIN,
+					     merge_short_edges, &t);
+		QSplat_TaskPool::ParallelFor(0, numleaves, GRAIN,
+					     find_merged, &t);
+		delete [] t.parent;
+	} else {
+		int *parent = OOC_New<int>(numleaves);
+		unsigned char *rank = OOC_New<unsigned char>(numleaves);
+		for (i=0; i < numleaves; i++) {
+			parent[i] = i;
+			rank[i] = 0;
+		}
+		for (i=0; i < numfaces; i++) {
+			for (int j = 0; j < 3; j++) {
+				int v1 = faces[i][j], v2 = faces[i][(j+1)%3];
+				if (Dist(leaves[v1].pos, leaves[v2].pos) < thresh)
+					union_sets(parent, rank, v1, v2);
+			}
+		}
+
+		// The first member of a set we come across is the smallest.
+		// Until then, the root's remap is -1.
+		for (i=0; i < numleaves; i++)
+			leaves[i].m.remap = -1;
+		for (i=0; i < numleaves; i++) {
+			int r = find_set(parent, i);
+			if (leaves[r].m.remap < 0)
+				leaves[r].m.remap = i;
+			leaves[i].m.remap = leaves[r].m.remap;
+		}
+		OOC_Delete(rank, numleaves);
+		OOC_Delete(parent, numleaves);
+	}
+
+	// Add up the positions and colors of each set.  The smallest member
+	// of a set always comes first.
+	int nmerged = 0;
 	for (i=0; i < numleaves; i++) {
 		if (leaves[i].m.refcount == 0)
 			continue;
@@ -457,8 +549,6 @@ void merge_nodes(int &numleaves, QTree_Node *leaves,
 			continue;
 		}
 		int j = leaves[i].m.remap;
-		while (leaves[j].m.remap != j)
-			j = leaves[j].m.remap;
 		leaves[j].m.refcount++;
 		leaves[j].pos[0] += leaves[i].pos[0];
 		leaves[j].pos[1] += leaves[i].pos[1];
@@ -472,30 +562,212 @@ void merge_nodes(int &numleaves, QTree_Node *leaves,
 			leaves[j].m.col_tmp[2] += leaves[i].col[2];
 		}
 		leaves[i].m.refcount = 0;
+		nmerged++;
+	}
+
+	QSplat_TaskPool::ParallelFor(0, numleaves, GRAIN, average_merged, &t);
+	QSplat_TaskPool::ParallelFor(0, numfaces, GRAIN, remap_faces, &t);
+	progress("%d merged... Done.\n", nmerged);
+}
+
+
+// State for clustering vertices on a grid.  The vertices are sorted by the
+// number of the cell they fall in with a radix sort, each pass of which
+// histograms and scatters fixed chunks of the array in parallel.
+struct ClusterTask {
+	QTree_Node *leaves;
+	bool havecolor;
+	int n, nchunks;
+	point origin;
+	float cell;
+	unsigned long long nx, ny, nz;
+	unsigned long long *key, *key2;
+	int *index, *index2;
+	size_t *hist;		// 256 counts per chunk
+	int shift;
+	std::atomic<int> nmerged;
+};
+
+static void cluster_keys(void *arg, int begin, int end)
+{
+	ClusterTask *t = (ClusterTask *) arg;
+	float x = 1.0f / t->cell;
+	for (int i = begin; i < end; i++) {
+		const point &p = t->leaves[t->index[i]].pos;
+		unsigned long long ix = (unsigned long long) ((p[0] - t->origin[0]) * x);
+		unsigned long long iy = (unsigned long long) ((p[1] - t->origin[1]) * x);
+		unsigned long long iz = (unsigned long long) ((p[2] - t->origin[2]) * x);
+		ix = min(ix, t->nx - 1);
+		iy = min(iy, t->ny - 1);
+		iz = min(iz, t->nz - 1);
+		t->key[i] = (iz * t->ny + iy) * t->nx + ix;
 	}
+}
 
+static void radix_histogram(void *arg, int begin, int end)
+{
+	ClusterTask *t = (ClusterTask *) arg;
+	for (int c = begin; c < end; c++) {
+		size_t *h = t->hist + 256*c;
+		memset(h, 0, 256*sizeof(size_t));
+		int cbegin = (int) ((long long) t->n * c / t->nchunks);
+		int cend = (int) ((long long) t->n * (c+1) / t->nchunks);
+		for (int i = cbegin; i < cend; i++)
+			h[(t->key[i] >> t->shift) & 0xff]++;
+	}
+}
+
+static void radix_scatter(void *arg, int begin, int end)
+{
+	ClusterTask *t = (ClusterTask *) arg;
+	for (int c = begin; c < end; c++) {
+		size_t *h = t->hist + 256*c;
+		int cbegin = (int) ((long long) t->n * c / t->nchunks);
+		int cend = (int) ((long long) t->n * (c+1) / t->nchunks);
+		for (int i = cbegin; i < cend; i++) {
+			size_t j = h[(t->key[i] >> t->shift) & 0xff]++;
+			t->key2[j] = t->key[i];
+			t->index2[j] = t->index[i];
+		}
+	}
+}
+
+// Collapse each run of vertices in the same cell onto the first (lowest-
+// numbered) one.  A run belongs to the range its first vertex is in.
+static void cluster_runs(void *arg, int begin, int end)
+{
+	ClusterTask *t = (ClusterTask *) arg;
+	QTree_Node *leaves = t->leaves;
+	int nmerged = 0;
+	int i = begin;
+	while (i > 0 && i < end && t->key[i] == t->key[i-1])
+		i++;
+	while (i < end) {
+		int j = i + 1;
+		while (j < t->n && t->key[j] == t->key[i])
+			j++;
+		if (j - i > 1) {
+			QTree_Node &l = leaves[t->index[i]];
+			int col[3] = { l.col[0], l.col[1], l.col[2] };
+			for (int k = i+1; k < j; k++) {
+				QTree_Node &l2 = leaves[t->index[k]];
+				l.pos[0] += l2.pos[0];
+				l.pos[1] += l2.pos[1];
+				l.pos[2] += l2.pos[2];
+				l.norm[0] += l2.norm[0];
+				l.norm[1] += l2.norm[1];
+				l.norm[2] += l2.norm[2];
+				col[0] += l2.col[0];
+				col[1] += l2.col[1];
+				col[2] += l2.col[2];
+				l.r = max(l.r, l2.r);
+				l2.m.refcount = 0;
+			}
+			float x = 1.0f / (j - i);
+			l.pos[0] *= x;
+			l.pos[1] *= x;
+			l.pos[2] *= x;
+			// Normal will get fixed later
+			if (t->havecolor) {
+				l.col[0] = (unsigned char) (col[0] * x + 0.5f);
+				l.col[1] = (unsigned char) (col[1] * x + 0.5f);
+				l.col[2] = (unsigned char) (col[2] * x + 0.5f);
+			}
+			nmerged += j - i - 1;
+		}
+		i = j;
+	}
+	t->nmerged += nmerged;
+}
+
+
+// Replace all the vertices in each cell of a grid with their average.
+// This runs after the splat sizes are known, and the merged splat is as
+// big as the biggest one it replaces.
+bool cluster_nodes(int numleaves, QTree_Node *leaves,
+		   bool havecolor, float cell)
+{
+	if (cell <= 0.0f)
+		return true;
+
+	progress("Clustering vertices... ");
+
+	// Find the vertices that are still around, and their bounding box
+	int i, n = 0;
+	point min_p = { BIGNUM, BIGNUM, BIGNUM };
+	point max_p = { -BIGNUM, -BIGNUM, -BIGNUM };
 	for (i=0; i < numleaves; i++) {
-		if (leaves[i].m.refcount < 2)
+		if (!leaves[i].m.refcount || leaves[i].r == 0.0f)
 			continue;
-		float x = 1.0f / leaves[i].m.refcount;
-		leaves[i].pos[0] *= x;
-		leaves[i].pos[1] *= x;
-		leaves[i].pos[2] *= x;
-		// Normal will get fixed later
-		if (havecolor) {
-			leaves[i].col[0] = min(max((unsigned char)(leaves[i].m.col_tmp[0] * x + 0.5), (unsigned char)0), (unsigned char)255);
-			leaves[i].col[1] = min(max((unsigned char)(leaves[i].m.col_tmp[1] * x + 0.5), (unsigned char)0), (unsigned char)255);
-			leaves[i].col[2] = min(max((unsigned char)(leaves[i].m.col_tmp[2] * x + 0.5), (unsigned char)0), (unsigned char)255);
+		n++;
+		for (int j=0; j < 3; j++) {
+			min_p[j] = min(min_p[j], leaves[i].pos[j]);
+			max_p[j] = max(max_p[j], leaves[i].pos[j]);
 		}
 	}
+	if (!n) {
+		progress("Done.\n");
+		return true;
+	}
 
-	for (i=0; i < numfaces; i++) {
-		while (faces[i][0] != leaves[faces[i][0]].m.remap)
-			faces[i][0] = leaves[faces[i][0]].m.remap;
-		while (faces[i][1] != leaves[faces[i][1]].m.remap)
-			faces[i][1] = leaves[faces[i][1]].m.remap;
-		while (faces[i][2] != leaves[faces[i][2]].m.remap)
-			faces[i][2] = leaves[faces[i][2]].m.remap;
+	ClusterTask t;
+	t.leaves = leaves;
+	t.havecolor = havecolor;
+	t.n = n;
+	t.nchunks = QSplat_TaskPool::NumThreads() > 1 ?
+		    4 * QSplat_TaskPool::NumThreads() : 1;
+	t.cell = cell;
+	t.origin[0] = min_p[0];  t.origin[1] = min_p[1];  t.origin[2] = min_p[2];
+	t.nmerged = 0;
+
+	// Number the cells
+	double nx = floor((max_p[0] - min_p[0]) / cell) + 1.0;
+	double ny = floor((max_p[1] - min_p[1]) / cell) + 1.0;
+	double nz = floor((max_p[2] - min_p[2]) / cell) + 1.0;
+	if (nx * ny * nz > 1.0e18) {
+		fprintf(stderr, "\nGrid cell size %g is too small for this mesh\n", cell);
+		return false;
 	}
-}
+	t.nx = (unsigned long long) nx;
+	t.ny = (unsigned long long) ny;
+	t.nz = (unsigned long long) nz;
+	unsigned long long maxkey = t.nx * t.ny * t.nz - 1;
+
+	t.key = OOC_New<unsigned long long>(n);
+	t.key2 = OOC_New<unsigned long long>(n);
+	t.index = OOC_New<int>(n);
+	t.index2 = OOC_New<int>(n);
+	t.hist = new size_t[256 * t.nchunks];
+	for (i=0, n=0; i < numleaves; i++)
+		if (leaves[i].m.refcount && leaves[i].r != 0.0f)
+			t.index[n++] = i;
+	QSplat_TaskPool::ParallelFor(0, n, GRAIN, cluster_keys, &t);
+
+	// Sort by cell, a byte at a time.  Each pass is stable, so the
+	// vertices in each cell stay in order.
+	for (t.shift = 0; t.shift < 64 && (maxkey >> t.shift); t.shift += 8) {
+		QSplat_TaskPool::ParallelFor(0, t.nchunks, 1, radix_histogram, &t);
+		size_t total = 0;
+		for (int d = 0; d < 256; d++) {
+			for (int c = 0; c < t.nchunks; c++) {
+				size_t count = t.hist[256*c + d];
+				t.hist[256*c + d] = total;
+				total += count;
+			}
+		}
+		QSplat_TaskPool::ParallelFor(0, t.nchunks, 1, radix_scatter, &t);
+		swap(t.key, t.key2);
+		swap(t.index, t.index2);
+	}
+
+	QSplat_TaskPool::ParallelFor(0, n, GRAIN, cluster_runs, &t);
+
+	delete [] t.hist;
+	OOC_Delete(t.index2, n);
+	OOC_Delete(t.index, n);
+	OOC_Delete(t.key2, n);
+	OOC_Delete(t.key, n);
 
+	progress("%d merged... Done.\n", (int) t.nmerged);
+	return true;
+}
@@ -13,6 +13,12 @@ Leland Stanford Junior University.  All Rights Reserved.
 
 #include "qsplat_make_qtree_v11.h"
 
+// Progress messages from the routines below.  They can be turned off, for
+// when several meshes are being read at once.
+extern bool qsplat_make_verbose;
+extern void progress(const char *fmt, ...);
+
+
 extern bool read_ply(const char *plyfile,
 		     int &numleaves, QTree_Node * &leaves,
 		     int &numfaces, face * &faces,
@@ -25,5 +31,7 @@ extern void merge_nodes(int &numleaves, QTree_Node *leaves,
 			bool havecolor, float thresh);
 extern void find_splat_sizes(int numleaves, QTree_Node *leaves,
 		             int numfaces, const face *faces);
+extern bool cluster_nodes(int numleaves, QTree_Node *leaves,
+			  bool havecolor, float cell);
 
 #endif
@@ -14,6 +14,17 @@ Leland Stanford Junior University.  All Rights Reserved.
 #include <string.h>
 #include "qsplat_make_qtree_v11.h"
 #include "qsplat_make_from_mesh.h"
+#include "qsplat_make_outofcore.h"
+#include "qsplat_make_convert.h"
+#include "qsplat_threads.h"
+#include "qsplat_spherequant.h"
+#include "qsplat_normquant.h"
+#include "qsplat_colorquant.h"
+#include <vector>
+
+#ifdef WIN32
+# define ftello _ftelli64
+#endif
 
 
 // Version stamp
@@ -22,10 +33,218 @@ const char *QSPLATMAKE_VERSION = "1.0";
 
 static void usage(const char *myname)
 {
-	fprintf(stderr, "Usage: %s [-m threshold] in.ply out.qs\n", myname);
+	fprintf(stderr, "Usage: %s [-m threshold] [-g cell] [-t threads] [-z] [-W] [-L] [-V] [-8] [-C] [-M megabytes [-T tmpdir]] [-F jobs] in.ply [in2.ply ...] out.qs\n", myname);
+	fprintf(stderr, "  -g  average together the vertices in each cell of a grid this big\n");
+	fprintf(stderr, "  -z  build the tree faster, from the leaves' order along a Z-order curve\n");
+	fprintf(stderr, "  -W  write 64-bit (version 12) fragments even if they're smaller than 2GB\n");
+	fprintf(stderr, "  -L  write the nodes in little-endian order, for faster drawing on x86\n");
+	fprintf(stderr, "  -V  lay out the tree in van Emde Boas order, so each subtree is contiguous\n");
+	fprintf(stderr, "  -8  write an 8-wide tree (version 13), for drawing 8 nodes at a time with SIMD\n");
+	fprintf(stderr, "  -C  compress the tree in blocks (version 14), to read less from slow disks\n");
+	fprintf(stderr, "  -M  build out-of-core, using about this much memory\n");
+	fprintf(stderr, "  -T  directory for temporary files (default $TMPDIR or /tmp)\n");
+	fprintf(stderr, "  -F  write separate fragments, building this many at once, each using -M memory\n");
+	fprintf(stderr, "  in.ply may be - to read from stdin, or @list to read the names of .ply files\n");
+	fprintf(stderr, "  from a file.  With several inputs, each becomes a fragment of out.qs, and -F\n");
+	fprintf(stderr, "  (default: one per thread) says how many are built at once.\n");
+	fprintf(stderr, "  If in.qs is given instead, it is copied with its nodes in little-endian order\n");
+	fprintf(stderr, "  (with -L) or in the usual big-endian order (without).  Version 13 fragments\n");
+	fprintf(stderr, "  are always little-endian, and version 14 fragments are compressed, so they are\n");
+	fprintf(stderr, "  copied as they are.\n");
 	exit(1);
 }
 
+
+// Add the names of the .ply files in a list (one per line, with blank lines
+// and lines starting with # ignored) to infiles
+static bool read_list(const char *listname, std::vector<std::string> &infiles)
+{
+	FILE *f = fopen(listname, "r");
+	if (!f) {
+		fprintf(stderr, "Couldn't open list of files %s\n", listname);
+		return false;
+	}
+	char buf[4096];
+	while (fgets(buf, sizeof(buf), f)) {
+		int len = strlen(buf);
+		while (len && (buf[len-1] == '\n' || buf[len-1] == '\r' ||
+			       buf[len-1] == ' ' || buf[len-1] == '\t'))
+			buf[--len] = '\0';
+		const char *name = buf;
+		while (*name == ' ' || *name == '\t')
+			name++;
+		if (*name && *name != '#')
+			infiles.push_back(name);
+	}
+	fclose(f);
+	return true;
+}
+
+
+// Read a mesh, and do everything to it that comes before building the tree.
+// Prints a message and returns false if we can't make a tree out of it.
+static bool make_leaves(const char *infilename, float threshold, float cellsize,
+			int &numleaves, QTree_Node * &leaves, bool &havecolor,
+			std::string &comments)
+{
+	// Read the .ply file
+	int numfaces;
+	face *faces;
+
+	if (!read_ply(infilename, numleaves, leaves, numfaces, faces, havecolor, comments)) {
+		fprintf(stderr, "Couldn't read input file %s\n", infilename);
+		return false;
+	}
+	bool ok = true;
+	if (numleaves < 4) {
+		fprintf(stderr, "Ummm...  That's an awfully small mesh you've got there...\n");
+		ok = false;
+	} else if (numfaces < 4) {
+		fprintf(stderr, "Ummm... I need a *mesh* as input.  That means triangles 'n stuff...\n");
+		ok = false;
+	}
+
+	if (ok) {
+		// Compute per-vertex normals
+		find_normals(numleaves, leaves, numfaces, faces);
+
+		// Merge nodes
+		merge_nodes(numleaves, leaves, numfaces, faces, havecolor, threshold);
+
+		// Compute initial splat sizes
+		find_splat_sizes(numleaves, leaves, numfaces, faces);
+
+		// Thin out the vertices on a grid
+		ok = cluster_nodes(numleaves, leaves, havecolor, cellsize);
+	}
+
+	// Make sure merging left us something to build a tree from
+	if (ok) {
+		int numleft = 0;
+		for (int j=0; j < numleaves && numleft < 4; j++)
+			if (leaves[j].m.refcount && leaves[j].r != 0.0f)
+				numleft++;
+		if (numleft < 4) {
+			fprintf(stderr, "Ummm...  Merging vertices left almost nothing.  Try a smaller -m or -g.\n");
+			ok = false;
+		}
+	}
+
+	// Don't need face data any more
+	OOC_Delete(faces, numfaces);
+	if (!ok)
+		OOC_Delete(leaves, numleaves);
+	return ok;
+}
+
+
+// Making the fragment for one of several input files
+struct ScanTask {
+	const char *infilename;
+	float threshold, cellsize;
+	bool morton;
+	FILE *f;		// Where the fragment goes
+	long long len;
+	bool ok;
+};
+
+static void build_scan(void *arg)
+{
+	ScanTask *t = (ScanTask *) arg;
+	int numleaves;
+	QTree_Node *leaves;
+	bool havecolor;
+	std::string comments;
+	t->ok = make_leaves(t->infilename, t->threshold, t->cellsize,
+			    numleaves, leaves, havecolor, comments);
+	if (!t->ok)
+		return;
+
+	QTree qt(numleaves, leaves, havecolor, false);
+	OOC_Delete(leaves, numleaves);
+	qt.BuildTree(t->morton);
+
+	// Each fragment is preceded by the comments from its own file
+	rewind(t->f);
+	if (!comments.empty())
+		write_comments(t->f, comments);
+	t->ok = qt.WriteFragment(t->f);
+	fflush(t->f);
+	t->len = ftello(t->f);
+	if (ferror(t->f))
+		t->ok = false;
+}
+
+
+// Make a fragment out of each input file, building this many at a time,
+// and write them all to one .qs file in order.  Memory use is bounded by
+// the biggest jobs meshes at once.
+static bool build_scans(const std::vector<std::string> &infiles,
+			const char *outfilename, int jobs,
+			float threshold, float cellsize, bool morton)
+{
+	// The quantization tables have to be set up before threads start
+	// using them
+	QSplat_ColorQuant::Init();
+	QSplat_NormQuant::Init();
+	QSplat_SphereQuant::Init();
+
+	int nscans = infiles.size();
+	jobs = max(min(jobs, nscans), 1);
+	printf("Building %d fragments, %d at a time...\n", nscans, jobs);
+	qsplat_make_verbose = false;
+
+	std::string tmpname;
+	FILE *f = QTree::OpenOutput(outfilename, tmpname);
+	if (!f)
+		return false;
+
+	std::vector<ScanTask> tasks(jobs);
+	for (int j = 0; j < jobs; j++) {
+		tasks[j].threshold = threshold;
+		tasks[j].cellsize = cellsize;
+		tasks[j].morton = morton;
+		tasks[j].f = OOC_TempFile();
+	}
+	bool ok = true, scanfailed = false;
+	for (int i = 0; i < nscans && ok; i += jobs) {
+		int njobs = min(jobs, nscans - i);
+		QSplat_TaskPool::TaskGroup g;
+		for (int j = 0; j < njobs; j++) {
+			tasks[j].infilename = infiles[i+j].c_str();
+			if (j)
+				QSplat_TaskPool::Spawn(g, build_scan, &tasks[j]);
+		}
+		build_scan(&tasks[0]);
+		QSplat_TaskPool::Wait(g);
+		for (int j = 0; j < njobs && ok; j++) {
+			if (!tasks[j].ok) {
+				fprintf(stderr, "Couldn't make a fragment from %s\n",
+					tasks[j].infilename);
+				ok = false;
+				scanfailed = true;
+			} else if (!OOC_AppendTemp(f, tasks[j].f, tasks[j].len)) {
+				ok = false;
+			} else {
+				printf(" %s... Done.\n", tasks[j].infilename);
+			}
+		}
+	}
+
+	if (ok)
+		ok = write_index(f);
+
+	for (int j = 0; j < jobs; j++)
+		fclose(tasks[j].f);
+	if (scanfailed) {
+		fclose(f);
+		remove(tmpname.c_str());
+		return false;
+	}
+	return QTree::CloseOutput(f, outfilename, tmpname, ok);
+}
+
+
 int main(int argc, char *argv[])
 {
 #ifdef WIN32
@@ -34,62 +253,151 @@ int main(int argc, char *argv[])
 	printf("This is QSplatMake version %s.\n", QSPLATMAKE_VERSION);
 
 	// Parse command-line params
-	if ((argc < 3) ||
-	    !strncasecmp(argv[1], "-h", 2) ||
-	    !strncasecmp(argv[1], "--h", 3))
+	float threshold = 0, cellsize = 0;
+	int numthreads = 0;
+	bool morton = false;
+	int fragjobs = 0;
+	size_t memlimit = 0;
+	const char *tmpdir = NULL;
+	int i = 1;
+	while (i < argc && argv[i][0] == '-' && argv[i][1]) {
+		if (!strcmp(argv[i], "-M") && i+1 < argc) {
+			memlimit = (size_t) (atof(argv[i+1]) * 1048576.0);
+			i += 2;
+		} else if (!strcmp(argv[i], "-T") && i+1 < argc) {
+			tmpdir = argv[i+1];
+			i += 2;
+		} else if (!strcmp(argv[i], "-F") && i+1 < argc) {
+			fragjobs = max(atoi(argv[i+1]), 1);
+			i += 2;
+		} else if (!strncasecmp(argv[i], "-m", 2) && i+1 < argc) {
+			threshold = atof(argv[i+1]);
+			i += 2;
+		} else if (!strncasecmp(argv[i], "-g", 2) && i+1 < argc) {
+			cellsize = atof(argv[i+1]);
+			i += 2;
+		} else if (!strncasecmp(argv[i], "-t", 2) && i+1 < argc) {
+			numthreads = atoi(argv[i+1]);
+			i += 2;
+		} else if (!strcasecmp(argv[i], "-z")) {
+			morton = true;
+			i++;
+		} else if (!strcmp(argv[i], "-W")) {
+			qsplat_make_wide = true;
+			i++;
+		} else if (!strcmp(argv[i], "-L")) {
+			qsplat_make_little_endian = true;
+			i++;
+		} else if (!strcmp(argv[i], "-V")) {
+			qsplat_make_veb = true;
+			i++;
+		} else if (!strcmp(argv[i], "-8")) {
+			qsplat_make_simd = true;
+			i++;
+		} else if (!strcmp(argv[i], "-C")) {
+			qsplat_make_compress = true;
+			i++;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (argc - i < 2)
 		usage(argv[0]);
 
-	const char *infilename = argv[1];
-	const char *outfilename = argv[2];
-	float threshold = 0;
-
-	if (argc >= 5 && !strncasecmp(argv[1], "-m", 2)) {
-		threshold = atof(argv[2]);
-		infilename = argv[3];
-		outfilename = argv[4];
+	std::vector<std::string> infiles;
+	for ( ; i < argc - 1; i++) {
+		if (argv[i][0] == '@') {
+			if (!read_list(argv[i] + 1, infiles))
+				exit(1);
+		} else {
+			infiles.push_back(argv[i]);
+		}
+	}
+	const char *outfilename = argv[argc-1];
+	if (infiles.empty()) {
+		fprintf(stderr, "No input files.\n");
+		exit(1);
 	}
 
+	// Existing .qs files just get their byte order changed
+	if (infiles.size() == 1 && is_qs_file(infiles[0].c_str()))
+		return convert_qs_file(infiles[0].c_str(), outfilename,
+				       qsplat_make_little_endian) ? 0 : 1;
 
-	// Read the .ply file
-	int numleaves, numfaces;
-	face *faces;
-	bool havecolor;
-	QTree_Node *leaves;
-	std::string comments;
-
-	if (!read_ply(infilename, numleaves, leaves, numfaces, faces, havecolor, comments)) {
-		fprintf(stderr, "Couldn't read input file %s\n", infilename);
+	if (morton && memlimit) {
+		fprintf(stderr, "Sorry - -z can't be used with -M.\n");
 		exit(1);
 	}
-	if (numleaves < 4) {
-		fprintf(stderr, "Ummm...  That's an awfully small mesh you've got there...\n");
+	if (qsplat_make_veb && memlimit && !fragjobs) {
+		fprintf(stderr, "Sorry - -V can't be used with -M, except with -F.\n");
 		exit(1);
 	}
-	if (numfaces < 4) {
-		fprintf(stderr, "Ummm... I need a *mesh* as input.  That means triangles 'n stuff...\n");
+	if (qsplat_make_simd && qsplat_make_veb) {
+		fprintf(stderr, "Sorry - -8 and -V can't be used together.\n");
+		exit(1);
+	}
+	if (qsplat_make_simd && memlimit && !fragjobs) {
+		fprintf(stderr, "Sorry - -8 can't be used with -M, except with -F.\n");
+		exit(1);
+	}
+	if (qsplat_make_compress && qsplat_make_simd) {
+		fprintf(stderr, "Sorry - -C and -8 can't be used together.\n");
+		exit(1);
+	}
+	if (qsplat_make_compress && memlimit && !fragjobs) {
+		fprintf(stderr, "Sorry - -C can't be used with -M, except with -F.\n");
+		exit(1);
+	}
+	if (infiles.size() > 1 && memlimit) {
+		fprintf(stderr, "Sorry - -M can't be used with more than one input file.\n");
+		exit(1);
+	}
+	if (infiles.size() == 1 && fragjobs && !memlimit) {
+		fprintf(stderr, "-F needs -M to know how big to make the fragments.\n");
 		exit(1);
 	}
 
-	// Compute per-vertex normals
-	find_normals(numleaves, leaves, numfaces, faces);
+	QSplat_TaskPool::Init(numthreads);
 
-	// Merge nodes
-	merge_nodes(numleaves, leaves, numfaces, faces, havecolor, threshold);
+	// Several scans each become a fragment of their own
+	if (infiles.size() > 1) {
+		int jobs = fragjobs ? fragjobs : QSplat_TaskPool::NumThreads();
+		return build_scans(infiles, outfilename, jobs, threshold,
+				   cellsize, morton) ? 0 : 1;
+	}
 
-	// Compute initial splat sizes
-	find_splat_sizes(numleaves, leaves, numfaces, faces);
+	// If we're going out-of-core, the big arrays live in temporary files
+	if (memlimit)
+		OOC_Init(tmpdir);
 
-	// Don't need face data any more
-	delete [] faces;
+	// Read the mesh and get it ready
+	const char *infilename = infiles[0].c_str();
+	int numleaves;
+	bool havecolor;
+	QTree_Node *leaves;
+	std::string comments;
+	if (!make_leaves(infilename, threshold, cellsize, numleaves, leaves,
+			 havecolor, comments))
+		exit(1);
+
+	if (memlimit) {
+		// Build the tree a piece at a time, then write it out
+		QTree_OOC qt(numleaves, leaves, havecolor, memlimit);
+		if (fragjobs)
+			return qt.WriteFragments(outfilename, comments,
+						 fragjobs) ? 0 : 1;
+		qt.BuildTree();
+		return qt.Write(outfilename, comments) ? 0 : 1;
+	}
 
-	// Initialize the tree
+	// Initialize the tree.  It keeps its own copy of the leaves.
 	QTree qt(numleaves, leaves, havecolor);
+	OOC_Delete(leaves, numleaves);
 
 	// Build the tree...
-	qt.BuildTree();
+	qt.BuildTree(morton);
 
 	// ... and write it out
-	qt.Write(outfilename, comments);
-	return 0;
+	return qt.Write(outfilename, comments) ? 0 : 1;
 }
 
@@ -0,0 +1,702 @@
+/*
+qsplat_make_outofcore.cpp
+Building trees for meshes that don't fit in memory.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "qsplat_util.h"
+#include "qsplat_make_outofcore.h"
+#include "qsplat_spherequant.h"
+#include "qsplat_normquant.h"
+#include "qsplat_colorquant.h"
+
+#ifdef WIN32
+# include <io.h>
+# define fseeko _fseeki64
+# define ftello _ftelli64
+#else
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+
+
+// Approximate number of bytes of memory needed per leaf to build a tree:
+// the tree's copy of the leaf, plus the interior nodes.
+#define BYTES_PER_LEAF (2 * (sizeof(point) + sizeof(float) + sizeof(vec) + \
+			     sizeof(color)) + sizeof(float) + 4 * sizeof(int))
+
+// Never make buckets smaller than this, no matter what the memory limit
+#define MIN_BUCKET 1024
+
+// Size of stdio buffers for temporary files
+#define OOC_BUFSIZE (1 << 20)
+
+
+// Directory for temporary files.  If NULL, OOC_Alloc() just uses the heap.
+static const char *ooc_tmpdir = NULL;
+
+
+// Put scratch files in the given directory (or $TMPDIR, or /tmp)
+void OOC_Init(const char *tmpdir)
+{
+	if (!tmpdir)
+		tmpdir = getenv("TMPDIR");
+	if (!tmpdir || !*tmpdir)
+		tmpdir = "/tmp";
+	ooc_tmpdir = tmpdir;
+}
+
+
+// Create a temporary file that vanishes when closed
+FILE *OOC_TempFile()
+{
+#ifdef WIN32
+	FILE *f = tmpfile();
+#else
+	std::string name = std::string(ooc_tmpdir ? ooc_tmpdir : "/tmp") +
+			   "/qsplatXXXXXX";
+	FILE *f = NULL;
+	int fd = mkstemp(&name[0]);
+	if (fd >= 0) {
+		unlink(name.c_str());
+		f = fdopen(fd, "w+b");
+	}
+#endif
+	if (!f) {
+		perror("Couldn't create temporary file");
+		exit(1);
+	}
+	setvbuf(f, NULL, _IOFBF, OOC_BUFSIZE);
+	return f;
+}
+
+
+// Allocate an array, backed by a temporary file if OOC_Init() was called
+void *OOC_Alloc(size_t bytes)
+{
+#ifndef WIN32
+	if (ooc_tmpdir && bytes) {
+		FILE *f = OOC_TempFile();
+		void *p = MAP_FAILED;
+		if (ftruncate(fileno(f), bytes) == 0)
+			p = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+				 fileno(f), 0);
+		fclose(f);
+		if (p == MAP_FAILED) {
+			perror("Couldn't map temporary file");
+			exit(1);
+		}
+		return p;
+	}
+#endif
+	return ::operator new(bytes);
+}
+
+
+// Free something from OOC_Alloc()
+void OOC_Free(void *p, size_t bytes)
+{
+	if (!p)
+		return;
+#ifndef WIN32
+	if (ooc_tmpdir && bytes) {
+		munmap(p, bytes);
+		return;
+	}
+#endif
+	::operator delete(p);
+}
+
+
+// Read from a temporary file
+static void read_tmp(void *p, size_t size, FILE *f)
+{
+	if (size && !fread(p, size, 1, f)) {
+		fprintf(stderr, "Error reading temporary file.\n");
+		exit(1);
+	}
+}
+
+// Set up the tree.  The leaves must have come from OOC_New(), and will be
+// freed when the tree goes away.
+QTree_OOC::QTree_OOC(int _numleaves, QTree_Node *_leaves, bool _havecolor,
+		     size_t memlimit) :
+	numleaves(_numleaves), leaves(_leaves), leaves_alloced(_numleaves),
+	havecolor(_havecolor), wide(false), little(false), top(NULL),
+	bucketarena(ARENA_HUGE_BLOCK, true),
+	nodefile(NULL), descfile(NULL)
+{
+	QSplat_ColorQuant::Init();
+	QSplat_NormQuant::Init();
+	QSplat_SphereQuant::Init();
+
+	size_t maxleaves = memlimit / BYTES_PER_LEAF;
+	bucketmax = maxleaves > INT_MAX ? INT_MAX :
+		    max((int)maxleaves, MIN_BUCKET);
+
+	printf("Splitting into buckets of at most %d leaves... ", bucketmax);
+	fflush(stdout);
+
+	// Get rid of the leaves that won't be in the tree, just like
+	// QTree::InitLeaves
+	int i, next = 0;
+	for (i=0; i < numleaves; i++) {
+		if (!leaves[i].m.refcount || leaves[i].r == 0.0f)
+			continue;
+		if (i != next)
+			memcpy(&leaves[next], &leaves[i], sizeof(QTree_Node));
+		next++;
+	}
+	if (numleaves != next) {
+		printf("Removed %d vertices... ", numleaves - next);
+		fflush(stdout);
+		numleaves = next;
+	}
+
+	SplitLeaves(0, numleaves, 0);
+	printf("Done.\n");
+}
+
+
+QTree_OOC::~QTree_OOC()
+{
+	OOC_Delete(leaves, leaves_alloced);
+	delete top;
+	if (nodefile)
+		fclose(nodefile);
+	if (descfile)
+		fclose(descfile);
+}
+
+
+// Partition the leaves in [begin..end), exactly as QTree::Partition does
+// with its array of pointers.  Both passes over the leaves are sequential,
+// so this doesn't thrash too badly even if they're not in memory.
+int QTree_OOC::Partition(int begin, int end)
+{
+	// Find bbox
+	float xmin=leaves[begin].pos[0];
+	float ymin=leaves[begin].pos[1];
+	float zmin=leaves[begin].pos[2];
+	float xmax=xmin, ymax=ymin, zmax=zmin;
+
+	for (int i = begin+1; i < end; i++) {
+		const float *p = leaves[i].pos;
+
+		if (p[0] < xmin)  xmin = p[0];
+		else if (p[0] > xmax)  xmax = p[0];
+
+		if (p[1] < ymin)  ymin = p[1];
+		else if (p[1] > ymax)  ymax = p[1];
+
+		if (p[2] < zmin)  zmin = p[2];
+		else if (p[2] > zmax)  zmax = p[2];
+	}
+
+	// Find axis along which to split, and do the partition
+	float dx = xmax-xmin, dy = ymax-ymin, dz = zmax-zmin;
+	if (!dx && !dy && !dz)
+		return (begin+end)/2;
+	int splitaxis;
+	if (dx > dy)
+		splitaxis = (dx > dz) ? 0 : 2;
+	else
+		splitaxis = (dy > dz) ? 1 : 2;
+	float splitval;
+	switch (splitaxis) {
+		case 0: splitval = 0.5f*(xmin+xmax); break;
+		case 1: splitval = 0.5f*(ymin+ymax); break;
+		default: splitval = 0.5f*(zmin+zmax); break;
+	}
+
+	int left = begin, right = end-1;
+	while (1) {
+		while (leaves[left].pos[splitaxis] < splitval)
+			left++;
+		while (leaves[right].pos[splitaxis] >= splitval)
+			right--;
+		if (right < left)
+			return left;
+		swap(leaves[left], leaves[right]);
+	}
+}
+
+
+// Recursively split the leaves until the pieces fit in memory, following
+// QTree::BuildLeaves.  Returns the index of the new TopNode.
+int QTree_OOC::SplitLeaves(int begin, int end, int depth)
+{
+	int t = topnodes.size();
+	topnodes.push_back(TopNode());
+	topnodes[t].depth = depth;
+
+	if (end - begin <= bucketmax) {
+		// Small enough - this becomes a bucket
+		int b = buckets.size();
+		buckets.push_back(Bucket());
+		Bucket &bk = buckets[b];
+		bk.begin = begin;
+		bk.n = end - begin;
+		bk.topnode = t;
+		topnodes[t].bucket = b;
+		topnodes[t].numchildren = 0;
+		return t;
+	}
+
+	// Split into 2, 3, or 4 pieces, just like the in-core version
+	int split[5], nsplit = 0;
+	int middle = Partition(begin, end);
+	split[nsplit++] = begin;
+	if (middle - begin > 4)
+		split[nsplit++] = Partition(begin, middle);
+	split[nsplit++] = middle;
+	if (end - middle > 4)
+		split[nsplit++] = Partition(middle, end);
+	split[nsplit] = end;
+
+	topnodes[t].bucket = -1;
+	topnodes[t].numchildren = nsplit;
+	for (int i = 0; i < nsplit; i++) {
+		int c = SplitLeaves(split[i], split[i+1], depth + 1);
+		topnodes[t].child[i] = c;
+	}
+	return t;
+}
+
+
+// Build the tree of each bucket to find out what its root looks like, then
+// build the interior nodes above the buckets
+void QTree_OOC::BuildTree()
+{
+	printf("Building tree (%d buckets)... ", (int)buckets.size());
+	fflush(stdout);
+
+	top = new QTree(topnodes.size(), havecolor);
+	for (int b = 0; b < buckets.size(); b++) {
+		Bucket &bk = buckets[b];
+		bucketarena.reset();
+		QTree qt(bk.n, &leaves[bk.begin], havecolor, false,
+			 &bucketarena);
+		qt.BuildTree();
+		bk.numchildren = qt.Num_Children(qt.root);
+		bk.grandchildren = qt.Has_Grandchildren(qt.root);
+
+		TopNode &tn = topnodes[bk.topnode];
+		tn.node = top->NewNode();
+		top->CopyNode(tn.node, qt, qt.root);
+	}
+	CombineTop(0);
+
+	printf("using %d MB per bucket... Done.\n",
+	       (int) (bucketarena.stats().peak >> 20));
+}
+
+
+// Fill in the interior TopNodes bottom-up
+void QTree_OOC::CombineTop(int t)
+{
+	if (topnodes[t].bucket >= 0)
+		return;
+
+	int c[4];
+	for (int i = 0; i < topnodes[t].numchildren; i++) {
+		CombineTop(topnodes[t].child[i]);
+		c[i] = topnodes[topnodes[t].child[i]].node;
+	}
+	topnodes[t].node = top->CombineNodes(c, topnodes[t].numchildren);
+}
+
+
+// Does this TopNode have any children at all?
+bool QTree_OOC::HasChildren(int t)
+{
+	const TopNode &tn = topnodes[t];
+	return tn.bucket < 0 || buckets[tn.bucket].numchildren;
+}
+
+
+// Does this (interior) TopNode have any grandchildren?
+bool QTree_OOC::HasGrandchildren(int t)
+{
+	const TopNode &tn = topnodes[t];
+	if (tn.bucket >= 0)
+		return buckets[tn.bucket].grandchildren;
+	for (int i = 0; i < tn.numchildren; i++)
+		if (HasChildren(tn.child[i]))
+			return true;
+	return false;
+}
+
+
+// Size on disk of the group of children of an interior TopNode
+int QTree_OOC::GroupSize(int t)
+{
+	return (havecolor ? 6 : 4) * topnodes[t].numchildren +
+	       (HasGrandchildren(t) ? (wide ? 8 : 4) : 0);
+}
+
+
+// Size on disk of level k of bucket b
+long long QTree_OOC::LevelSize(int b, int k)
+{
+	const Bucket &bk = buckets[b];
+	return bk.levelsize[k] + (wide ? 4LL * bk.levelptrs[k] : 0);
+}
+
+
+// Quantize the children of each interior TopNode relative to their
+// parents, top-down.  Like QTree::WriteNodes, this replaces the positions
+// and radii by their quantized values.
+void QTree_OOC::QuantizeTop(int t)
+{
+	TopNode &tn = topnodes[t];
+	if (tn.bucket >= 0)
+		return;
+
+	int nodesize = havecolor ? 6 : 4;
+	int p = tn.node;
+	for (int i = 0; i < tn.numchildren; i++) {
+		TopNode &tc = topnodes[tn.child[i]];
+		int n = tc.node;
+		unsigned char *buf = tn.group + i * nodesize;
+
+		QSplat_SphereQuant::quantize(
+			top->pos[p][0], top->pos[p][1],
+			top->pos[p][2], top->r[p],
+			top->pos[n][0], top->pos[n][1],
+			top->pos[n][2], top->r[n],
+			buf);
+		QSplat_SphereQuant::lookup(
+			buf,
+			top->pos[p][0], top->pos[p][1],
+			top->pos[p][2], top->r[p],
+			top->pos[n][0], top->pos[n][1],
+			top->pos[n][2], top->r[n]);
+
+		int nc = (tc.bucket >= 0) ? buckets[tc.bucket].numchildren :
+					    tc.numchildren;
+		buf[1] |= nc ? nc - 1 : 0;
+		if (HasGrandchildren(tn.child[i]))
+			buf[1] |= 4;
+
+		QSplat_NormQuant::quantize(top->norm[n], buf+2,
+			dither_key(top->pos[n], top->r[n]));
+		QSplat_NormQuant::quantize_cone(top->Normcone(n), buf+2);
+		if (havecolor)
+			QSplat_ColorQuant::quantize(top->col[n], buf+4);
+	}
+
+	for (int i = 0; i < tn.numchildren; i++)
+		QuantizeTop(tn.child[i]);
+}
+
+
+// Rebuild each bucket, with its root now quantized, and write its levels
+// to nodefile.  Each group also gets a descriptor byte in descfile, so
+// that the child offsets can be found and patched later.  Since we don't
+// know yet whether the whole tree needs 64-bit offsets, both kinds are
+// written.
+void QTree_OOC::WriteBuckets()
+{
+	nodefile = OOC_TempFile();
+	descfile = OOC_TempFile();
+
+	for (int b = 0; b < buckets.size(); b++) {
+		Bucket &bk = buckets[b];
+		bucketarena.reset();
+		QTree qt(bk.n, &leaves[bk.begin], havecolor, false,
+			 &bucketarena);
+		qt.BuildTree();
+
+		int n = topnodes[bk.topnode].node;
+		qt.pos[qt.root][0] = top->pos[n][0];
+		qt.pos[qt.root][1] = top->pos[n][1];
+		qt.pos[qt.root][2] = top->pos[n][2];
+		qt.r[qt.root] = top->r[n];
+
+		bk.nodepos = ftello(nodefile);
+		bk.descpos = ftello(descfile);
+		qt.WriteNodes(nodefile, QTree::OFFSETS_BOTH, false,
+			      &bk.levelsize, &bk.levelptrs, descfile);
+	}
+}
+
+
+// Figure out where everything at the given level of the tree goes.  The
+// groups at each level are in the left-to-right order of their parents.
+void QTree_OOC::Place(int t, int level, long long &pos)
+{
+	TopNode &tn = topnodes[t];
+	if (tn.bucket >= 0) {
+		Bucket &bk = buckets[tn.bucket];
+		int k = level - tn.depth;
+		if (k >= 0 && k < bk.levelsize.size()) {
+			bk.where.push_back(pos);
+			pos += LevelSize(tn.bucket, k);
+		}
+		return;
+	}
+	if (tn.depth == level) {
+		tn.grouppos = pos;
+		pos += GroupSize(t);
+		return;
+	}
+	if (tn.depth == level - 1)
+		tn.childpos = pos;
+	if (tn.depth < level)
+		for (int i = 0; i < tn.numchildren; i++)
+			Place(tn.child[i], level, pos);
+}
+
+
+// Figure out where every level of the tree goes.  Returns the size of the
+// tree on disk.
+long long QTree_OOC::Layout(int &numlevels)
+{
+	for (int b = 0; b < buckets.size(); b++)
+		buckets[b].where.clear();
+
+	long long treesize = 0;
+	numlevels = 0;
+	while (1) {
+		long long pos = treesize;
+		Place(0, numlevels, pos);
+		if (pos == treesize)
+			break;
+		treesize = pos;
+		numlevels++;
+	}
+	return treesize;
+}
+
+
+// Write out one level of the tree below TopNode t
+void QTree_OOC::WriteLevel(FILE *f, int t, int level)
+{
+	const TopNode &tn = topnodes[t];
+	if (tn.bucket >= 0) {
+		int k = level - tn.depth;
+		if (k >= 0 && k < buckets[tn.bucket].levelsize.size())
+			CopyLevel(f, tn.bucket, k);
+		return;
+	}
+	if (tn.depth == level) {
+		if (HasGrandchildren(t))
+			write_offset(f, tn.childpos - tn.grouppos, wide, little);
+		unsigned char buf[4*6];
+		int groupsize = (havecolor ? 6 : 4) * tn.numchildren;
+		memcpy(buf, tn.group, groupsize);
+		if (little)
+			swap_words(buf, groupsize);
+		fwrite((void *)buf, groupsize, 1, f);
+		return;
+	}
+	if (tn.depth < level)
+		for (int i = 0; i < tn.numchildren; i++)
+			WriteLevel(f, tn.child[i], level);
+}
+
+
+// Copy level k of bucket b to the output.  The offsets to the next level
+// were computed as if the bucket's levels were contiguous, so they have
+// to be adjusted for whatever the other subtrees put in between.  The
+// buckets are always big-endian, so the nodes are swapped here if need be.
+void QTree_OOC::CopyLevel(FILE *f, int b, int k)
+{
+	Bucket &bk = buckets[b];
+	int nodesize = havecolor ? 6 : 4;
+	long long delta = 0;
+	if (k + 1 < bk.levelsize.size())
+		delta = bk.where[k+1] - bk.where[k] - LevelSize(b, k);
+
+	fseeko(nodefile, bk.nodepos, SEEK_SET);
+	fseeko(descfile, bk.descpos, SEEK_SET);
+	unsigned char buf[4*6];
+	long long left = bk.levelsize[k];
+	while (left > 0) {
+		unsigned char desc;
+		read_tmp(&desc, 1, descfile);
+		if (desc & 4) {
+			int offset;
+			long long wideoffset;
+			read_tmp(&offset, 4, nodefile);
+			read_tmp(&wideoffset, 8, nodefile);
+			FIX_LONG(offset);
+			FIX_LONGLONG(wideoffset);
+			write_offset(f, wide ? wideoffset + delta :
+					      (long long) offset + delta,
+				     wide, little);
+			left -= 4;
+		}
+		int groupsize = ((desc & 3) + 1) * nodesize;
+		read_tmp(buf, groupsize, nodefile);
+		if (little)
+			swap_words(buf, groupsize);
+		fwrite((void *)buf, groupsize, 1, f);
+		left -= groupsize;
+	}
+	bk.nodepos = ftello(nodefile);
+	bk.descpos = ftello(descfile);
+}
+
+
+// Write out the tree.  Note: like QTree::Write, this messes up the values
+// in the tree.
+bool QTree_OOC::Write(const char *qsfile, const std::string &comments)
+{
+	printf("Quantizing and writing... "); fflush(stdout);
+	QuantizeTop(0);
+	WriteBuckets();
+
+	// Lay out the levels of the tree.  Version 11 stores sizes and
+	// offsets in 32 bits; if that's not enough, do it again with 64-bit
+	// child offsets.
+	int numlevels;
+	wide = qsplat_make_wide;
+	little = qsplat_make_little_endian;
+	long long treesize = Layout(numlevels);
+	if (!wide && treesize > INT_MAX - 64) {
+		wide = true;
+		treesize = Layout(numlevels);
+	}
+
+	std::string tmpname;
+	FILE *f = QTree::OpenOutput(qsfile, tmpname);
+	if (!f)
+		return false;
+	if (!comments.empty())
+		write_comments(f, comments);
+
+	top->root = topnodes[0].node;
+	int numchildren = (topnodes[0].bucket >= 0) ?
+			  buckets[0].numchildren : topnodes[0].numchildren;
+	int padding = top->WriteHeader(f, treesize, numleaves,
+				       numchildren, wide, little);
+	for (int level = 0; level < numlevels; level++)
+		WriteLevel(f, 0, level);
+	if (padding) {
+		unsigned char buf[4] = { 0, 0, 0, 0 };
+		fwrite((void *)buf, padding, 1, f);
+	}
+	bool ok = !ferror(nodefile) && !ferror(descfile);
+	if (!QTree::CloseOutput(f, qsfile, tmpname, ok))
+		return false;
+	printf("Done.\n");
+	return true;
+}
+
+
+// Build the tree of one fragment, and write it to a temporary file
+void QTree_OOC::BuildFragmentTask(void *arg)
+{
+	FragmentTask *t = (FragmentTask *) arg;
+	t->arena->reset();
+	QTree qt(t->n, &t->qt->leaves[t->begin], t->qt->havecolor, false,
+		 t->arena);
+	qt.BuildTree();
+	rewind(t->f);
+	t->ok = qt.WriteFragment(t->f);
+	fflush(t->f);
+	t->len = ftello(t->f);
+	if (ferror(t->f))
+		t->ok = false;
+}
+
+
+// Copy the first len bytes of temporary file from to f
+bool OOC_AppendTemp(FILE *f, FILE *from, long long len)
+{
+	unsigned char buf[OOC_BUFSIZE / 4];
+	rewind(from);
+	while (len > 0) {
+		size_t n = (size_t) min(len, (long long) sizeof(buf));
+		read_tmp(buf, n, from);
+		if (!fwrite((void *)buf, n, 1, f))
+			return false;
+		len -= n;
+	}
+	return true;
+}
+
+
+// Write each run of buckets as a separate fragment
+bool QTree_OOC::WriteFragments(const char *qsfile, const std::string &comments,
+			       int jobs)
+{
+	// Buckets are lumped together until they fill up the memory we
+	// have, and small ones always get lumped in with their neighbors.
+	// Since the buckets come from recursive splits, each run of them
+	// covers a compact piece of space.
+	std::vector<int> fragbegin;
+	int fragn = 0;
+	for (int b = 0; b < buckets.size(); b++) {
+		if (fragbegin.empty() ||
+		    (fragn >= MIN_BUCKET && fragn + buckets[b].n > bucketmax)) {
+			fragbegin.push_back(buckets[b].begin);
+			fragn = 0;
+		}
+		fragn += buckets[b].n;
+	}
+	if (fragbegin.size() > 1 && fragn < MIN_BUCKET)
+		fragbegin.pop_back();
+	fragbegin.push_back(numleaves);
+	int nfrags = fragbegin.size() - 1;
+	jobs = max(min(jobs, nfrags), 1);
+
+	printf("Building and writing %d fragments, %d at a time... ",
+	       nfrags, jobs);
+	fflush(stdout);
+
+	std::string tmpname;
+	FILE *f = QTree::OpenOutput(qsfile, tmpname);
+	if (!f)
+		return false;
+	if (!comments.empty())
+		write_comments(f, comments);
+
+	// Build a batch of fragments at once, then copy them to the output
+	// in order
+	std::vector<FragmentTask> tasks(jobs);
+	for (int j = 0; j < jobs; j++) {
+		tasks[j].qt = this;
+		tasks[j].arena = new Arena(ARENA_HUGE_BLOCK, true);
+		tasks[j].f = OOC_TempFile();
+	}
+	bool ok = true;
+	for (int i = 0; i < nfrags && ok; i += jobs) {
+		int njobs = min(jobs, nfrags - i);
+		QSplat_TaskPool::TaskGroup g;
+		for (int j = 0; j < njobs; j++) {
+			tasks[j].begin = fragbegin[i+j];
+			tasks[j].n = fragbegin[i+j+1] - fragbegin[i+j];
+			if (j)
+				QSplat_TaskPool::Spawn(g, BuildFragmentTask,
+						       &tasks[j]);
+		}
+		BuildFragmentTask(&tasks[0]);
+		QSplat_TaskPool::Wait(g);
+		for (int j = 0; j < njobs && ok; j++)
+			ok = tasks[j].ok &&
+			     OOC_AppendTemp(f, tasks[j].f, tasks[j].len);
+	}
+
+	if (ok)
+		ok = write_index(f);
+
+	size_t peak = 0;
+	for (int j = 0; j < jobs; j++) {
+		peak = max(peak, tasks[j].arena->stats().peak);
+		delete tasks[j].arena;
+		fclose(tasks[j].f);
+	}
+	if (!QTree::CloseOutput(f, qsfile, tmpname, ok))
+		return false;
+	printf("using %d MB per job... Done.\n", (int) (peak >> 20));
+	return true;
+}
@@ -0,0 +1,121 @@
+#ifndef QSPLAT_MAKE_OUTOFCORE_H
+#define QSPLAT_MAKE_OUTOFCORE_H
+/*
+qsplat_make_outofcore.h
+Building trees for meshes that don't fit in memory.
+
+The leaves stay in a memory-mapped temporary file, and are partitioned in
+place by the same recursive midpoint splits QTree::BuildLeaves() uses, until
+each bucket is small enough to build in memory.  The subtree of each bucket
+is then built and written out on its own, and finally the top levels of the
+tree are stitched on top.  The tree is the same one QTree would build.
+
+Alternatively, the buckets can be built several at a time and written out
+as separate fragments, which the viewer draws one after the other.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include "qsplat_make_qtree_v11.h"
+
+
+// Scratch memory for arrays that might be too big for memory.  Once
+// OOC_Init() has been called, these are backed by temporary files.
+extern void OOC_Init(const char *tmpdir);
+extern void *OOC_Alloc(size_t bytes);
+extern void OOC_Free(void *p, size_t bytes);
+extern FILE *OOC_TempFile();
+extern bool OOC_AppendTemp(FILE *f, FILE *from, long long len);
+
+template <class T>
+static inline T *OOC_New(size_t n)
+{
+	return (T *) OOC_Alloc(n * sizeof(T));
+}
+
+template <class T>
+static inline void OOC_Delete(T *p, size_t n)
+{
+	OOC_Free((void *) p, n * sizeof(T));
+}
+
+
+// The out-of-core counterpart of QTree
+class QTree_OOC {
+private:
+	// A subtree that is built in memory
+	struct Bucket {
+		int begin, n;			// Which leaves
+		int topnode;			// The TopNode for the root
+		int numchildren;
+		bool grandchildren;
+		std::vector<long long> levelsize;	// Size of each level on disk
+		std::vector<int> levelptrs;	// Child offsets in each level
+		long long nodepos, descpos;	// Next level in nodefile, descfile
+		std::vector<long long> where;	// Where each level ends up
+	};
+
+	// A node in the top levels of the tree
+	struct TopNode {
+		int node;			// Which node of top
+		int bucket;			// -1 for interior nodes
+		int numchildren;
+		int child[4];
+		int depth;
+		long long grouppos, childpos;
+		unsigned char group[4*6];	// Quantized children
+	};
+
+	int numleaves, bucketmax;
+	QTree_Node *leaves;
+	int leaves_alloced;
+	bool havecolor;
+	bool wide;			// Writing a version 12 fragment
+	bool little;			// Writing little-endian nodes
+	std::vector<Bucket> buckets;
+	std::vector<TopNode> topnodes;
+	QTree *top;			// Bucket roots and the nodes above them
+	Arena bucketarena;		// Reused for the tree of each bucket
+	FILE *nodefile, *descfile;
+
+	int Partition(int begin, int end);
+	int SplitLeaves(int begin, int end, int depth);
+	void CombineTop(int t);
+	void QuantizeTop(int t);
+	void WriteBuckets();
+	bool HasChildren(int t);
+	bool HasGrandchildren(int t);
+	int GroupSize(int t);
+	long long LevelSize(int b, int k);
+	void Place(int t, int level, long long &pos);
+	long long Layout(int &numlevels);
+	void WriteLevel(FILE *f, int t, int level);
+	void CopyLevel(FILE *f, int b, int k);
+
+	// Building a piece of the leaves as a fragment of its own
+	struct FragmentTask {
+		QTree_OOC *qt;
+		int begin, n;		// Which leaves
+		Arena *arena;
+		FILE *f;		// Where the fragment goes
+		long long len;
+		bool ok;
+	};
+	static void BuildFragmentTask(void *arg);
+
+public:
+	QTree_OOC(int _numleaves, QTree_Node *_leaves, bool _havecolor,
+		  size_t memlimit);
+	~QTree_OOC();
+	void BuildTree();
+	bool Write(const char *qsfile, const std::string &comments);
+
+	// Instead of building one tree, write runs of buckets as separate
+	// fragments of the .qs file, building this many at a time.  Each
+	// uses about as much memory as the tree of a bucket.
+	bool WriteFragments(const char *qsfile, const std::string &comments,
+			    int jobs);
+};
+
+#endif
@@ -0,0 +1,1053 @@
+/*
+qsplat_make_ply.cpp
+Reading triangle meshes from .ply files.
+
+Reads ascii, binary_big_endian, and binary_little_endian files, with any set
+of vertex and face properties in any order, as long as the vertices have x,
+y, and z.  Faces with more than 3 vertices are split into fans, and
+triangle strips are unpacked into triangles.  Colors come from red, green,
+and blue (or diffuse_red, etc.) vertex properties.
+
+The file is mapped into memory, and the big blocks of vertices and faces
+are decoded in parallel.  Input that can't be mapped (e.g. a pipe, given
+as "-" for stdin) is first copied to a temporary file.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include "qsplat_util.h"
+#include "qsplat_make_from_mesh.h"
+#include "qsplat_make_outofcore.h"
+#include "qsplat_threads.h"
+
+#ifdef WIN32
+# include <io.h>
+# include <fcntl.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
+
+
+// Vertices and faces are decoded in parallel in pieces at least this big
+#define PLY_GRAIN 65536
+
+// Size of the pieces into which ascii data is split
+#define PLY_ASCII_CHUNK (1 << 20)
+
+
+// Scalar types that can appear in ply files
+enum { PLY_CHAR, PLY_UCHAR, PLY_SHORT, PLY_USHORT,
+       PLY_INT, PLY_UINT, PLY_FLOAT, PLY_DOUBLE, PLY_NTYPES };
+static const char *ply_type_names[PLY_NTYPES][2] = {
+	{ "char", "int8" }, { "uchar", "uint8" },
+	{ "short", "int16" }, { "ushort", "uint16" },
+	{ "int", "int32" }, { "uint", "uint32" },
+	{ "float", "float32" }, { "double", "float64" } };
+static const int ply_type_size[PLY_NTYPES] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+// A property, as described in the header
+struct PlyProperty {
+	std::string name;
+	int type;		// Type of the value, or of the list items
+	int count_type;		// Type of the list count, or -1 if not a list
+	int offset;		// Offset within a binary element (-1 if varies)
+};
+
+// An element (vertex, face, etc.), as described in the header
+struct PlyElement {
+	std::string name;
+	int count;
+	std::vector<PlyProperty> props;
+	int size;		// Size of a binary element (-1 if varies)
+};
+
+// A piece of the ascii data
+struct PlyChunk {
+	const char *begin, *end;
+	int firstline, nlines;
+	int firsttri, ntris;
+	std::vector<int> strips;
+};
+
+// Everything we need to know while decoding
+struct PlyReader {
+	const unsigned char *data, *end;
+	bool ascii, swap;
+	std::vector<PlyElement> elements;
+	int vertex_elem, face_elem, tstrip_elem;
+	int vprop[6];		// Which properties are x, y, z, r, g, b
+	int fprop;		// Which property is the list of vertices
+	bool have_colors;
+
+	// Binary data
+	const unsigned char *vdata, *fdata;
+	int fsize;		// Size of a face, if they're all triangles
+
+	// Ascii data
+	std::vector<PlyChunk> chunks;
+	std::vector<int> elemline;
+
+	QTree_Node *leaves;
+	int numleaves;
+	face *faces;
+	std::atomic<bool> bad_data, bad_index, not_tris, garbage;
+};
+
+
+// Byte-swapping loads of unaligned binary values
+static inline unsigned short get_u16(const unsigned char *p, bool swap)
+{
+	unsigned short x;
+	memcpy(&x, p, 2);
+	return swap ? (unsigned short) SWAP_SHORT(x) : x;
+}
+
+static inline unsigned get_u32(const unsigned char *p, bool swap)
+{
+	unsigned x;
+	memcpy(&x, p, 4);
+	return swap ? SWAP_LONG(x) : x;
+}
+
+static inline double get_value(const unsigned char *p, int type, bool swap)
+{
+	switch (type) {
+		case PLY_CHAR:
+			return *(const signed char *) p;
+		case PLY_UCHAR:
+			return *p;
+		case PLY_SHORT:
+			return (short) get_u16(p, swap);
+		case PLY_USHORT:
+			return get_u16(p, swap);
+		case PLY_INT:
+			return (int) get_u32(p, swap);
+		case PLY_UINT:
+			return get_u32(p, swap);
+		case PLY_FLOAT: {
+			unsigned x = get_u32(p, swap);
+			float f;
+			memcpy(&f, &x, 4);
+			return f;
+		}
+		default: {
+			unsigned x[2];
+			memcpy(x, p, 8);
+			if (swap) {
+				unsigned tmp = SWAP_LONG(x[0]);
+				x[0] = SWAP_LONG(x[1]);
+				x[1] = tmp;
+			}
+			double d;
+			memcpy(&d, x, 8);
+			return d;
+		}
+	}
+}
+
+static inline int get_int(const unsigned char *p, int type, bool swap)
+{
+	if (type == PLY_INT || type == PLY_UINT)
+		return (int) get_u32(p, swap);
+	return (int) get_value(p, type, swap);
+}
+
+
+// Convert a color component to a byte
+static inline unsigned char to_color(double x, int type)
+{
+	if (type == PLY_FLOAT || type == PLY_DOUBLE)
+		x = x * 255.0 + 0.5;
+	return (unsigned char) (x < 0.0 ? 0.0 : x > 255.0 ? 255.0 : x);
+}
+
+
+// Get the whole input file into memory
+static bool map_input(const char *plyfile, const unsigned char *&data,
+		      size_t &len)
+{
+#ifdef WIN32
+	FILE *f = strcmp(plyfile, "-") ? fopen(plyfile, "rb") : stdin;
+	if (!f) {
+		fprintf(stderr, "Can't open plyfile %s\n", plyfile);
+		return false;
+	}
+	if (f == stdin)
+		_setmode(_fileno(stdin), _O_BINARY);
+	size_t size = 1 << 20;
+	unsigned char *buf = (unsigned char *) malloc(size);
+	len = 0;
+	while (buf) {
+		if (len == size)
+			buf = (unsigned char *) realloc(buf, size *= 2);
+		size_t n = buf ? fread(buf + len, 1, size - len, f) : 0;
+		if (!n)
+			break;
+		len += n;
+	}
+	if (f != stdin)
+		fclose(f);
+	if (!buf) {
+		fprintf(stderr, "Not enough memory to read %s\n", plyfile);
+		return false;
+	}
+	data = buf;
+#else
+	int fd = strcmp(plyfile, "-") ? open(plyfile, O_RDONLY) : 0;
+	if (fd < 0) {
+		fprintf(stderr, "Can't open plyfile %s\n", plyfile);
+		return false;
+	}
+
+	// If it's not a plain file, copy it somewhere we can map it
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		FILE *f = OOC_TempFile();
+		char buf[65536];
+		ssize_t n;
+		while ((n = read(fd, buf, sizeof(buf))) > 0)
+			fwrite(buf, n, 1, f);
+		if (fd)
+			close(fd);
+		fflush(f);
+		fd = dup(fileno(f));
+		fclose(f);
+		fstat(fd, &st);
+	}
+
+	len = st.st_size;
+	void *p = len ? mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (fd)
+		close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Can't map plyfile %s\n", plyfile);
+		return false;
+	}
+# ifdef MADV_WILLNEED
+	madvise(p, len, MADV_WILLNEED);
+# endif
+	data = (const unsigned char *) p;
+#endif
+	return true;
+}
+
+static void unmap_input(const unsigned char *data, size_t len)
+{
+#ifdef WIN32
+	free((void *) data);
+#else
+	munmap((void *) data, len);
+#endif
+}
+
+
+// Get the next line of the header, without the newline
+static bool get_line(const char *&p, const char *end, std::string &line)
+{
+	if (p >= end)
+		return false;
+	const char *eol = (const char *) memchr(p, '\n', end - p);
+	if (!eol)
+		eol = end;
+	line.assign(p, eol);
+	p = (eol < end) ? eol + 1 : end;
+	while (!line.empty() && line[line.size()-1] == '\r')
+		line.erase(line.size()-1);
+	return true;
+}
+
+static void split_words(const std::string &line, std::vector<std::string> &words)
+{
+	words.clear();
+	const char *p = line.c_str();
+	while (1) {
+		while (*p && isspace(*p))
+			p++;
+		if (!*p)
+			break;
+		const char *q = p;
+		while (*q && !isspace(*q))
+			q++;
+		words.push_back(std::string(p, q));
+		p = q;
+	}
+}
+
+static int parse_type(const std::string &s)
+{
+	for (int i = 0; i < PLY_NTYPES; i++)
+		if (s == ply_type_names[i][0] || s == ply_type_names[i][1])
+			return i;
+	return -1;
+}
+
+static int find_prop(const PlyElement &e, const char *name)
+{
+	for (int i = 0; i < e.props.size(); i++)
+		if (e.props[i].name == name)
+			return i;
+	return -1;
+}
+
+
+// Read the header.  Returns a pointer to the data, or NULL on error.
+static const unsigned char *read_header(PlyReader &r, std::string &comments)
+{
+	const char *p = (const char *) r.data, *end = (const char *) r.end;
+	std::string line;
+	std::vector<std::string> words;
+
+	if (!get_line(p, end, line) || line != "ply") {
+		fprintf(stderr, "Not a ply file.\n");
+		return NULL;
+	}
+
+	bool have_format = false;
+	while (1) {
+		if (!get_line(p, end, line)) {
+			fprintf(stderr, "Expected \"end_header\"\n");
+			return NULL;
+		}
+		split_words(line, words);
+		if (words.empty())
+			continue;
+
+		if (words[0] == "end_header") {
+			break;
+		} else if (words[0] == "comment") {
+			if (line.size() >= 8)
+				comments += line.substr(8) + "\n";
+		} else if (words[0] == "obj_info") {
+			continue;
+		} else if (words[0] == "format" && words.size() >= 2) {
+			if (words[1] == "ascii") {
+				r.ascii = true;
+			} else if (words[1] == "binary_big_endian") {
+#ifdef WE_ARE_LITTLE_ENDIAN
+				r.swap = true;
+#endif
+			} else if (words[1] == "binary_little_endian") {
+#ifndef WE_ARE_LITTLE_ENDIAN
+				r.swap = true;
+#endif
+			} else {
+				fprintf(stderr, "Unknown ply format %s\n", words[1].c_str());
+				return NULL;
+			}
+			have_format = true;
+		} else if (words[0] == "element" && words.size() == 3) {
+			PlyElement e;
+			e.name = words[1];
+			e.count = atoi(words[2].c_str());
+			e.size = 0;
+			if (e.count < 0) {
+				fprintf(stderr, "Bad element count: %s\n", line.c_str());
+				return NULL;
+			}
+			r.elements.push_back(e);
+		} else if (words[0] == "property" && !r.elements.empty()) {
+			PlyElement &e = r.elements.back();
+			PlyProperty prop;
+			prop.offset = e.size;
+			if (words.size() == 3) {
+				prop.type = parse_type(words[1]);
+				prop.count_type = -1;
+				prop.name = words[2];
+			} else if (words.size() == 5 && words[1] == "list") {
+				prop.count_type = parse_type(words[2]);
+				prop.type = parse_type(words[3]);
+				prop.name = words[4];
+				if (prop.count_type < 0 ||
+				    prop.count_type >= PLY_FLOAT)
+					prop.type = -1;
+			} else {
+				prop.type = -1;
+			}
+			if (prop.type < 0) {
+				fprintf(stderr, "Unsupported property: %s\n", line.c_str());
+				return NULL;
+			}
+			if (e.size >= 0 && prop.count_type < 0)
+				e.size += ply_type_size[prop.type];
+			else
+				e.size = -1;
+			e.props.push_back(prop);
+		} else {
+			fprintf(stderr, "Unexpected line in header: %s\n", line.c_str());
+			return NULL;
+		}
+	}
+
+	if (!have_format) {
+		fprintf(stderr, "Expected \"format\"\n");
+		return NULL;
+	}
+	return (const unsigned char *) p;
+}
+
+
+// Find the vertex and face (or tstrip) elements and properties
+static bool find_elements(PlyReader &r)
+{
+	r.vertex_elem = r.face_elem = r.tstrip_elem = -1;
+	for (int i = 0; i < r.elements.size(); i++) {
+		const std::string &name = r.elements[i].name;
+		if (name == "vertex" && r.vertex_elem < 0)
+			r.vertex_elem = i;
+		else if (name == "face" && r.face_elem < 0)
+			r.face_elem = i;
+		else if (name == "tristrips" && r.tstrip_elem < 0)
+			r.tstrip_elem = i;
+	}
+	if (r.vertex_elem < 0) {
+		fprintf(stderr, "Expected \"element vertex\"\n");
+		return false;
+	}
+
+	const PlyElement &v = r.elements[r.vertex_elem];
+	static const char *vnames[6][2] = {
+		{ "x", "x" }, { "y", "y" }, { "z", "z" },
+		{ "red", "diffuse_red" }, { "green", "diffuse_green" },
+		{ "blue", "diffuse_blue" } };
+	for (int i = 0; i < 6; i++) {
+		r.vprop[i] = find_prop(v, vnames[i][0]);
+		if (r.vprop[i] < 0)
+			r.vprop[i] = find_prop(v, vnames[i][1]);
+		if (r.vprop[i] >= 0 && v.props[r.vprop[i]].count_type >= 0)
+			r.vprop[i] = -1;
+		if (i < 3 && r.vprop[i] < 0) {
+			fprintf(stderr, "Expected \"property float %s\"\n",
+				vnames[i][0]);
+			return false;
+		}
+	}
+	r.have_colors = (r.vprop[3] >= 0 && r.vprop[4] >= 0 && r.vprop[5] >= 0);
+	if (!r.ascii && v.size < 0) {
+		fprintf(stderr, "Can't handle lists in binary vertices.\n");
+		return false;
+	}
+
+	// Faces if we have them, else triangle strips
+	if (r.face_elem < 0) {
+		r.face_elem = r.tstrip_elem;
+	} else {
+		r.tstrip_elem = -1;
+	}
+	r.fprop = -1;
+	if (r.face_elem >= 0) {
+		const PlyElement &f = r.elements[r.face_elem];
+		r.fprop = find_prop(f, "vertex_indices");
+		if (r.fprop < 0)
+			r.fprop = find_prop(f, "vertex_index");
+		if (r.fprop < 0 || f.props[r.fprop].count_type < 0 ||
+		    f.props[r.fprop].type >= PLY_FLOAT) {
+			fprintf(stderr, "Expected \"property list ... vertex_indices\"\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Write out the triangles in a polygon with n vertices, and return the
+// number written
+static inline int add_polygon(PlyReader &r, const int *v, int n, face *f)
+{
+	int ntris = 0;
+	for (int i = 0; i < n; i++) {
+		if (v[i] < 0 || v[i] >= r.numleaves) {
+			r.bad_index = true;
+			return 0;
+		}
+	}
+	for (int i = 1; i < n - 1; i++, ntris++) {
+		f[ntris][0] = v[0];
+		f[ntris][1] = v[i];
+		f[ntris][2] = v[i+1];
+	}
+	return ntris;
+}
+
+
+// Decode some binary vertices
+static void decode_binary_vertices(void *arg, int begin, int end)
+{
+	PlyReader *r = (PlyReader *) arg;
+	const PlyElement &e = r->elements[r->vertex_elem];
+	const PlyProperty *prop[6];
+	for (int j = 0; j < 6; j++)
+		prop[j] = (r->vprop[j] >= 0) ? &e.props[r->vprop[j]] : NULL;
+	bool swap = r->swap;
+	int size = e.size;
+
+	// The usual case is three floats in a row - make that go fast
+	const unsigned char *p = r->vdata + (size_t) begin * size;
+	if (prop[0]->type == PLY_FLOAT && prop[1]->type == PLY_FLOAT &&
+	    prop[2]->type == PLY_FLOAT &&
+	    prop[1]->offset == prop[0]->offset + 4 &&
+	    prop[2]->offset == prop[0]->offset + 8) {
+		int offset = prop[0]->offset;
+		for (int i = begin; i < end; i++, p += size) {
+			unsigned x[3];
+			memcpy(x, p + offset, 12);
+			if (swap) {
+				x[0] = SWAP_LONG(x[0]);
+				x[1] = SWAP_LONG(x[1]);
+				x[2] = SWAP_LONG(x[2]);
+			}
+			memcpy(r->leaves[i].pos, x, 12);
+		}
+	} else {
+		for (int i = begin; i < end; i++, p += size)
+			for (int j = 0; j < 3; j++)
+				r->leaves[i].pos[j] = (float) get_value(
+					p + prop[j]->offset, prop[j]->type, swap);
+	}
+
+	if (!r->have_colors)
+		return;
+	p = r->vdata + (size_t) begin * size;
+	for (int i = begin; i < end; i++, p += size)
+		for (int j = 0; j < 3; j++) {
+			const PlyProperty *c = prop[3+j];
+			r->leaves[i].col[j] = (c->type == PLY_UCHAR) ?
+				p[c->offset] :
+				to_color(get_value(p + c->offset, c->type, swap),
+					 c->type);
+		}
+}
+
+
+// Decode some binary faces, assuming they're all triangles
+static void decode_binary_faces(void *arg, int begin, int end)
+{
+	PlyReader *r = (PlyReader *) arg;
+	const PlyProperty &prop = r->elements[r->face_elem].props[r->fprop];
+	int count_type = prop.count_type, type = prop.type;
+	int itemsize = ply_type_size[type];
+	const unsigned char *p = r->fdata + (size_t) begin * r->fsize +
+				 prop.offset;
+	bool swap = r->swap;
+
+	for (int i = begin; i < end; i++, p += r->fsize) {
+		if (get_int(p, count_type, swap) != 3) {
+			r->not_tris = true;
+			return;
+		}
+		const unsigned char *q = p + ply_type_size[count_type];
+		int v[3];
+		v[0] = get_int(q, type, swap);
+		v[1] = get_int(q + itemsize, type, swap);
+		v[2] = get_int(q + 2*itemsize, type, swap);
+		add_polygon(*r, v, 3, r->faces + i);
+	}
+}
+
+
+// Find the size of one binary element, and the list in property "which".
+// Returns 0 if the element runs off the end of the file.
+static size_t binary_element(const PlyReader &r, const PlyElement &e,
+			     const unsigned char *p, int which,
+			     const unsigned char *&list, int &n)
+{
+	if (e.size >= 0 && which < 0)
+		return (p + e.size <= r.end) ? e.size : 0;
+
+	size_t size = 0;
+	for (int i = 0; i < e.props.size(); i++) {
+		const PlyProperty &prop = e.props[i];
+		if (prop.count_type < 0) {
+			size += ply_type_size[prop.type];
+			continue;
+		}
+		int countsize = ply_type_size[prop.count_type];
+		if (p + size + countsize > r.end)
+			return 0;
+		int count = get_int(p + size, prop.count_type, r.swap);
+		if (count < 0)
+			return 0;
+		size += countsize;
+		if (i == which) {
+			list = p + size;
+			n = count;
+		}
+		size += (size_t) count * ply_type_size[prop.type];
+		if (p + size > r.end)
+			return 0;
+	}
+	return (p + size <= r.end) ? size : 0;
+}
+
+
+// Read the binary data
+static bool read_binary(PlyReader &r, const unsigned char *p,
+			int &numfaces, face *&faces,
+			std::vector<int> &strips)
+{
+	for (int ei = 0; ei < r.elements.size(); ei++) {
+		const PlyElement &e = r.elements[ei];
+		const unsigned char *list = NULL;
+		int n = 0;
+
+		if (ei == r.vertex_elem) {
+			progress(" Reading %d vertices... ", e.count);
+			if ((size_t) (r.end - p) / e.size < (size_t) e.count)
+				return false;
+			r.vdata = p;
+			QSplat_TaskPool::ParallelFor(0, e.count, PLY_GRAIN,
+						     decode_binary_vertices, &r);
+			p += (size_t) e.count * e.size;
+			progress("Done.\n");
+
+		} else if (ei == r.face_elem && r.tstrip_elem < 0) {
+			progress(" Reading %d faces... ", e.count);
+
+			// If every face is a triangle, they're all the
+			// same size, and we can decode them in parallel
+			const PlyProperty &prop = e.props[r.fprop];
+			bool fixed = true;
+			r.fsize = 0;
+			for (int i = 0; i < e.props.size(); i++) {
+				const PlyProperty &pi = e.props[i];
+				if (pi.count_type < 0)
+					r.fsize += ply_type_size[pi.type];
+				else if (i == r.fprop)
+					r.fsize += ply_type_size[pi.count_type] +
+						   3 * ply_type_size[pi.type];
+				else
+					fixed = false;
+			}
+			r.fdata = p;
+			if (fixed && prop.offset >= 0 &&
+			    (size_t) (r.end - p) / r.fsize >= (size_t) e.count) {
+				numfaces = e.count;
+				faces = OOC_New<face>(numfaces);
+				r.faces = faces;
+				QSplat_TaskPool::ParallelFor(0, e.count,
+					PLY_GRAIN, decode_binary_faces, &r);
+				if (!r.not_tris) {
+					p += (size_t) e.count * r.fsize;
+					progress("Done.\n");
+					continue;
+				}
+				OOC_Delete(faces, numfaces);
+				faces = NULL;
+				r.not_tris = false;
+			}
+
+			// Else count the triangles, then fill them in
+			numfaces = 0;
+			const unsigned char *q = p;
+			for (int i = 0; i < e.count; i++) {
+				size_t size = binary_element(r, e, q, r.fprop, list, n);
+				if (!size)
+					return false;
+				if (n >= 3)
+					numfaces += n - 2;
+				q += size;
+			}
+			progress("%d triangles... ", numfaces);
+			faces = OOC_New<face>(numfaces);
+			int whichface = 0;
+			std::vector<int> v;
+			for (int i = 0; i < e.count; i++) {
+				p += binary_element(r, e, p, r.fprop, list, n);
+				v.resize(n);
+				for (int j = 0; j < n; j++)
+					v[j] = get_int(list + j * ply_type_size[prop.type],
+						       prop.type, r.swap);
+				if (n >= 3)
+					whichface += add_polygon(r, &v[0], n,
+								 faces + whichface);
+			}
+			progress("Done.\n");
+
+		} else if (ei == r.tstrip_elem) {
+			progress(" Reading triangle strips... ");
+			const PlyProperty &prop = e.props[r.fprop];
+			for (int i = 0; i < e.count; i++) {
+				size_t size = binary_element(r, e, p, r.fprop, list, n);
+				if (!size)
+					return false;
+				if (i)
+					strips.push_back(-1);
+				for (int j = 0; j < n; j++)
+					strips.push_back(get_int(list + j * ply_type_size[prop.type],
+								 prop.type, r.swap));
+				p += size;
+			}
+			progress("Done.\n");
+
+		} else {
+			// Something we don't care about - skip it
+			if (e.size >= 0) {
+				if (e.size && (size_t) (r.end - p) / e.size < (size_t) e.count)
+					return false;
+				p += (size_t) e.count * e.size;
+				continue;
+			}
+			for (int i = 0; i < e.count; i++) {
+				size_t size = binary_element(r, e, p, -1, list, n);
+				if (!size)
+					return false;
+				p += size;
+			}
+		}
+	}
+
+	if (p < r.end)
+		fprintf(stderr, "Warning: ignored excess garbage at end of ply file.\n");
+	return true;
+}
+
+
+// Read the next number on an ascii line
+static inline bool ascii_number(const char *&p, const char *end, double &x)
+{
+	while (p < end && isspace(*p))
+		p++;
+	char buf[64];
+	int n = 0;
+	while (p < end && !isspace(*p) && n < sizeof(buf) - 1)
+		buf[n++] = *p++;
+	buf[n] = '\0';
+	char *numend;
+	x = strtod(buf, &numend);
+	return n && numend == buf + n;
+}
+
+
+// Parse an ascii element.  The values of the scalar properties go in vals,
+// and the list in property "which" goes in list (if it's not NULL).
+// Returns the length of that list, or -1 on error.
+static int ascii_element(const PlyElement &e, const char *p, const char *end,
+			 double *vals, int which, std::vector<int> *list)
+{
+	int n = 0;
+	for (int i = 0; i < e.props.size(); i++) {
+		double x;
+		if (!ascii_number(p, end, x))
+			return -1;
+		if (e.props[i].count_type < 0) {
+			if (vals)
+				vals[i] = x;
+			continue;
+		}
+		int count = (int) x;
+		if (count < 0)
+			return -1;
+		if (i == which) {
+			n = count;
+			if (!list)
+				return n;
+			list->clear();
+		}
+		for (int j = 0; j < count; j++) {
+			if (!ascii_number(p, end, x))
+				return -1;
+			if (i == which)
+				list->push_back((int) x);
+		}
+	}
+	return n;
+}
+
+
+// Which element does a given line of an ascii file belong to?
+static inline int ascii_which_element(const PlyReader &r, int line, int e)
+{
+	while (e < r.elements.size() &&
+	       line >= r.elemline[e] + r.elements[e].count)
+		e++;
+	return e;
+}
+
+
+// Count the lines in some ascii chunks
+static void count_ascii_lines(void *arg, int begin, int end)
+{
+	PlyReader *r = (PlyReader *) arg;
+	for (int c = begin; c < end; c++) {
+		PlyChunk &chunk = r->chunks[c];
+		const char *p = chunk.begin;
+		chunk.nlines = 0;
+		while (p < chunk.end) {
+			const char *eol = (const char *) memchr(p, '\n', chunk.end - p);
+			chunk.nlines++;
+			p = eol ? eol + 1 : chunk.end;
+		}
+	}
+}
+
+
+// Parse the vertices in some ascii chunks, count the triangles, and grab
+// the triangle strips
+static void parse_ascii_vertices(void *arg, int begin, int end)
+{
+	PlyReader *r = (PlyReader *) arg;
+	const PlyElement &v = r->elements[r->vertex_elem];
+	std::vector<double> vals(v.props.size());
+	std::vector<int> list;
+
+	for (int c = begin; c < end; c++) {
+		PlyChunk &chunk = r->chunks[c];
+		chunk.ntris = 0;
+		const char *p = chunk.begin;
+		int e = 0;
+		for (int line = chunk.firstline; p < chunk.end; line++) {
+			const char *eol = (const char *) memchr(p, '\n', chunk.end - p);
+			if (!eol)
+				eol = chunk.end;
+			e = ascii_which_element(*r, line, e);
+			int i = (e < r->elements.size()) ? line - r->elemline[e] : 0;
+
+			if (e == r->vertex_elem) {
+				if (ascii_element(v, p, eol, &vals[0], -1, NULL) < 0)
+					r->bad_data = true;
+				for (int j = 0; j < 3; j++)
+					r->leaves[i].pos[j] = (float) vals[r->vprop[j]];
+				if (r->have_colors)
+					for (int j = 0; j < 3; j++)
+						r->leaves[i].col[j] = to_color(
+							vals[r->vprop[3+j]],
+							v.props[r->vprop[3+j]].type);
+			} else if (e == r->face_elem) {
+				const PlyElement &f = r->elements[e];
+				bool strips = (r->tstrip_elem >= 0);
+				int n = ascii_element(f, p, eol, NULL, r->fprop,
+						      strips ? &list : NULL);
+				if (n < 0) {
+					r->bad_data = true;
+				} else if (strips) {
+					if (i)
+						chunk.strips.push_back(-1);
+					chunk.strips.insert(chunk.strips.end(),
+							    list.begin(), list.end());
+				} else if (n >= 3) {
+					chunk.ntris += n - 2;
+				}
+			} else if (e == r->elements.size()) {
+				// Past the end of the data - better be blank
+				while (p < eol && isspace(*p))
+					p++;
+				if (p < eol)
+					r->garbage = true;
+			}
+			p = eol + 1;
+		}
+	}
+}
+
+
+// Fill in the faces from some ascii chunks
+static void parse_ascii_faces(void *arg, int begin, int end)
+{
+	PlyReader *r = (PlyReader *) arg;
+	const PlyElement &f = r->elements[r->face_elem];
+	std::vector<int> list;
+
+	for (int c = begin; c < end; c++) {
+		PlyChunk &chunk = r->chunks[c];
+		face *next = r->faces + chunk.firsttri;
+		const char *p = chunk.begin;
+		int e = 0;
+		for (int line = chunk.firstline; p < chunk.end; line++) {
+			const char *eol = (const char *) memchr(p, '\n', chunk.end - p);
+			if (!eol)
+				eol = chunk.end;
+			e = ascii_which_element(*r, line, e);
+			if (e == r->face_elem) {
+				int n = ascii_element(f, p, eol, NULL, r->fprop, &list);
+				if (n >= 3)
+					next += add_polygon(*r, &list[0], n, next);
+			}
+			p = eol + 1;
+		}
+	}
+}
+
+
+// Read ascii data
+static bool read_ascii(PlyReader &r, const unsigned char *data,
+		       int &numfaces, face *&faces,
+		       std::vector<int> &strips)
+{
+	// Split the data into chunks of whole lines, and count the lines
+	const char *p = (const char *) data, *end = (const char *) r.end;
+	while (p < end) {
+		PlyChunk chunk;
+		chunk.begin = p;
+		p += min((size_t) PLY_ASCII_CHUNK, (size_t) (end - p));
+		const char *eol = (p < end) ?
+			(const char *) memchr(p, '\n', end - p) : NULL;
+		p = eol ? eol + 1 : end;
+		chunk.end = p;
+		r.chunks.push_back(chunk);
+	}
+	int nchunks = r.chunks.size();
+	QSplat_TaskPool::ParallelFor(0, nchunks, 1, count_ascii_lines, &r);
+
+	int nlines = 0;
+	for (int c = 0; c < nchunks; c++) {
+		r.chunks[c].firstline = nlines;
+		nlines += r.chunks[c].nlines;
+	}
+	int needlines = 0;
+	for (int e = 0; e < r.elements.size(); e++) {
+		r.elemline.push_back(needlines);
+		needlines += r.elements[e].count;
+	}
+	if (nlines < needlines)
+		return false;
+
+	// Vertices and triangle counts
+	const PlyElement &v = r.elements[r.vertex_elem];
+	progress(" Reading %d vertices... ", v.count);
+	QSplat_TaskPool::ParallelFor(0, nchunks, 1, parse_ascii_vertices, &r);
+	if (r.bad_data)
+		return false;
+	progress("Done.\n");
+
+	if (r.tstrip_elem >= 0) {
+		progress(" Reading triangle strips... ");
+		for (int c = 0; c < nchunks; c++)
+			strips.insert(strips.end(), r.chunks[c].strips.begin(),
+				      r.chunks[c].strips.end());
+		progress("Done.\n");
+	} else if (r.face_elem >= 0) {
+		progress(" Reading %d faces... ",
+			 r.elements[r.face_elem].count);
+		numfaces = 0;
+		for (int c = 0; c < nchunks; c++) {
+			r.chunks[c].firsttri = numfaces;
+			numfaces += r.chunks[c].ntris;
+		}
+		faces = OOC_New<face>(numfaces);
+		r.faces = faces;
+		QSplat_TaskPool::ParallelFor(0, nchunks, 1, parse_ascii_faces, &r);
+		progress("Done.\n");
+	}
+
+	if (r.garbage)
+		fprintf(stderr, "Warning: ignored excess garbage at end of ply file.\n");
+	return true;
+}
+
+
+// Unpack tstrips into faces
+static void unpack_tstrips(PlyReader &r, const std::vector<int> &tstrips,
+			   int &numfaces, face * &faces)
+{
+	int i;
+	int tstripdatalen = tstrips.size();
+	if (tstripdatalen < 4)
+		return;
+
+	progress("Unpacking triangle strips... ");
+
+	// Count number of faces
+	numfaces = 0;
+	int this_tstrip_len = 0;
+	for (i=0; i < tstripdatalen; i++) {
+		if (tstrips[i] == -1) {
+			this_tstrip_len = 0;
+			continue;
+		}
+		this_tstrip_len++;
+		if (this_tstrip_len >= 3)
+			numfaces++;
+	}
+	progress("%d triangles... ", numfaces);
+
+	faces = OOC_New<face>(numfaces);
+
+	int whichface = 0;
+	this_tstrip_len = 0;
+	for (i=0; i < tstripdatalen; i++) {
+		if (tstrips[i] == -1) {
+			this_tstrip_len = 0;
+			continue;
+		}
+		this_tstrip_len++;
+		if (this_tstrip_len < 3)
+			continue;
+		int v[3];
+		if (this_tstrip_len % 2) {
+			v[0] = tstrips[i-2];
+			v[1] = tstrips[i-1];
+		} else {
+			v[0] = tstrips[i-1];
+			v[1] = tstrips[i-2];
+		}
+		v[2] = tstrips[i];
+		whichface += add_polygon(r, v, 3, faces + whichface);
+	}
+
+	progress("Done.\n");
+}
+
+
+// Try to read a plyfile, returning vertices and faces
+bool read_ply(const char *plyfile,
+	      int &numleaves, QTree_Node * &leaves,
+	      int &numfaces, face * &faces,
+	      bool &have_colors,
+	      std::string &comments)
+{
+	have_colors = false;  numleaves = numfaces = 0;
+	leaves = NULL;  faces = NULL;
+
+	const unsigned char *data;
+	size_t len;
+	if (!map_input(plyfile, data, len))
+		return false;
+	progress("Reading %s...\n", plyfile);
+
+	PlyReader r;
+	r.data = data;
+	r.end = data + len;
+	r.ascii = r.swap = false;
+	r.bad_data = r.bad_index = r.not_tris = r.garbage = false;
+	r.faces = NULL;
+	std::vector<int> strips;
+	bool ok = false;
+
+	const unsigned char *body = read_header(r, comments);
+	if (body && find_elements(r)) {
+		numleaves = r.numleaves = r.elements[r.vertex_elem].count;
+		leaves = r.leaves = OOC_New<QTree_Node>(numleaves);
+		have_colors = r.have_colors;
+		if (r.ascii)
+			ok = read_ascii(r, body, numfaces, faces, strips);
+		else
+			ok = read_binary(r, body, numfaces, faces, strips);
+		if (ok && !strips.empty())
+			unpack_tstrips(r, strips, numfaces, faces);
+		if (ok && r.bad_index) {
+			fprintf(stderr, "Face refers to nonexistent vertex.\n");
+			ok = false;
+		}
+		if (!ok)
+			fprintf(stderr, "Error reading plyfile.\n");
+	}
+	unmap_input(data, len);
+
+	if (!ok) {
+		if (leaves) OOC_Delete(leaves, numleaves);
+		if (faces) OOC_Delete(faces, numfaces);
+		leaves = NULL;  faces = NULL;
+		return false;
+	}
+	return true;
+}
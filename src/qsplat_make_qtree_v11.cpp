@@ -9,255 +9,443 @@ Leland Stanford Junior University.  All Rights Reserved.
 */
 
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
 #include "qsplat_util.h"
 #include "qsplat_make_qtree_v11.h"
 #include "qsplat_spherequant.h"
 #include "qsplat_normquant.h"
 #include "qsplat_colorquant.h"
+#include "qsplat_threads.h"
+#include "qsplat_make_outofcore.h"
+#include "qsplat_lz.h"
 #include <vector>
-#include <queue>
+#include <algorithm>
+
+#ifdef WIN32
+# define fseeko _fseeki64
+# define ftello _ftelli64
+#endif
 
 
 // A few random #defines
-#define QSPLAT_MAGIC "QSplat"
-#define QSPLAT_FILE_VERSION 11
 #define ANGLE(x,y) (acos(min(max(Dot(x,y), 0.0f), 1.0f)))
 
+// Subtrees with fewer leaves than this are built by a single thread
+#define PARALLEL_BUILD_MIN 65536
+
+
+// Interior nodes are handed out to threads this many at a time
+#define NODE_CHUNK 1024
+
+// Bits per axis in Morton codes, bits per digit when sorting them, and how
+// much work the threads of the Morton builder get at a time
+#define MORTON_BITS 21
+#define MORTON_RADIX_BITS 11
+#define MORTON_RADIX (1 << MORTON_RADIX_BITS)
+#define MORTON_DIGITS ((3*MORTON_BITS + MORTON_RADIX_BITS-1) / MORTON_RADIX_BITS)
+#define MORTON_GRAIN 4096
+
+// Size of the buffer for writing nodes
+#define OUTBUF_SIZE (4 << 20)
+
+// Each level of the tree is encoded this many groups at a time, and the
+// groups are handed out to threads in pieces this big
+#define ENCODE_CHUNK 65536
+#define ENCODE_GRAIN 1024
+
+// Blocks of version 14 fragments are compressed this many at a time
+#define COMPRESS_BATCH 64
+
+
+// Output through a big buffer, so that writing a node doesn't cost a trip
+// through stdio
+class OutBuffer {
+private:
+	FILE *f;
+	unsigned char *buf;
+	size_t n;
+
+public:
+	OutBuffer(FILE *_f) : f(_f), buf(new unsigned char[OUTBUF_SIZE]), n(0)
+		{}
+	~OutBuffer()
+		{ flush(); delete [] buf; }
+	void flush()
+	{
+		if (n)
+			fwrite((void *)buf, n, 1, f);
+		n = 0;
+	}
+	void put(const void *p, size_t k)
+	{
+		if (n + k > OUTBUF_SIZE)
+			flush();
+		memcpy(buf + n, p, k);
+		n += k;
+	}
+	void put_int(int I)
+	{
+		FIX_LONG(I);
+		put(&I, 4);
+	}
+};
+
+
+// Write version 12 fragments even when version 11 would do
+bool qsplat_make_wide = false;
+bool qsplat_make_little_endian = false;
+bool qsplat_make_veb = false;
+bool qsplat_make_simd = false;
+bool qsplat_make_compress = false;
+
+
+// Set up a tree with the given leaves
+QTree::QTree(int _numleaves, const QTree_Node *leaves, bool _havecolor,
+	     bool _verbose /* = true */, Arena *_arena /* = NULL */) :
+	numleaves(_numleaves), root(-1), havecolor(_havecolor),
+	verbose(_verbose), arena(_arena), ownarena(!_arena)
+{
+	if (ownarena)
+		arena = new Arena(ARENA_HUGE_BLOCK, true);
+	InitLeaves(leaves);
+}
+
+
+// Set up a tree with no leaves, to be filled in by hand
+QTree::QTree(int numinterior, bool _havecolor, Arena *_arena /* = NULL */) :
+	numleaves(0), root(-1), havecolor(_havecolor), verbose(false),
+	arena(_arena), ownarena(!_arena)
+{
+	if (ownarena)
+		arena = new Arena;
+	Alloc(numinterior);
+}
+
+
+QTree::~QTree()
+{
+	if (ownarena)
+		delete arena;
+}
+
 
-// Static QTree_Node class variable
-PoolAlloc QTree_Node::memPool(sizeof(QTree_Node));
+// Allocate the arrays for the leaves, and room for the given number of
+// interior nodes.  A tree never has more interior nodes than leaves, but
+// each thread might leave part of its last chunk unused.
+void QTree::Alloc(int numinterior)
+{
+	numinterior += QSplat_TaskPool::NumThreads() * NODE_CHUNK;
+	maxnodes = numleaves + numinterior;
+	pos = arena->alloc<point>(maxnodes);
+	r = arena->alloc<float>(maxnodes);
+	norm = arena->alloc<vec>(maxnodes);
+	col = havecolor ? arena->alloc<color>(maxnodes) : NULL;
+	normcone = arena->alloc<float>(numinterior);
+	child = (int (*)[4]) arena->alloc<int>(4 * numinterior);
+	groupinfo = arena->alloc<unsigned char>(numinterior);
+	subtreesize = arena->alloc<long long>(numinterior);
+
+	nextchunk = numleaves;
+	NodeChunk c = { numleaves, numleaves };
+	chunks.assign(QSplat_TaskPool::NumThreads(), c);
+}
 
 
 // Initializes a Qtree
-void QTree::InitLeaves()
+void QTree::InitLeaves(const QTree_Node *leaves)
 {
 	QSplat_ColorQuant::Init();
 	QSplat_NormQuant::Init();
 	QSplat_SphereQuant::Init();
 
-	printf("Initializing tree... "); fflush(stdout);
-	int i, next = 0;
-	for (i=0; i < numleaves; i++) {
-		if (!leaves[i].m.refcount || leaves[i].r == 0.0f)
-			continue;
-		if (i != next)
-			memcpy(&leaves[next], &leaves[i], sizeof(QTree_Node));
-		next++;
+	if (verbose) {
+		printf("Initializing tree... "); fflush(stdout);
 	}
+	int i, next = 0;
+	for (i=0; i < numleaves; i++)
+		if (leaves[i].m.refcount && leaves[i].r != 0.0f)
+			next++;
 
 	if (numleaves != next) {
-		printf("Removed %d vertices... ", numleaves - next); fflush(stdout);
-		numleaves = next;
+		if (verbose) {
+			printf("Removed %d vertices... ", numleaves - next);
+			fflush(stdout);
+		}
 	}
 
-	for (i=0; i < numleaves; i++) {
-		leaves[i].child[0] = NULL;
-		leaves[i].normcone = 0;
-		vec &n = leaves[i].norm;
-		float l = Len(n);
-		if (l == 0.0f) {
+	int oldnumleaves = numleaves;
+	numleaves = next;
+	Alloc(numleaves);
+
+	for (i=0, next=0; i < oldnumleaves; i++) {
+		const QTree_Node &l = leaves[i];
+		if (!l.m.refcount || l.r == 0.0f)
+			continue;
+		pos[next][0] = l.pos[0];
+		pos[next][1] = l.pos[1];
+		pos[next][2] = l.pos[2];
+		r[next] = l.r;
+		if (havecolor) {
+			col[next][0] = l.col[0];
+			col[next][1] = l.col[1];
+			col[next][2] = l.col[2];
+		}
+		vec &n = norm[next];
+		n[0] = l.norm[0];  n[1] = l.norm[1];  n[2] = l.norm[2];
+		float len = Len(n);
+		if (len == 0.0f) {
 			n[0] = n[1] = 0.0f;
 			n[2] = 1.0f;
 		} else {
-			l = 1.0f / l;
-			n[0] *= l;  n[1] *= l;  n[2] *= l;
+			len = 1.0f / len;
+			n[0] *= len;  n[1] *= len;  n[2] *= len;
 		}
+		next++;
 	}
 
-	printf("Done.\n");
+	if (verbose)
+		printf("Done.\n");
+}
+
+
+// Return the number of a new interior node.  Each thread takes nodes from
+// a chunk of its own, so this doesn't need any locking.
+int QTree::NewNode()
+{
+	NodeChunk &c = chunks[QSplat_TaskPool::ThreadNum()];
+	if (c.next == c.end) {
+		c.next = nextchunk.fetch_add(NODE_CHUNK);
+		if (c.next >= maxnodes) {
+			fprintf(stderr, "Yikes! Out of nodes in NewNode()\n");
+			exit(1);
+		}
+		c.end = min(c.next + NODE_CHUNK, maxnodes);
+	}
+	int n = c.next++;
+	child[n - numleaves][0] = -1;
+	groupinfo[n - numleaves] = 0;
+	subtreesize[n - numleaves] = 0;
+	return n;
+}
+
+
+// Make node n (which must be an interior node) a childless copy of
+// fromnode in another tree
+void QTree::CopyNode(int n, const QTree &from, int fromnode)
+{
+	pos[n][0] = from.pos[fromnode][0];
+	pos[n][1] = from.pos[fromnode][1];
+	pos[n][2] = from.pos[fromnode][2];
+	r[n] = from.r[fromnode];
+	norm[n][0] = from.norm[fromnode][0];
+	norm[n][1] = from.norm[fromnode][1];
+	norm[n][2] = from.norm[fromnode][2];
+	normcone[n - numleaves] = (fromnode < from.numleaves) ? 0.0f :
+		from.normcone[fromnode - from.numleaves];
+	if (havecolor) {
+		col[n][0] = from.col[fromnode][0];
+		col[n][1] = from.col[fromnode][1];
+		col[n][2] = from.col[fromnode][2];
+	}
+	child[n - numleaves][0] = -1;
+	groupinfo[n - numleaves] = 0;
+	subtreesize[n - numleaves] = 0;
 }
 
 
 // Assume the leaves have been filled in, and build the rest of the tree
-void QTree::BuildTree()
-{
-	printf("Building tree... "); fflush(stdout);
-	leafptr = new QTree_Node * [numleaves];
-	for (int i = 0; i < numleaves; i++)
-		leafptr[i] = &(leaves[i]);
-	root = BuildLeaves(0, numleaves);
-	delete [] leafptr;
-	printf("Done.\n");
+void QTree::BuildTree(bool morton /* = false */)
+{
+	if (verbose) {
+		printf("Building tree... "); fflush(stdout);
+	}
+	root = morton ? BuildMorton() : BuildLeaves(0, numleaves);
+	if (verbose)
+		printf("using %d MB... Done.\n",
+		       (int) (arena->stats().peak >> 20));
 }
 
 
 // Return the bounding sphere of the leaves in positions [begin..end)
-QTree_Node *QTree::BuildLeaves(int begin, int end)
+int QTree::BuildLeaves(int begin, int end)
 {
 #ifdef DEBUG
 	if (begin == end) {
 		fprintf(stderr, "Yikes! begin == end in BuildLeaves()\n");
-		return NULL;
+		return -1;
 	}
 #endif
 
 	if (end - begin <= 4)
 		return CombineLeaves(begin, end);
 
-	// Recursive case
+	// Recursive case - split into 2, 3, or 4 pieces.  Pieces with 4 or
+	// fewer leaves aren't split any further.
+	int split[5], nsplit = 0;
 	int middle = Partition(begin, end);
-
-	if (middle - begin <= 4) {
-		if (end - middle <= 4) {
-			return CombineNodes(CombineLeaves(begin, middle),
-					    CombineLeaves(middle, end));
-		} else {
-			int m2 = Partition(middle, end);
-			return CombineNodes(CombineLeaves(begin, middle),
-					    BuildLeaves(middle, m2),
-					    BuildLeaves(m2, end));
-		}
+	split[nsplit++] = begin;
+	if (middle - begin > 4)
+		split[nsplit++] = Partition(begin, middle);
+	split[nsplit++] = middle;
+	if (end - middle > 4)
+		split[nsplit++] = Partition(middle, end);
+	split[nsplit] = end;
+
+	// Build the pieces.  Big ones get handed off to other threads.
+	int n[4];
+	if (end - begin < PARALLEL_BUILD_MIN ||
+	    QSplat_TaskPool::NumThreads() == 1) {
+		for (int i = 0; i < nsplit; i++)
+			n[i] = BuildLeaves(split[i], split[i+1]);
 	} else {
-		if (end - middle <= 4) {
-			int m1 = Partition(begin, middle);
-			return CombineNodes(BuildLeaves(begin, m1),
-					    BuildLeaves(m1, middle),
-					    CombineLeaves(middle, end));
-		} else {
-			int m1 = Partition(begin, middle);
-			int m2 = Partition(middle, end);
-			return CombineNodes(BuildLeaves(begin, m1),
-					    BuildLeaves(m1, middle),
-					    BuildLeaves(middle, m2),
-					    BuildLeaves(m2, end));
+		BuildTask tasks[4];
+		QSplat_TaskPool::TaskGroup g;
+		for (int i = 0; i < nsplit; i++) {
+			tasks[i].qt = this;
+			tasks[i].begin = split[i];
+			tasks[i].end = split[i+1];
+			if (i)
+				QSplat_TaskPool::Spawn(g, BuildLeavesTask, &tasks[i]);
 		}
+		BuildLeavesTask(&tasks[0]);
+		QSplat_TaskPool::Wait(g);
+		for (int i = 0; i < nsplit; i++)
+			n[i] = tasks[i].result;
 	}
+
+	return CombineNodes(n, nsplit);
 }
 
 
-// 3-way overloaded function: return a new node in the tree, given the nodes
-// of 2, 3, or 4 children.
-QTree_Node *QTree::CombineNodes(QTree_Node *n1, QTree_Node *n2)
+// Run BuildLeaves() on behalf of the task pool
+void QTree::BuildLeavesTask(void *arg)
 {
-	QTree_Node *n = new QTree_Node;
-
-	n->pos[0] = (n1->pos[0] + n2->pos[0])/2.0f;
-	n->pos[1] = (n1->pos[1] + n2->pos[1])/2.0f;
-	n->pos[2] = (n1->pos[2] + n2->pos[2])/2.0f;
-
-	n->r = max(Dist(n->pos, n1->pos) + n1->r,
-		   Dist(n->pos, n2->pos) + n2->r);
-
-	n->norm[0] = n1->norm[0] + n2->norm[0];
-	n->norm[1] = n1->norm[1] + n2->norm[1];
-	n->norm[2] = n1->norm[2] + n2->norm[2];
-	Normalize(n->norm);
-
-	n->normcone = max(ANGLE(n->norm, n1->norm) + n1->normcone,
-			  ANGLE(n->norm, n2->norm) + n2->normcone);
-
-	if (havecolor) {
-		n->col[0] = (n1->col[0] + n2->col[0]) / 2;
-		n->col[1] = (n1->col[1] + n2->col[1]) / 2;
-		n->col[2] = (n1->col[2] + n2->col[2]) / 2;
-	}
-
-	n->child[0] = n1;
-	n->child[1] = n2;
-	n->child[2] = NULL;
-
-	return n;
+	BuildTask *t = (BuildTask *) arg;
+	t->result = t->qt->BuildLeaves(t->begin, t->end);
 }
 
-QTree_Node *QTree::CombineNodes(QTree_Node *n1, QTree_Node *n2, QTree_Node *n3)
-{
-	QTree_Node *n = new QTree_Node;
-
-	n->pos[0] = (n1->pos[0] + n2->pos[0] + n3->pos[0])/3.0f;
-	n->pos[1] = (n1->pos[1] + n2->pos[1] + n3->pos[1])/3.0f;
-	n->pos[2] = (n1->pos[2] + n2->pos[2] + n3->pos[2])/3.0f;
-
-	n->r = max(max(Dist(n->pos, n1->pos) + n1->r,
-		       Dist(n->pos, n2->pos) + n2->r),
-		       Dist(n->pos, n3->pos) + n3->r);
-
-	n->norm[0] = n1->norm[0] + n2->norm[0] + n3->norm[0];
-	n->norm[1] = n1->norm[1] + n2->norm[1] + n3->norm[1];
-	n->norm[2] = n1->norm[2] + n2->norm[2] + n3->norm[2];
-	Normalize(n->norm);
-
-	n->normcone = max(max(ANGLE(n->norm, n1->norm) + n1->normcone,
-			      ANGLE(n->norm, n2->norm) + n2->normcone),
-			      ANGLE(n->norm, n3->norm) + n3->normcone);
-
-	if (havecolor) {
-		n->col[0] = (n1->col[0] + n2->col[0] + n3->col[0]) / 3;
-		n->col[1] = (n1->col[1] + n2->col[1] + n3->col[1]) / 3;
-		n->col[2] = (n1->col[2] + n2->col[2] + n3->col[2]) / 3;
-	}
-
-	n->child[0] = n1;
-	n->child[1] = n2;
-	n->child[2] = n3;
-	n->child[3] = NULL;
 
+// Return a new node in the tree, given its 2, 3, or 4 children
+int QTree::CombineNodes(const int *c, int nc)
+{
+	int n = NewNode();
+	Combine(n, c, nc);
 	return n;
 }
 
-QTree_Node *QTree::CombineNodes(QTree_Node *n1, QTree_Node *n2,
-				QTree_Node *n3, QTree_Node *n4)
-{
-	QTree_Node *n = new QTree_Node;
-
-	n->pos[0] = (n1->pos[0] + n2->pos[0] + n3->pos[0] + n4->pos[0])/4.0f;
-	n->pos[1] = (n1->pos[1] + n2->pos[1] + n3->pos[1] + n4->pos[1])/4.0f;
-	n->pos[2] = (n1->pos[2] + n2->pos[2] + n3->pos[2] + n4->pos[2])/4.0f;
-
-	n->r = max(max(Dist(n->pos, n1->pos) + n1->r,
-		       Dist(n->pos, n2->pos) + n2->r),
-		   max(Dist(n->pos, n3->pos) + n3->r,
-		       Dist(n->pos, n4->pos) + n4->r));
 
-	n->norm[0] = n1->norm[0] + n2->norm[0] + n3->norm[0] + n4->norm[0];
-	n->norm[1] = n1->norm[1] + n2->norm[1] + n3->norm[1] + n4->norm[1];
-	n->norm[2] = n1->norm[2] + n2->norm[2] + n3->norm[2] + n4->norm[2];
-	Normalize(n->norm);
+// Fill in interior node n from its 2, 3, or 4 children
+void QTree::Combine(int n, const int *c, int nc)
+{
+	int i;
+
+	point &p = pos[n];
+	p[0] = p[1] = p[2] = 0.0f;
+	for (i = 0; i < nc; i++) {
+		p[0] += pos[c[i]][0];
+		p[1] += pos[c[i]][1];
+		p[2] += pos[c[i]][2];
+	}
+	// Under -ffast-math the sum above may be reassociated, so the centre
+	// can come out one ulp different from the old per-arity code
+	p[0] /= (float) nc;
+	p[1] /= (float) nc;
+	p[2] /= (float) nc;
+
+	r[n] = Dist(p, pos[c[0]]) + r[c[0]];
+	for (i = 1; i < nc; i++)
+		r[n] = max(r[n], Dist(p, pos[c[i]]) + r[c[i]]);
+
+	vec &nn = norm[n];
+	nn[0] = nn[1] = nn[2] = 0.0f;
+	for (i = 0; i < nc; i++) {
+		nn[0] += norm[c[i]][0];
+		nn[1] += norm[c[i]][1];
+		nn[2] += norm[c[i]][2];
+	}
+	Normalize(nn);
 
-	n->normcone = max(max(ANGLE(n->norm, n1->norm) + n1->normcone,
-			      ANGLE(n->norm, n2->norm) + n2->normcone),
-			  max(ANGLE(n->norm, n3->norm) + n3->normcone,
-			      ANGLE(n->norm, n4->norm) + n4->normcone));
+	float cone = ANGLE(nn, norm[c[0]]) + Normcone(c[0]);
+	for (i = 1; i < nc; i++)
+		cone = max(cone, ANGLE(nn, norm[c[i]]) + Normcone(c[i]));
+	normcone[n - numleaves] = cone;
 
 	if (havecolor) {
-		n->col[0] = (n1->col[0] + n2->col[0] + n3->col[0] + n4->col[0]) / 4;
-		n->col[1] = (n1->col[1] + n2->col[1] + n3->col[1] + n4->col[1]) / 4;
-		n->col[2] = (n1->col[2] + n2->col[2] + n3->col[2] + n4->col[2]) / 4;
+		int sum[3] = { 0, 0, 0 };
+		for (i = 0; i < nc; i++) {
+			sum[0] += col[c[i]][0];
+			sum[1] += col[c[i]][1];
+			sum[2] += col[c[i]][2];
+		}
+		col[n][0] = sum[0] / nc;
+		col[n][1] = sum[1] / nc;
+		col[n][2] = sum[2] / nc;
 	}
 
-	n->child[0] = n1;
-	n->child[1] = n2;
-	n->child[2] = n3;
-	n->child[3] = n4;
-
-	return n;
+	int *ch = child[n - numleaves];
+	for (i = 0; i < 4; i++)
+		ch[i] = (i < nc) ? c[i] : -1;
+
+	// Remember the sizes of things on disk, so that writing doesn't have
+	// to go looking for them
+	bool grandchildren = false;
+	long long size = 0;
+	for (i = 0; i < nc; i++) {
+		if (Num_Children(c[i]))
+			grandchildren = true;
+		size += Treesize(c[i]);
+	}
+	groupinfo[n - numleaves] = nc | (grandchildren ? 8 : 0);
+	size += Nodesize(n);
+	subtreesize[n - numleaves] = size;
 }
 
 
 // Run CombineNodes on the leaves in positions begin through end
-QTree_Node *QTree::CombineLeaves(int begin, int end)
+int QTree::CombineLeaves(int begin, int end)
 {
+	int c[4];
 	switch (end - begin) {
 		case 1:
-			return leafptr[begin];
+			return begin;
 		case 2:
-			return CombineNodes(leafptr[begin], leafptr[begin+1]);
 		case 3:
-			return CombineNodes(leafptr[begin], leafptr[begin+1],
-					    leafptr[begin+2]);
 		case 4:
-			return CombineNodes(leafptr[begin], leafptr[begin+1],
-					    leafptr[begin+2], leafptr[begin+3]);
+			for (int i = 0; i < end - begin; i++)
+				c[i] = begin + i;
+			return CombineNodes(c, end - begin);
 	}
 
 #ifdef DEBUG
 	fprintf(stderr, "Yikes! end - begin not between 1 and 4 in CombineLeaves()\n");
 #endif
-	return NULL;
+	return -1;
+}
+
+
+// Exchange two leaves
+void QTree::SwapLeaves(int i, int j)
+{
+	swap(pos[i][0], pos[j][0]);
+	swap(pos[i][1], pos[j][1]);
+	swap(pos[i][2], pos[j][2]);
+	swap(r[i], r[j]);
+	swap(norm[i][0], norm[j][0]);
+	swap(norm[i][1], norm[j][1]);
+	swap(norm[i][2], norm[j][2]);
+	if (havecolor) {
+		swap(col[i][0], col[j][0]);
+		swap(col[i][1], col[j][1]);
+		swap(col[i][2], col[j][2]);
+	}
 }
 
 
-// Do partitioning on the range [begin..end) of thetree.  Returns index on
+// Do partitioning on the range [begin..end) of the leaves.  Returns index on
 // which we partition (i.e. partitions are [begin..middle) and [middle..end) )
+// The leaves themselves get moved around, so the leaves of any subtree
+// end up next to each other in memory.
 int QTree::Partition(int begin, int end)
 {
 #ifdef DEBUG
@@ -266,13 +454,13 @@ int QTree::Partition(int begin, int end)
 #endif
 
 	// Find bbox
-	float xmin=leafptr[begin]->pos[0];
-	float ymin=leafptr[begin]->pos[1];
-	float zmin=leafptr[begin]->pos[2];
+	float xmin=pos[begin][0];
+	float ymin=pos[begin][1];
+	float zmin=pos[begin][2];
 	float xmax=xmin, ymax=ymin, zmax=zmin;
 
 	for (int i = begin+1; i < end; i++) {
-		const float *p = leafptr[i]->pos;
+		const float *p = pos[i];
 
 		if (p[0] < xmin)  xmin = p[0];
 		else if (p[0] > xmax)  xmax = p[0];
@@ -314,11 +502,11 @@ int QTree::Partition(int begin, int end)
 	int left = begin, right = end-1;
 	while (1) {
 		// March the "left" pointer to the right
-		while (leafptr[left]->pos[splitaxis] < splitval)
+		while (pos[left][splitaxis] < splitval)
 			left++;
 
 		// March the "right" pointer to the left
-		while (leafptr[right]->pos[splitaxis] >= splitval)
+		while (pos[right][splitaxis] >= splitval)
 			right--;
 
 		// If the pointers have crossed, we're done
@@ -336,202 +524,1188 @@ int QTree::Partition(int begin, int end)
 		}
 
 		// Else, swap and repeat
-		swap(leafptr[left], leafptr[right]);
+		SwapLeaves(left, right);
 	}
 }
 
 
-// A couple of trivial helper functions
-static inline void write_float(FILE *f, float F)
+// Spread the low MORTON_BITS bits of x out to every third bit
+static inline unsigned long long morton_spread(unsigned long long x)
 {
-	FIX_FLOAT(F);
-	fwrite((void *)&F, 4, 1, f);
+	x &= (1ull << MORTON_BITS) - 1;
+	x = (x | x << 32) & 0x1f00000000ffffull;
+	x = (x | x << 16) & 0x1f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
 }
-static inline void write_int(FILE *f, int I)
+
+
+// State for sorting the leaves along a Morton curve.  The codes are sorted
+// with an LSD radix sort, each pass of which histograms and scatters fixed
+// chunks of the array in parallel, and then the leaves are put in order.
+struct MortonTask {
+	int n, nchunks;
+	point origin;
+	float scale;
+	unsigned long long *code, *code2;
+	int *index, *index2;
+	size_t *hist;		// For each chunk, counts of each digit
+	int shift;
+	point *pos;
+	float *r;
+	vec *norm;
+	color *col;		// NULL if no color
+	point *tmppos;
+	float *tmpr;
+	vec *tmpnorm;
+	color *tmpcol;
+
+	size_t *counts(int c, int d)
+		{ return hist + MORTON_RADIX * (MORTON_DIGITS * c + d); }
+	void chunk(int c, int &begin, int &end)
+	{
+		begin = (int) ((long long) n * c / nchunks);
+		end = (int) ((long long) n * (c+1) / nchunks);
+	}
+};
+
+static void morton_codes(void *arg, int begin, int end)
 {
-	FIX_LONG(I);
-	fwrite((void *)&I, 4, 1, f);
+	MortonTask *t = (MortonTask *) arg;
+	const unsigned long long maxcell = (1ull << MORTON_BITS) - 1;
+	for (int i = begin; i < end; i++) {
+		const float *p = t->pos[i];
+		unsigned long long x = (unsigned long long) ((p[0] - t->origin[0]) * t->scale);
+		unsigned long long y = (unsigned long long) ((p[1] - t->origin[1]) * t->scale);
+		unsigned long long z = (unsigned long long) ((p[2] - t->origin[2]) * t->scale);
+		t->code[i] = morton_spread(min(x, maxcell)) |
+			     morton_spread(min(y, maxcell)) << 1 |
+			     morton_spread(min(z, maxcell)) << 2;
+		t->index[i] = i;
+	}
 }
 
-static inline void write_comments(FILE *f, const std::string &comments)
+// Count every digit of the codes in each chunk
+static void morton_histogram_all(void *arg, int begin, int end)
 {
-	int s = comments.size();
-	int padding = (4 - (s % 4)) % 4;
-	unsigned char buf[9];
-	sprintf((char *)buf, "%s%02d", QSPLAT_MAGIC, QSPLAT_FILE_VERSION);
-	fwrite((void *)buf, 8, 1, f);
-	write_int(f, 20 + s + padding);
-	write_int(f, 0);
-	write_int(f, 2);
-	fwrite((void *)comments.data(), s, 1, f);
-	buf[0] = buf[1] = buf[2] = 0;
-	if (padding) fwrite((void *)buf, padding, 1, f);
+	MortonTask *t = (MortonTask *) arg;
+	for (int c = begin; c < end; c++) {
+		size_t *h = t->counts(c, 0);
+		memset(h, 0, MORTON_DIGITS * MORTON_RADIX * sizeof(size_t));
+		int cbegin, cend;
+		t->chunk(c, cbegin, cend);
+		for (int i = cbegin; i < cend; i++) {
+			unsigned long long code = t->code[i];
+			for (int d = 0; d < MORTON_DIGITS; d++) {
+				h[MORTON_RADIX * d + (code & (MORTON_RADIX - 1))]++;
+				code >>= MORTON_RADIX_BITS;
+			}
+		}
+	}
+}
+
+// Count just the digit at shift
+static void morton_histogram(void *arg, int begin, int end)
+{
+	MortonTask *t = (MortonTask *) arg;
+	for (int c = begin; c < end; c++) {
+		size_t *h = t->counts(c, t->shift / MORTON_RADIX_BITS);
+		memset(h, 0, MORTON_RADIX * sizeof(size_t));
+		int cbegin, cend;
+		t->chunk(c, cbegin, cend);
+		for (int i = cbegin; i < cend; i++)
+			h[(t->code[i] >> t->shift) & (MORTON_RADIX - 1)]++;
+	}
+}
+
+static void morton_scatter(void *arg, int begin, int end)
+{
+	MortonTask *t = (MortonTask *) arg;
+	for (int c = begin; c < end; c++) {
+		size_t *h = t->counts(c, t->shift / MORTON_RADIX_BITS);
+		int cbegin, cend;
+		t->chunk(c, cbegin, cend);
+		for (int i = cbegin; i < cend; i++) {
+			size_t j = h[(t->code[i] >> t->shift) & (MORTON_RADIX - 1)]++;
+			t->code2[j] = t->code[i];
+			t->index2[j] = t->index[i];
+		}
+	}
+}
+
+static void morton_gather(void *arg, int begin, int end)
+{
+	MortonTask *t = (MortonTask *) arg;
+	for (int i = begin; i < end; i++) {
+		int j = t->index[i];
+		memcpy(t->tmppos[i], t->pos[j], sizeof(point));
+		t->tmpr[i] = t->r[j];
+		memcpy(t->tmpnorm[i], t->norm[j], sizeof(vec));
+		if (t->col)
+			memcpy(t->tmpcol[i], t->col[j], sizeof(color));
+	}
+}
+
+static void morton_copyback(void *arg, int begin, int end)
+{
+	MortonTask *t = (MortonTask *) arg;
+	int n = end - begin;
+	memcpy(t->pos + begin, t->tmppos + begin, n * sizeof(point));
+	memcpy(t->r + begin, t->tmpr + begin, n * sizeof(float));
+	memcpy(t->norm + begin, t->tmpnorm + begin, n * sizeof(vec));
+	if (t->col)
+		memcpy(t->col + begin, t->tmpcol + begin, n * sizeof(color));
+}
+
+
+// Where to split the sorted codes in [begin..end): at the first one with
+// the highest bit in which the codes differ set, or in the middle if they
+// are all the same
+static int morton_split(const unsigned long long *code, int begin, int end)
+{
+	unsigned long long a = code[begin], b = code[end-1];
+	if (a == b)
+		return (begin + end) / 2;
+	unsigned long long bit = 1ull << 63;
+	while (!((a ^ b) & bit))
+		bit >>= 1;
+	return std::lower_bound(code + begin, code + end, b & ~(bit - 1)) - code;
+}
+
+
+// A node still to be split by BuildMorton(), and the leaves below it
+struct MortonRange {
+	int begin, end, node;
+};
+
+
+// Build the tree over the leaves sorted along a Morton curve, and return
+// the root.  The leaves of a node are split by morton_split(), and each
+// piece with more than 4 leaves is split again, the same way BuildLeaves()
+// splits with Partition().  The interior nodes are numbered a level at a
+// time, so the levels can then be combined in parallel from the bottom up.
+int QTree::BuildMorton()
+{
+	if (numleaves == 1)
+		return 0;
+
+	// Find bbox.  Codes are measured in cubical cells.
+	int i, n = numleaves;
+	point min_p = { pos[0][0], pos[0][1], pos[0][2] };
+	point max_p = { pos[0][0], pos[0][1], pos[0][2] };
+	for (i = 1; i < n; i++) {
+		for (int j = 0; j < 3; j++) {
+			min_p[j] = min(min_p[j], pos[i][j]);
+			max_p[j] = max(max_p[j], pos[i][j]);
+		}
+	}
+	float size = max(max(max_p[0] - min_p[0], max_p[1] - min_p[1]),
+			 max_p[2] - min_p[2]);
+
+	MortonTask t;
+	t.n = n;
+	t.nchunks = QSplat_TaskPool::NumThreads() > 1 ?
+		    4 * QSplat_TaskPool::NumThreads() : 1;
+	t.origin[0] = min_p[0];  t.origin[1] = min_p[1];  t.origin[2] = min_p[2];
+	t.scale = size ? (float) (1 << MORTON_BITS) / size : 0.0f;
+	t.code = new unsigned long long[n];
+	t.code2 = new unsigned long long[n];
+	t.index = new int[n];
+	t.index2 = new int[n];
+	t.hist = new size_t[MORTON_DIGITS * MORTON_RADIX * t.nchunks];
+	t.pos = pos;  t.r = r;  t.norm = norm;  t.col = col;
+	QSplat_TaskPool::ParallelFor(0, n, MORTON_GRAIN, morton_codes, &t);
+
+	// Sort by code, a digit at a time, skipping digits that are the same
+	// in every code.  The first pass over the codes counts every digit;
+	// with more than one chunk, the counts for each chunk have to be
+	// redone before each later pass, since the codes have moved around.
+	QSplat_TaskPool::ParallelFor(0, t.nchunks, 1, morton_histogram_all, &t);
+	bool first = true;
+	for (int d = 0; d < MORTON_DIGITS; d++) {
+		t.shift = d * MORTON_RADIX_BITS;
+		bool same = false;
+		for (int k = 0; k < MORTON_RADIX && !same; k++) {
+			size_t count = 0;
+			for (int c = 0; c < t.nchunks; c++)
+				count += t.counts(c, d)[k];
+			same = (count == (size_t) n);
+		}
+		if (same)
+			continue;
+
+		if (!first && t.nchunks > 1)
+			QSplat_TaskPool::ParallelFor(0, t.nchunks, 1, morton_histogram, &t);
+		first = false;
+		size_t total = 0;
+		for (int k = 0; k < MORTON_RADIX; k++) {
+			for (int c = 0; c < t.nchunks; c++) {
+				size_t count = t.counts(c, d)[k];
+				t.counts(c, d)[k] = total;
+				total += count;
+			}
+		}
+		QSplat_TaskPool::ParallelFor(0, t.nchunks, 1, morton_scatter, &t);
+		swap(t.code, t.code2);
+		swap(t.index, t.index2);
+	}
+	delete [] t.hist;
+	delete [] t.code2;
+	delete [] t.index2;
+
+	// Put the leaves in order
+	t.tmppos = new point[n];
+	t.tmpr = new float[n];
+	t.tmpnorm = new vec[n];
+	t.tmpcol = havecolor ? new color[n] : NULL;
+	QSplat_TaskPool::ParallelFor(0, n, MORTON_GRAIN, morton_gather, &t);
+	QSplat_TaskPool::ParallelFor(0, n, MORTON_GRAIN, morton_copyback, &t);
+	delete [] t.tmpcol;
+	delete [] t.tmpnorm;
+	delete [] t.tmpr;
+	delete [] t.tmppos;
+	delete [] t.index;
+
+	// Lay out the tree, a level at a time
+	std::vector<MortonRange> level, nextlevel;
+	std::vector<int> levelstart;
+	MortonRange rootrange = { 0, n, numleaves };
+	level.push_back(rootrange);
+	int next = numleaves + 1;
+	while (!level.empty()) {
+		levelstart.push_back(level[0].node);
+		nextlevel.clear();
+		for (i = 0; i < level.size(); i++) {
+			const MortonRange &l = level[i];
+			int split[5], nsplit = 0;
+			if (l.end - l.begin <= 4) {
+				for (int j = l.begin; j < l.end; j++)
+					split[nsplit++] = j;
+			} else {
+				int middle = morton_split(t.code, l.begin, l.end);
+				split[nsplit++] = l.begin;
+				if (middle - l.begin > 4)
+					split[nsplit++] = morton_split(t.code, l.begin, middle);
+				split[nsplit++] = middle;
+				if (l.end - middle > 4)
+					split[nsplit++] = morton_split(t.code, middle, l.end);
+			}
+			split[nsplit] = l.end;
+
+			// Pieces of one leaf are just that leaf
+			int *ch = child[l.node - numleaves];
+			for (int j = 0; j < 4; j++) {
+				if (j >= nsplit) {
+					ch[j] = -1;
+				} else if (split[j+1] - split[j] == 1) {
+					ch[j] = split[j];
+				} else {
+					MortonRange piece = { split[j], split[j+1], next };
+					nextlevel.push_back(piece);
+					ch[j] = next++;
+				}
+			}
+		}
+		level.swap(nextlevel);
+	}
+	levelstart.push_back(next);
+	delete [] t.code;
+
+	// Any nodes made by NewNode() come after these
+	nextchunk = next;
+
+	for (i = levelstart.size() - 2; i >= 0; i--)
+		QSplat_TaskPool::ParallelFor(levelstart[i], levelstart[i+1],
+					     MORTON_GRAIN, CombineRangeTask, this);
+
+	return numleaves;
+}
+
+
+// Fill in the interior nodes [begin..end) from their children, on behalf
+// of the task pool
+void QTree::CombineRangeTask(void *arg, int begin, int end)
+{
+	QTree *qt = (QTree *) arg;
+	for (int n = begin; n < end; n++) {
+		int c[4], nc = 0;
+		const int *ch = qt->child[n - qt->numleaves];
+		while (nc < 4 && ch[nc] >= 0) {
+			c[nc] = ch[nc];
+			nc++;
+		}
+		qt->Combine(n, c, nc);
+	}
 }
 
 
 // Writes out the QTree to a .qs file.  Note: this messes up the values in
 // the QTree!
-void QTree::Write(const char *qsfile, const std::string &comments)
+bool QTree::Write(const char *qsfile, const std::string &comments)
 {
-	FILE *f = fopen(qsfile, "w");
-	if (!f) {
-		fprintf(stderr, "Couldn't open %s for writing.\n", qsfile);
-		return;
-	}
+	std::string tmpname;
+	FILE *f = OpenOutput(qsfile, tmpname);
+	if (!f)
+		return false;
 	printf("Quantizing and writing... "); fflush(stdout);
 
 	// Write out comment
 	if (!comments.empty())
 		write_comments(f, comments);
 
+	// Write out the header, then the nodes...
+	if (!WriteFragment(f)) {
+		CloseOutput(f, qsfile, tmpname, false);
+		return false;
+	}
+
+	if (!CloseOutput(f, qsfile, tmpname))
+		return false;
+	printf("Done.\n");
+	return true;
+}
+
+
+// Write the header and the nodes to f, as one fragment of a .qs file
+bool QTree::WriteFragment(FILE *f)
+{
+	// Version 13 has a layout of its own
+	if (qsplat_make_simd) {
+		int c[8];
+		int numchildren = Num_Children(root) ? WideChildren(root, c) : 0;
+		long long numgroups = numchildren ? NumGroups8(root) : 0;
+		WriteHeader(f, numgroups * Groupsize8(), numleaves, numchildren,
+			    true, true, QSPLAT_FILE_VERSION_SIMD);
+		WriteNodes8(f);
+		return !ferror(f);
+	}
+	if (qsplat_make_compress)
+		return WriteCompressed(f);
+
+	// Version 11 stores sizes and offsets in 32 bits.  If that's not
+	// enough, every child offset gets 4 bytes bigger.
+	long long treesize = Treesize();
+	bool wide = qsplat_make_wide || treesize > INT_MAX - 64;
+	if (wide)
+		treesize += 4 * NumPointers();
+
+	// As far as the reader is concerned, the top-level group always
+	// starts with an offset to the next level, even if there isn't one
+	int extra = (Num_Children(root) && !Has_Grandchildren(root)) ?
+		    (wide ? 8 : 4) : 0;
+	bool little = qsplat_make_little_endian;
+	int padding = WriteHeader(f, treesize + extra, numleaves,
+				  Num_Children(root), wide, little);
+	if (extra == 8)
+		write_longlong(f, 0);
+	else if (extra)
+		write_int(f, 0);
+	if (qsplat_make_veb && Has_Grandchildren(root))
+		WriteNodesVEB(f, wide, little);
+	else
+		WriteNodes(f, wide ? OFFSETS_WIDE : OFFSETS_NARROW, little);
+
+	if (padding) {
+		unsigned char buf[4] = { 0, 0, 0, 0 };
+		fwrite((void *)buf, padding, 1, f);
+	}
+	return !ferror(f);
+}
+
+
+// The number of groups in the tree that start with a child offset
+long long QTree::NumPointers()
+{
+	long long count = 0;
+	std::vector<int> level(1, root), nextlevel;
+	while (!level.empty()) {
+		nextlevel.clear();
+		for (int i = 0; i < level.size(); i++) {
+			int g = level[i];
+			if (!Has_Grandchildren(g))
+				continue;
+			count++;
+			for (int j = 0; j < Num_Children(g); j++) {
+				int n = child[g - numleaves][j];
+				if (Num_Children(n))
+					nextlevel.push_back(n);
+			}
+		}
+		level.swap(nextlevel);
+	}
+	return count;
+}
+
+
+// Add an index of the fragments to the end of a .qs file, so that readers
+// can find them all without visiting each one.  For each fragment, the
+// index has its offset, number of points and bounding sphere, and all the
+// comments are copied into it.  To older readers, the index looks like a
+// fragment with no points.  If the file has any fragments of version 12 or
+// later, or is too big for 32-bit offsets, the index is version 12, with
+// 64-bit offsets and counts, and ends with QSPLAT_INDEX_TAG_WIDE.
+bool write_index(FILE *f)
+{
+	fflush(f);
+	long long end = ftello(f);
+
+	struct Entry {
+		long long offset, points;
+		unsigned char sphere[16];
+	};
+	std::vector<Entry> entries;
+	std::string comments;
+	unsigned char hdr[48];
+	int lastoptions = 0;
+	bool wide = (end > INT_MAX - 64);
+	for (long long pos = 0; pos < end; ) {
+		fseeko(f, pos, SEEK_SET);
+		if (!fread(hdr, 20, 1, f))
+			return false;
+		int version = (hdr[6] - '0') * 10 + (hdr[7] - '0');
+		long long fraglen, points;
+		int options, headerlen;
+		if (version >= QSPLAT_FILE_VERSION_WIDE) {
+			if (!fread(hdr+20, 8, 1, f))
+				return false;
+			fraglen = * (long long *)(hdr+8);  FIX_LONGLONG(fraglen);
+			points = * (long long *)(hdr+16);  FIX_LONGLONG(points);
+			options = * (int *)(hdr+24);  FIX_LONG(options);
+			headerlen = 28;
+			wide = true;
+		} else {
+			int len = * (int *)(hdr+8);  FIX_LONG(len);
+			int n = * (int *)(hdr+12);  FIX_LONG(n);
+			options = * (int *)(hdr+16);  FIX_LONG(options);
+			fraglen = len;
+			points = n;
+			headerlen = 20;
+		}
+		if (fraglen < headerlen || fraglen > end - pos)
+			return false;
+		if (options & QSPLAT_OPT_COMMENTS) {
+			size_t n = comments.size();
+			size_t len = fraglen - headerlen;
+			comments.resize(n + len);
+			if (len && !fread(&comments[n], len, 1, f))
+				return false;
+		} else if (!(options & QSPLAT_OPT_INDEX)) {
+			if (fraglen < headerlen + 20 ||
+			    !fread(hdr+headerlen, 20, 1, f))
+				return false;
+			Entry e;
+			e.offset = pos;
+			e.points = points;
+			memcpy(e.sphere, hdr+headerlen, 16);
+			entries.push_back(e);
+			lastoptions = options;
+		}
+		pos += fraglen;
+	}
+	if (entries.empty())
+		return false;
+
+	// The header is that of an empty fragment with the same sphere as the
+	// first one, and the same color flag as the last, so that older
+	// readers don't notice anything
+	fseeko(f, end, SEEK_SET);
+	int count = entries.size();
+	int s = comments.size();
+	int padding = (4 - (s % 4)) % 4;
+	int countsize = wide ? 8 : 4;
+	long long len = 8 + 2*countsize + 24 + 4 +
+			count * (2*countsize + 16) + 4 + s + padding +
+			countsize + 4;
+	char magic[9];
+	sprintf(magic, "%s%02d", QSPLAT_MAGIC,
+		wide ? QSPLAT_FILE_VERSION_WIDE : QSPLAT_FILE_VERSION);
+	fwrite((void *)magic, 8, 1, f);
+	if (wide) {
+		write_longlong(f, len);
+		write_longlong(f, 0);
+	} else {
+		write_int(f, (int) len);
+		write_int(f, 0);
+	}
+	write_int(f, QSPLAT_OPT_INDEX | (lastoptions & QSPLAT_OPT_COLOR));
+	fwrite((void *)entries[0].sphere, 16, 1, f);
+	write_int(f, 0);
+
+	write_int(f, count);
+	for (int i = 0; i < count; i++) {
+		if (wide) {
+			write_longlong(f, entries[i].offset);
+			write_longlong(f, entries[i].points);
+		} else {
+			write_int(f, (int) entries[i].offset);
+			write_int(f, (int) entries[i].points);
+		}
+		fwrite((void *)entries[i].sphere, 16, 1, f);
+	}
+	write_int(f, s);
+	if (s)
+		fwrite((void *)comments.data(), s, 1, f);
+	unsigned char zero[4] = { 0, 0, 0, 0 };
+	if (padding)
+		fwrite((void *)zero, padding, 1, f);
+	if (wide) {
+		write_longlong(f, end);
+		fwrite((void *)QSPLAT_INDEX_TAG_WIDE, 4, 1, f);
+	} else {
+		write_int(f, (int) end);
+		fwrite((void *)QSPLAT_INDEX_TAG, 4, 1, f);
+	}
+	return !ferror(f);
+}
+
+
+// Open a temporary file next to the .qs file we're going to write, so that
+// the .qs file only shows up once it's complete.  It's open for reading
+// too, so that write_index() can look back at the fragments.
+FILE *QTree::OpenOutput(const char *qsfile, std::string &tmpname)
+{
+	tmpname = std::string(qsfile) + ".tmp";
+	FILE *f = fopen(tmpname.c_str(), "w+b");
+	if (!f) {
+		fprintf(stderr, "Couldn't open %s for writing.\n", tmpname.c_str());
+		return NULL;
+	}
+	setvbuf(f, NULL, _IOFBF, OUTBUF_SIZE);
+	return f;
+}
+
+
+// Finish writing, and give the temporary file its real name.  If anything
+// went wrong (or ok is false), the temporary file is removed instead.
+bool QTree::CloseOutput(FILE *f, const char *qsfile, const std::string &tmpname,
+			bool ok /* = true */)
+{
+	if (ferror(f))
+		ok = false;
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok) {
+		fprintf(stderr, "\nError writing %s\n", tmpname.c_str());
+		remove(tmpname.c_str());
+		return false;
+	}
+#ifdef WIN32
+	// rename() won't replace an existing file on Windows
+	remove(qsfile);
+#endif
+	if (rename(tmpname.c_str(), qsfile) != 0) {
+		fprintf(stderr, "\nCouldn't rename %s to %s\n",
+			tmpname.c_str(), qsfile);
+		remove(tmpname.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+// Write out the header of a fragment, given the size of the tree on disk,
+// the number of leaves, the number of children of the root, and how the
+// nodes are stored.  Version 13 headers are laid out like version 12 ones.
+// Returns the amount of padding that must follow the tree.
+int QTree::WriteHeader(FILE *f, long long treesize, long long leafcount,
+		       int numchildren, bool wide, bool little,
+		       int version /* = 0 */)
+{
 	// Write out magic number
+	if (!version)
+		version = wide ? QSPLAT_FILE_VERSION_WIDE : QSPLAT_FILE_VERSION;
 	unsigned char buf[9];
-	sprintf((char *)buf, "%s%02d", QSPLAT_MAGIC, QSPLAT_FILE_VERSION);
+	sprintf((char *)buf, "%s%02d", QSPLAT_MAGIC, version);
 	fwrite((void *)buf, 8, 1, f);
 
 	// Write out file length
-	int file_len = 8			// Magic number
-		     + 4			// File length
-		     + 4			// Number of leaf nodes
-		     + 4			// Options 'n parameters
-		     + 4*3 + 4			// Center and R of top level
-		     + 4			// # of children @ top level
-		     + Treesize();		// The tree itself
+	int countsize = wide ? 8 : 4;
+	long long file_len = 8			// Magic number
+			   + countsize		// File length
+			   + countsize		// Number of leaf nodes
+			   + 4			// Options 'n parameters
+			   + 4*3 + 4		// Center and R of top level
+			   + 4			// # of children @ top level
+			   + treesize;		// The tree itself
 	int padding = (4 - (file_len % 4)) % 4;
 	if (padding == 4)
 		padding = 0;
 	else
 		file_len += padding;
-	write_int(f, file_len);
+	if (wide) {
+		write_longlong(f, file_len);
+		write_longlong(f, leafcount);
+	} else {
+		write_int(f, (int) file_len);
+		write_int(f, (int) leafcount);
+	}
 
 	// Write out more stuff in the header
-	write_int(f, numleaves);
-	write_int(f, havecolor);
-	write_float(f, root->pos[0]);
-	write_float(f, root->pos[1]);
-	write_float(f, root->pos[2]);
-	write_float(f, root->r);
-	write_int(f, Num_Children(root));
-
-	// Write out the nodes...
-	std::queue<QTree_Node *> todolist;
-	todolist.push(root);
-	int todolistlen = Nodesize(root);
-
-	while (!todolist.empty()) {
-
-		QTree_Node *this_node = todolist.front();
-		todolist.pop();
-		int this_size = Nodesize(this_node);
-
-		// Write out the children of this node
-		if (Has_Grandchildren(this_node))
-			write_int(f, todolistlen);
-		todolistlen -= this_size;
-
-		for (int i = 0; i < Num_Children(this_node); i++) {
-			QTree_Node *n = this_node->child[i];
-
-			QSplat_SphereQuant::quantize(
-				this_node->pos[0], this_node->pos[1],
-				this_node->pos[2], this_node->r,
-				n->pos[0], n->pos[1],
-				n->pos[2], n->r,
-				buf);
-			QSplat_SphereQuant::lookup(
-				buf,
-				this_node->pos[0], this_node->pos[1],
-				this_node->pos[2], this_node->r,
-				n->pos[0], n->pos[1],
-				n->pos[2], n->r);
-
-			buf[1] |= Num_Children(n) ? Num_Children(n) - 1 : 0;
-			if (Has_Grandchildren(n))
-				buf[1] |= 4;
-
-			QSplat_NormQuant::quantize(n->norm, buf+2);
-			QSplat_NormQuant::quantize_cone(n->normcone, buf+2);
-			if (havecolor) {
-				QSplat_ColorQuant::quantize(n->col, buf+4);
-				fwrite((void *)buf, 6, 1, f);
-			} else {
-				fwrite((void *)buf, 4, 1, f);
+	write_int(f, (havecolor ? QSPLAT_OPT_COLOR : 0) |
+		     (little ? QSPLAT_OPT_LITTLE_ENDIAN : 0));
+	write_float(f, pos[root][0]);
+	write_float(f, pos[root][1]);
+	write_float(f, pos[root][2]);
+	write_float(f, r[root]);
+	write_int(f, numchildren);
+
+	return padding;
+}
+
+
+// Write out the nodes in breadth-first order, with 32-bit or 64-bit child
+// offsets, or both, in big-endian or little-endian order.  If levelsizes is
+// non-NULL, it gets the number of bytes at each level of the tree (with
+// 32-bit offsets), and levelptrs gets the number of child offsets at each
+// level.  For each group of siblings, we write a byte to descf giving the
+// number of nodes in the group (minus one), ORed with 4 if the group starts
+// with a child pointer.
+//
+// Each level is done a chunk at a time: first we figure out where every
+// group goes and what its child pointer is, then the nodes themselves are
+// quantized in parallel.
+void QTree::WriteNodes(FILE *f, int offsets /* = OFFSETS_NARROW */,
+		       bool little /* = false */,
+		       std::vector<long long> *levelsizes /* = NULL */,
+		       std::vector<int> *levelptrs /* = NULL */,
+		       FILE *descf /* = NULL */)
+{
+	if (!Num_Children(root))
+		return;
+
+	OutBuffer out(f);
+	int nodesize = havecolor ? 6 : 4;
+	std::vector<int> level(1, root), nextlevel, where;
+	std::vector<unsigned char> buf(ENCODE_CHUNK * (12 + 4 * nodesize));
+
+	// Sizes and positions are kept both for 32-bit offsets [0] and for
+	// 64-bit ones [1]
+	long long levelsize[2];
+	levelsize[0] = Nodesize(root);
+	levelsize[1] = levelsize[0] + (Has_Grandchildren(root) ? 4 : 0);
+
+	while (!level.empty()) {
+		// Bytes in this level before the current group, and in the
+		// next level before the current group's children
+		long long levelpos[2] = { 0, 0 }, nextlevelsize[2] = { 0, 0 };
+		int ptrs = 0;
+		nextlevel.clear();
+
+		for (int begin = 0; begin < level.size(); begin += ENCODE_CHUNK) {
+			int end = min(begin + ENCODE_CHUNK, (int) level.size());
+			where.resize(end - begin);
+			int bytes = 0;
+			for (int i = begin; i < end; i++) {
+				int g = level[i];
+				int nc = Num_Children(g);
+				bool grandchildren = Has_Grandchildren(g);
+				if (grandchildren && (offsets & OFFSETS_NARROW)) {
+					put_offset(&buf[bytes], levelsize[0] -
+						levelpos[0] + nextlevelsize[0],
+						4, little);
+					bytes += 4;
+				}
+				if (grandchildren && (offsets & OFFSETS_WIDE)) {
+					put_offset(&buf[bytes], levelsize[1] -
+						levelpos[1] + nextlevelsize[1],
+						8, little);
+					bytes += 8;
+				}
+				where[i - begin] = bytes;
+				bytes += nc * nodesize;
+				levelpos[0] += Nodesize(g);
+				levelpos[1] += Nodesize(g) + (grandchildren ? 4 : 0);
+				if (grandchildren)
+					ptrs++;
+
+				for (int j = 0; j < nc; j++) {
+					int n = child[g - numleaves][j];
+					if (Num_Children(n)) {
+						nextlevel.push_back(n);
+						nextlevelsize[0] += Nodesize(n);
+						nextlevelsize[1] += Nodesize(n) +
+							(Has_Grandchildren(n) ? 4 : 0);
+					}
+				}
+
+				if (descf) {
+					unsigned char desc = nc - 1;
+					if (grandchildren)
+						desc |= 4;
+					fwrite((void *)&desc, 1, 1, descf);
+				}
 			}
 
-			if (Num_Children(n)) {
-				todolist.push(n);
-				todolistlen += Nodesize(n);
+			EncodeTask t = { this, &level[begin], &where[0], &buf[0],
+					 little };
+			QSplat_TaskPool::ParallelFor(0, end - begin, ENCODE_GRAIN,
+						     EncodeGroupsTask, &t);
+			out.put(&buf[0], bytes);
+		}
+
+		// Keep track of where the levels of the tree begin and end
+		if (levelsizes)
+			levelsizes->push_back(levelsize[0]);
+		if (levelptrs)
+			levelptrs->push_back(ptrs);
+		level.swap(nextlevel);
+		levelsize[0] = nextlevelsize[0];
+		levelsize[1] = nextlevelsize[1];
+	}
+}
+
+
+// The groups that make up a unit of the van Emde Boas layout.  The
+// children of all the nodes of a group have to be contiguous, so a unit is
+// the groups of the children of node u (those that have children of their
+// own), or just the top-level group if u is -1.  Returns how many there are.
+int QTree::UnitGroups(int u, int *groups)
+{
+	if (u < 0) {
+		groups[0] = root;
+		return 1;
+	}
+	int n = 0;
+	for (int i = 0; i < Num_Children(u); i++) {
+		int c = child[u - numleaves][i];
+		if (Num_Children(c))
+			groups[n++] = c;
+	}
+	return n;
+}
+
+
+// Append to units the top levels of the subtree below unit u, in van Emde
+// Boas order: the top half of the levels, then each subtree below them
+void QTree::VEBOrder(int u, int levels, std::vector<int> &units)
+{
+	if (levels <= 1) {
+		units.push_back(u);
+		return;
+	}
+	int top = levels / 2;
+	VEBOrder(u, top, units);
+	VEBBottom(u, top, levels - top, units);
+}
+
+
+// Lay out each of the subtrees that start depth levels below unit u
+void QTree::VEBBottom(int u, int depth, int levels, std::vector<int> &units)
+{
+	int groups[4];
+	int n = UnitGroups(u, groups);
+	for (int i = 0; i < n; i++) {
+		if (!Has_Grandchildren(groups[i]))
+			continue;
+		if (depth == 1)
+			VEBOrder(groups[i], levels, units);
+		else
+			VEBBottom(groups[i], depth - 1, levels, units);
+	}
+}
+
+
+// Write out the nodes in van Emde Boas order.  The groups are quantized a
+// level at a time, just like in WriteNodes, but kept in memory until all of
+// them are done, and then written out unit by unit.
+void QTree::WriteNodesVEB(FILE *f, bool wide, bool little)
+{
+	int nodesize = havecolor ? 6 : 4;
+	int offsetsize = wide ? 8 : 4;
+	std::vector<long long> encpos(maxnodes - numleaves);
+	std::vector<unsigned char> enc;
+	enc.reserve((size_t) Treesize());
+
+	std::vector<int> level(1, root), nextlevel, where;
+	int numlevels = 0;
+	while (!level.empty()) {
+		nextlevel.clear();
+		for (int begin = 0; begin < level.size(); begin += ENCODE_CHUNK) {
+			int end = min(begin + ENCODE_CHUNK, (int) level.size());
+			where.resize(end - begin);
+			size_t base = enc.size();
+			int bytes = 0;
+			for (int i = begin; i < end; i++) {
+				int g = level[i];
+				where[i - begin] = bytes;
+				encpos[g - numleaves] = base + bytes;
+				bytes += Num_Children(g) * nodesize;
+				for (int j = 0; j < Num_Children(g); j++) {
+					int n = child[g - numleaves][j];
+					if (Num_Children(n))
+						nextlevel.push_back(n);
+				}
 			}
+			enc.resize(base + bytes);
+			EncodeTask t = { this, &level[begin], &where[0], &enc[base],
+					 little };
+			QSplat_TaskPool::ParallelFor(0, end - begin, ENCODE_GRAIN,
+						     EncodeGroupsTask, &t);
 		}
+		level.swap(nextlevel);
+		numlevels++;
+	}
 
+	// Figure out where each unit goes...
+	std::vector<int> units;
+	VEBOrder(-1, numlevels, units);
+	std::vector<long long> unitpos(maxnodes - numleaves);
+	long long pos = 0;
+	int groups[4];
+	for (int i = 0; i < units.size(); i++) {
+		if (units[i] >= 0)
+			unitpos[units[i] - numleaves] = pos;
+		int n = UnitGroups(units[i], groups);
+		for (int j = 0; j < n; j++)
+			pos += Num_Children(groups[j]) * nodesize +
+			       (Has_Grandchildren(groups[j]) ? offsetsize : 0);
 	}
 
-	if (padding)
-		fwrite((void *)buf, padding, 1, f);
-	fclose(f);
-	printf("Done.\n");
+	// ... then write them out
+	OutBuffer out(f);
+	pos = 0;
+	for (int i = 0; i < units.size(); i++) {
+		int n = UnitGroups(units[i], groups);
+		for (int j = 0; j < n; j++) {
+			int g = groups[j];
+			if (Has_Grandchildren(g)) {
+				unsigned char buf[8];
+				put_offset(buf, unitpos[g - numleaves] - pos,
+					   offsetsize, little);
+				out.put(buf, offsetsize);
+				pos += offsetsize;
+			}
+			int bytes = Num_Children(g) * nodesize;
+			out.put(&enc[encpos[g - numleaves]], bytes);
+			pos += bytes;
+		}
+	}
 }
 
 
-// Number of children of this node
-int QTree::Num_Children(QTree_Node *n)
+// The children of node n in the 8-wide tree of a version 13 fragment: its
+// own children, with the biggest of those that have children replaced by
+// their children, for as long as they fit.  They stay in the same order, so
+// siblings are still near each other.  Returns how many there are.
+int QTree::WideChildren(int n, int *c)
 {
-	return (n->child[0] ? (n->child[1] ? (n->child[2] ? (n->child[3] ?
-		4 : 3) : 2) : 1) : 0);
+	int nc = Num_Children(n);
+	for (int i = 0; i < nc; i++)
+		c[i] = child[n - numleaves][i];
+
+	for (;;) {
+		int best = -1;
+		for (int i = 0; i < nc; i++) {
+			int k = Num_Children(c[i]);
+			if (k && nc - 1 + k <= 8 &&
+			    (best < 0 || r[c[i]] > r[c[best]]))
+				best = i;
+		}
+		if (best < 0)
+			return nc;
+
+		int m = c[best];
+		int k = Num_Children(m);
+		for (int i = nc - 1; i > best; i--)
+			c[i + k - 1] = c[i];
+		for (int i = 0; i < k; i++)
+			c[best + i] = child[m - numleaves][i];
+		nc += k - 1;
+	}
 }
 
 
-// Does this node have any grandchildren?
-bool QTree::Has_Grandchildren(QTree_Node *n)
+// The number of groups in the 8-wide tree below node n (including its own)
+long long QTree::NumGroups8(int n)
 {
-	if (!n->child[0])
-		return false;
-	if (n->child[0]->child[0])
-		return true;
-	if (!n->child[1])
-		return false;
-	if (n->child[1]->child[0])
-		return true;
-	if (!n->child[2])
-		return false;
-	if (n->child[2]->child[0])
-		return true;
-	if (!n->child[3])
-		return false;
-	if (n->child[3]->child[0])
-		return true;
-	return false;
+	int c[8];
+	int nc = WideChildren(n, c);
+	long long count = 1;
+	for (int i = 0; i < nc; i++)
+		if (Num_Children(c[i]))
+			count += NumGroups8(c[i]);
+	return count;
+}
+
+
+// Write out the groups of a version 13 fragment in breadth-first order.
+// Since every group is the same size, the offset to the children of a group
+// is just the number of groups between them.  Like WriteNodes, each level
+// is laid out a chunk at a time and then quantized in parallel.
+void QTree::WriteNodes8(FILE *f)
+{
+	if (!Num_Children(root))
+		return;
+
+	OutBuffer out(f);
+	int groupsize = Groupsize8();
+	std::vector<int> level(1, root), nextlevel, lanes;
+	std::vector<long long> offsets;
+	std::vector<unsigned char> buf(ENCODE_CHUNK * groupsize);
+
+	// The number of the current group, and of the next group whose parent
+	// we haven't seen yet
+	long long groupnum = 0, nextgroup = 1;
+
+	while (!level.empty()) {
+		nextlevel.clear();
+		for (int begin = 0; begin < level.size(); begin += ENCODE_CHUNK) {
+			int end = min(begin + ENCODE_CHUNK, (int) level.size());
+			lanes.assign(8 * (end - begin), -1);
+			offsets.resize(end - begin);
+			for (int i = begin; i < end; i++, groupnum++) {
+				int *c = &lanes[8 * (i - begin)];
+				int nc = WideChildren(level[i], c);
+				offsets[i - begin] = 0;
+				for (int j = 0; j < nc; j++) {
+					if (!Num_Children(c[j]))
+						continue;
+					if (!offsets[i - begin])
+						offsets[i - begin] = groupsize *
+							(nextgroup - groupnum);
+					nextlevel.push_back(c[j]);
+					nextgroup++;
+				}
+			}
+
+			Encode8Task t = { this, &level[begin], &lanes[0],
+					  &offsets[0], &buf[0] };
+			QSplat_TaskPool::ParallelFor(0, end - begin, ENCODE_GRAIN,
+						     EncodeGroups8Task, &t);
+			out.put(&buf[0], (end - begin) * groupsize);
+		}
+		level.swap(nextlevel);
+	}
+}
+
+
+// Encode groups [begin..end) of an Encode8Task
+void QTree::EncodeGroups8Task(void *arg, int begin, int end)
+{
+	Encode8Task *t = (Encode8Task *) arg;
+	int groupsize = t->qt->Groupsize8();
+	for (int i = begin; i < end; i++)
+		t->qt->EncodeGroup8(t->groups[i], t->lanes + 8 * i,
+				    t->offsets[i], t->buf + groupsize * i);
+}
+
+
+// Quantize one group of a version 13 fragment: the nodes in lanes, relative
+// to their parent g.  The words are the same as in EncodeGroup, except that
+// the flags are kept separately.
+void QTree::EncodeGroup8(int g, const int *lanes, long long offset,
+			 unsigned char *buf)
+{
+	memset(buf, 0, Groupsize8());
+	unsigned char *spheres = buf;
+	unsigned char *norms = buf + 16;
+	unsigned char *cols = buf + 32;
+	unsigned char *info = buf + (havecolor ? 48 : 32);
+
+	for (int i = 0; i < 8 && lanes[i] >= 0; i++) {
+		int n = lanes[i];
+		unsigned char q[2];
+
+		QSplat_SphereQuant::quantize(
+			pos[g][0], pos[g][1],
+			pos[g][2], r[g],
+			pos[n][0], pos[n][1],
+			pos[n][2], r[n],
+			q);
+		QSplat_SphereQuant::lookup(
+			q,
+			pos[g][0], pos[g][1],
+			pos[g][2], r[g],
+			pos[n][0], pos[n][1],
+			pos[n][2], r[n]);
+		spheres[2*i] = q[1];  spheres[2*i+1] = q[0];
+
+		QSplat_NormQuant::quantize(norm[n], q,
+					   dither_key(pos[n], r[n]));
+		QSplat_NormQuant::quantize_cone(Normcone(n), q);
+		norms[2*i] = q[1];  norms[2*i+1] = q[0];
+
+		if (havecolor) {
+			QSplat_ColorQuant::quantize(col[n], q);
+			cols[2*i] = q[1];  cols[2*i+1] = q[0];
+		}
+
+		int c[8];
+		info[i] = 0x80 | (Num_Children(n) ? WideChildren(n, c) : 0);
+	}
+	put_offset(info + 8, offset, 8, true);
+}
+
+
+// Encode groups [begin..end) of an EncodeTask
+void QTree::EncodeGroupsTask(void *arg, int begin, int end)
+{
+	EncodeTask *t = (EncodeTask *) arg;
+	for (int i = begin; i < end; i++) {
+		t->qt->EncodeGroup(t->groups[i], t->buf + t->where[i]);
+		if (t->little)
+			swap_words(t->buf + t->where[i],
+				   t->qt->Num_Children(t->groups[i]) *
+				   (t->qt->havecolor ? 6 : 4));
+	}
+}
+
+
+// Quantize the children of node g, relative to g.  Like the rest of
+// writing, this replaces the positions and radii of the children by their
+// quantized values.
+void QTree::EncodeGroup(int g, unsigned char *buf)
+{
+	int nodesize = havecolor ? 6 : 4;
+	for (int i = 0; i < Num_Children(g); i++, buf += nodesize) {
+		int n = child[g - numleaves][i];
+
+		QSplat_SphereQuant::quantize(
+			pos[g][0], pos[g][1],
+			pos[g][2], r[g],
+			pos[n][0], pos[n][1],
+			pos[n][2], r[n],
+			buf);
+		QSplat_SphereQuant::lookup(
+			buf,
+			pos[g][0], pos[g][1],
+			pos[g][2], r[g],
+			pos[n][0], pos[n][1],
+			pos[n][2], r[n]);
+
+		buf[1] |= Num_Children(n) ? Num_Children(n) - 1 : 0;
+		if (Has_Grandchildren(n))
+			buf[1] |= 4;
+
+		QSplat_NormQuant::quantize(norm[n], buf+2,
+					   dither_key(pos[n], r[n]));
+		QSplat_NormQuant::quantize_cone(Normcone(n), buf+2);
+		if (havecolor)
+			QSplat_ColorQuant::quantize(col[n], buf+4);
+	}
 }
 
 
 // Return size in bytes of a group of nodes on disk
-int QTree::Nodesize(QTree_Node *n)
+int QTree::Nodesize(int n)
 {
-	if (!n || !n->child[0])
+	if (n < 0 || !Num_Children(n))
 		return 0;
 	else
 		return ((havecolor ? 6 : 4) * Num_Children(n)) +
 		       (Has_Grandchildren(n) ? 4 : 0);
 }
 
-// Return size in bytes of the tree on disk
-int QTree::Treesize(QTree_Node *n /* = NULL */ )
+
+// The blocks of a version 14 fragment that are being compressed at once
+struct CompressTask {
+	const unsigned char *in;
+	long long len;		// Bytes in in, including the overlap
+	unsigned char *out;	// bound bytes for each block
+	int bound;
+	int *outlen;
+};
+
+
+// Compress blocks [begin..end) of a CompressTask
+static void compress_blocks(void *arg, int begin, int end)
 {
-	if (!n)	
-		n = root;
+	CompressTask *t = (CompressTask *) arg;
+	for (int i = begin; i < end; i++) {
+		long long start = (long long) i << QSPLAT_BLOCK_BITS;
+		int len = (int) min((long long) (1 << QSPLAT_BLOCK_BITS) +
+				    QSPLAT_BLOCK_OVERLAP, t->len - start);
+		t->outlen[i] = qsplat_lz_compress(t->in + start, len,
+						  t->out + (size_t) t->bound * i);
+	}
+}
 
-	if (!n->child[0])
-		return 0;
 
-	int size = Nodesize(n) + Treesize(n->child[0]);
-	if (n->child[1]) {
-		size += Treesize(n->child[1]);
-		if (n->child[2]) {
-			size += Treesize(n->child[2]);
-			if (n->child[3])
-				size += Treesize(n->child[3]);
+// Write the header and the nodes as a version 14 fragment.  The tree is
+// written out as for version 12 in van Emde Boas order, to a temporary
+// file, and then read back and compressed a batch of blocks at a time.
+// The header and the offsets of the blocks are filled in at the end, once
+// we know where they went.
+bool QTree::WriteCompressed(FILE *f)
+{
+	int extra = (Num_Children(root) && !Has_Grandchildren(root)) ? 8 : 0;
+	long long treelen = Treesize() + 4 * NumPointers() + extra;
+	bool little = qsplat_make_little_endian;
+
+	FILE *tmp = OOC_TempFile();
+	if (extra)
+		write_longlong(tmp, 0);
+	if (Has_Grandchildren(root))
+		WriteNodesVEB(tmp, true, little);
+	else
+		WriteNodes(tmp, OFFSETS_WIDE, little);
+	fflush(tmp);
+	if (ferror(tmp) || ftello(tmp) != treelen) {
+		fclose(tmp);
+		return false;
+	}
+
+	long long blocksize = 1 << QSPLAT_BLOCK_BITS;
+	int numblocks = (int) ((treelen + blocksize - 1) / blocksize);
+	std::vector<long long> offsets(numblocks + 1);
+	long long dirlen = 24 + 8 * (numblocks + 1);
+	long long fragstart = ftello(f);
+	long long where = 48 + dirlen;
+	std::vector<unsigned char> zeros((size_t) where);
+	fwrite((void *)&zeros[0], zeros.size(), 1, f);
+
+	int bound = QSPLAT_LZ_BOUND(blocksize + QSPLAT_BLOCK_OVERLAP);
+	std::vector<unsigned char> in(COMPRESS_BATCH * blocksize +
+				      QSPLAT_BLOCK_OVERLAP);
+	std::vector<unsigned char> out((size_t) COMPRESS_BATCH * bound);
+	std::vector<int> outlen(COMPRESS_BATCH);
+	bool ok = true;
+	for (int b = 0; b < numblocks && ok; b += COMPRESS_BATCH) {
+		int n = min(COMPRESS_BATCH, numblocks - b);
+		long long start = b * blocksize;
+		long long len = min(n * blocksize + QSPLAT_BLOCK_OVERLAP,
+				    treelen - start);
+		fseeko(tmp, start, SEEK_SET);
+		if (!fread((void *)&in[0], (size_t) len, 1, tmp)) {
+			ok = false;
+			break;
+		}
+		CompressTask t = { &in[0], len, &out[0], bound, &outlen[0] };
+		QSplat_TaskPool::ParallelFor(0, n, 1, compress_blocks, &t);
+		for (int i = 0; i < n; i++) {
+			offsets[b + i] = where;
+			fwrite((void *)&out[(size_t) bound * i], outlen[i], 1, f);
+			where += outlen[i];
 		}
 	}
-	return size;
-}
+	offsets[numblocks] = where;
+	fclose(tmp);
+	if (!ok)
+		return false;
+	if (verbose && treelen)
+		printf("compressed to %.1f%%... ",
+		       100.0 * (where - 48 - dirlen) / treelen);
+
+	fflush(f);
+	long long fragend = ftello(f);
+	fseeko(f, fragstart, SEEK_SET);
+	int padding = WriteHeader(f, where - 48, numleaves, Num_Children(root),
+				  true, little, QSPLAT_FILE_VERSION_COMPRESSED);
+	write_int(f, QSPLAT_BLOCK_BITS);
+	write_int(f, QSPLAT_BLOCK_OVERLAP);
+	write_longlong(f, treelen);
+	write_int(f, numblocks);
+	write_int(f, 0);
+	for (int i = 0; i <= numblocks; i++)
+		write_longlong(f, offsets[i]);
+	fflush(f);
+	fseeko(f, fragend, SEEK_SET);
 
+	if (padding) {
+		unsigned char buf[4] = { 0, 0, 0, 0 };
+		fwrite((void *)buf, padding, 1, f);
+	}
+	return !ferror(f);
+}
@@ -12,58 +12,310 @@ Leland Stanford Junior University.  All Rights Reserved.
 
 #include "mempool.h"
 #include "qsplat_util.h"
+#include "qsplat_threads.h"
+#include <stdio.h>
+#include <string.h>
 #include <string>
+#include <vector>
+#include <atomic>
 
 
+// A few random #defines
+#define QSPLAT_MAGIC "QSplat"
+#define QSPLAT_FILE_VERSION 11
+
+// Fragments too big for version 11 are written as version 12, which has a
+// 64-bit length and number of points in the header (which is 48 bytes
+// instead of 40), and 64-bit child offsets.  qsplat_make_wide makes every
+// fragment version 12.
+#define QSPLAT_FILE_VERSION_WIDE 12
+extern bool qsplat_make_wide;
+
+// If qsplat_make_little_endian is set, the nodes and child offsets of each
+// fragment are written in little-endian order, so that little-endian
+// machines don't have to swap them as they draw.  The headers stay
+// big-endian.
+extern bool qsplat_make_little_endian;
+
+// Normally the groups of siblings are written in breadth-first order.  If
+// qsplat_make_veb is set, they're written in van Emde Boas order instead:
+// the top half of the levels of the tree, laid out the same way, followed
+// by each of the subtrees hanging below them, recursively.  Each subtree
+// ends up in a contiguous piece of the file, so a descent to one spot of
+// the model touches fewer pages.  Readers only follow the child offsets,
+// so they can't tell the difference.
+extern bool qsplat_make_veb;
+
+// If qsplat_make_simd is set, fragments are written as version 13 instead,
+// in which the tree is 8-wide and each group of siblings is stored as a
+// fixed-size block: the sphere words of all 8 slots, then their normal
+// words, then their color words (if any), then a byte per slot (0 if the
+// slot is empty, otherwise 0x80 | its number of children), then a 64-bit
+// offset from the start of the block to the blocks of its children.  A
+// reader can load each kind of word for the whole group at once and test
+// all 8 nodes side by side.  The header is the same as for version 12, and
+// everything is little-endian.
+#define QSPLAT_FILE_VERSION_SIMD 13
+extern bool qsplat_make_simd;
+
+// If qsplat_make_compress is set, fragments are written as version 14,
+// which holds a little- or big-endian version 12 tree (always in van Emde
+// Boas order, so that subtrees end up together) cut into blocks of
+// (1 << QSPLAT_BLOCK_BITS) bytes, each compressed on its own (see
+// qsplat_lz.h), so that readers only read and decompress the blocks they
+// use.  Each block carries on for QSPLAT_BLOCK_OVERLAP bytes past its end,
+// so a group that starts in a block can be read from that block alone.
+// After the version 12 header come the log2 of the block size, the overlap,
+// the length of the tree (64 bits), the number of blocks, an unused int,
+// and the offset of each block from the start of the fragment (64 bits),
+// with one more for the end of the last block.  Then the blocks.
+#define QSPLAT_FILE_VERSION_COMPRESSED 14
+#define QSPLAT_BLOCK_BITS 14
+#define QSPLAT_BLOCK_OVERLAP 32
+extern bool qsplat_make_compress;
+
+// Bits in the options of a fragment.  An index fragment lists all the other
+// fragments of a file; it comes last, and the file ends with its offset
+// followed by QSPLAT_INDEX_TAG.
+#define QSPLAT_OPT_COLOR 1
+#define QSPLAT_OPT_COMMENTS 2
+#define QSPLAT_OPT_INDEX 4
+#define QSPLAT_OPT_LITTLE_ENDIAN 8
+#define QSPLAT_INDEX_TAG "QSix"
+#define QSPLAT_INDEX_TAG_WIDE "QSiX"
+
+
+// A couple of trivial helper functions
+static inline void write_float(FILE *f, float F)
+{
+	FIX_FLOAT(F);
+	fwrite((void *)&F, 4, 1, f);
+}
+static inline void write_int(FILE *f, int I)
+{
+	FIX_LONG(I);
+	fwrite((void *)&I, 4, 1, f);
+}
+static inline void write_longlong(FILE *f, long long L)
+{
+	FIX_LONGLONG(L);
+	fwrite((void *)&L, 8, 1, f);
+}
+
+// Put a child offset of the given size (4 or 8 bytes) at p, read one back,
+// or write one to f
+static inline void put_offset(unsigned char *p, long long offset, int bytes,
+			      bool little)
+{
+	for (int i = 0; i < bytes; i++, offset >>= 8)
+		p[little ? i : bytes - 1 - i] = (unsigned char) (offset & 0xff);
+}
+static inline long long get_offset(const unsigned char *p, int bytes,
+				   bool little)
+{
+	long long offset = 0;
+	for (int i = 0; i < bytes; i++)
+		offset = (offset << 8) | p[little ? bytes - 1 - i : i];
+	if (bytes == 4)
+		offset = (int) offset;
+	return offset;
+}
+static inline void write_offset(FILE *f, long long offset, bool wide,
+				bool little)
+{
+	unsigned char buf[8];
+	int bytes = wide ? 8 : 4;
+	put_offset(buf, offset, bytes, little);
+	fwrite((void *)buf, bytes, 1, f);
+}
+
+// Nodes are made of 16-bit words; this switches them between big-endian
+// and little-endian order
+static inline void swap_words(unsigned char *p, size_t bytes)
+{
+	for (size_t i = 0; i + 1 < bytes; i += 2) {
+		unsigned char tmp = p[i];
+		p[i] = p[i+1];
+		p[i+1] = tmp;
+	}
+}
+
+// The key for dithering the normal of a node, made from its position and
+// radius (as they will be read back from the file)
+static inline unsigned dither_key(const float *pos, float r)
+{
+	unsigned k[4];
+	memcpy(k, pos, 12);
+	memcpy(k+3, &r, 4);
+	unsigned h = 0x811c9dc5u;
+	for (int i = 0; i < 4; i++) {
+		h = (h ^ k[i]) * 0x01000193u;
+		h ^= h >> 15;
+	}
+	return h;
+}
+
+static inline void write_comments(FILE *f, const std::string &comments)
+{
+	int s = comments.size();
+	int padding = (4 - (s % 4)) % 4;
+	unsigned char buf[9];
+	sprintf((char *)buf, "%s%02d", QSPLAT_MAGIC, QSPLAT_FILE_VERSION);
+	fwrite((void *)buf, 8, 1, f);
+	write_int(f, 20 + s + padding);
+	write_int(f, 0);
+	write_int(f, 2);
+	fwrite((void *)comments.data(), s, 1, f);
+	buf[0] = buf[1] = buf[2] = 0;
+	if (padding) fwrite((void *)buf, padding, 1, f);
+}
+
+
+extern bool write_index(FILE *f);
+
+
+// A vertex of the mesh, which will become a leaf of the tree
 struct QTree_Node {
 	point pos;
 	float r;
 	vec norm;
-	float normcone;
-	union {
-		QTree_Node * child[4];
-		struct {
-			int refcount;
-			int remap;
-			short col_tmp[3];
-		} m;	// What @$@#! on the C++ committee
-			// put in anon unions but not structs?
-	};
+	struct {
+		int refcount;
+		int remap;
+		short col_tmp[3];
+	} m;	// Scratch space for the code that reads the mesh
 	color col;
-
-
-	static PoolAlloc memPool;
-	void *operator new(size_t n) { return memPool.alloc(n); }
-	void operator delete(void *p, size_t n) { memPool.free(p,n); }
 };
 
 
+// The tree.  Each attribute of the nodes lives in an array of its own, and
+// nodes refer to their children by number.  Nodes [0..numleaves) are the
+// leaves; the interior nodes come after them, and only they have normal
+// cones and children.
 class QTree {
 private:
-	QTree_Node *root, *leaves;
-	int numleaves;
-	QTree_Node **leafptr;
+	friend class QTree_OOC;
+	int numleaves, maxnodes, root;
+	point *pos;
+	float *r;
+	vec *norm;
+	color *col;			// NULL if !havecolor
+	float *normcone;		// Interior nodes only
+	int (*child)[4];		// Interior nodes only, -1 if no child
+	unsigned char *groupinfo;	// Interior nodes only: number of
+					// children, | 8 if any grandchildren
+	long long *subtreesize;		// Interior nodes only: bytes on disk
+					// of the groups below this node, with
+					// 32-bit child offsets
 	bool havecolor;
-	void InitLeaves();
-	QTree_Node *BuildLeaves(int begin, int end);
-	QTree_Node *CombineNodes(QTree_Node *n1, QTree_Node *n2);
-	QTree_Node *CombineNodes(QTree_Node *n1, QTree_Node *n2, QTree_Node *n3);
-	QTree_Node *CombineNodes(QTree_Node *n1, QTree_Node *n2, QTree_Node *n3, QTree_Node *n4);
-	QTree_Node *CombineLeaves(int begin, int end);
+	bool verbose;
+	Arena *arena;			// Where the arrays come from
+	bool ownarena;
+
+	// Interior nodes are handed out to each thread in chunks
+	struct NodeChunk {
+		int next, end;
+	};
+	std::atomic<int> nextchunk;
+	std::vector<NodeChunk> chunks;
+
+	QTree(int numinterior, bool _havecolor, Arena *_arena = NULL);
+	void Alloc(int numinterior);
+	void InitLeaves(const QTree_Node *leaves);
+	int NewNode();
+	void CopyNode(int n, const QTree &from, int fromnode);
+	int BuildLeaves(int begin, int end);
+	struct BuildTask {
+		QTree *qt;
+		int begin, end;
+		int result;
+	};
+	static void BuildLeavesTask(void *arg);
+	struct EncodeTask {
+		QTree *qt;
+		const int *groups;	// Parents of the groups to encode
+		const int *where;	// Where each group goes in buf
+		unsigned char *buf;
+		bool little;		// Swap the words of each node
+	};
+	static void EncodeGroupsTask(void *arg, int begin, int end);
+	void EncodeGroup(int n, unsigned char *buf);
+	int BuildMorton();
+	static void CombineRangeTask(void *arg, int begin, int end);
+	void Combine(int n, const int *c, int nc);
+	int CombineNodes(const int *c, int nc);
+	int CombineLeaves(int begin, int end);
 	int Partition(int begin, int end);
-	int Num_Children(QTree_Node *n);
-	bool Has_Grandchildren(QTree_Node *n);
-	int Nodesize(QTree_Node *n);
-	int Treesize(QTree_Node *n = NULL);
+	void SwapLeaves(int i, int j);
+	float Normcone(int n)
+		{ return n < numleaves ? 0.0f : normcone[n - numleaves]; }
+	int Num_Children(int n)
+		{ return n < numleaves ? 0 : (groupinfo[n - numleaves] & 7); }
+	bool Has_Grandchildren(int n)
+		{ return n >= numleaves && (groupinfo[n - numleaves] & 8); }
+	int Nodesize(int n);
+	long long Treesize(int n = -1)
+		{ if (n < 0) n = root;
+		  return n < numleaves ? 0 : subtreesize[n - numleaves]; }
+	long long NumPointers();
+	int WriteHeader(FILE *f, long long treesize, long long leafcount,
+			int numchildren, bool wide, bool little,
+			int version = 0);
+	// Which child offsets WriteNodes writes: 32-bit, 64-bit, or both
+	// (the 32-bit one first)
+	enum { OFFSETS_NARROW = 1, OFFSETS_WIDE = 2, OFFSETS_BOTH = 3 };
+	void WriteNodes(FILE *f, int offsets = OFFSETS_NARROW,
+			bool little = false,
+			std::vector<long long> *levelsizes = NULL,
+			std::vector<int> *levelptrs = NULL,
+			FILE *descf = NULL);
+	void VEBOrder(int u, int levels, std::vector<int> &units);
+	void VEBBottom(int u, int depth, int levels, std::vector<int> &units);
+	int UnitGroups(int u, int *groups);
+	void WriteNodesVEB(FILE *f, bool wide, bool little);
+	int WideChildren(int n, int *c);
+	long long NumGroups8(int n);
+	int Groupsize8() { return havecolor ? 64 : 48; }
+	struct Encode8Task {
+		QTree *qt;
+		const int *groups;	// Parents of the groups to encode
+		const int *lanes;	// 8 per group, -1 if empty
+		const long long *offsets;
+		unsigned char *buf;
+	};
+	static void EncodeGroups8Task(void *arg, int begin, int end);
+	void EncodeGroup8(int g, const int *lanes, long long offset,
+			  unsigned char *buf);
+	void WriteNodes8(FILE *f);
+	bool WriteCompressed(FILE *f);
 
 public:
-	QTree(int _numleaves, QTree_Node *_leaves, bool _havecolor) :
-		numleaves(_numleaves), leaves(_leaves), havecolor(_havecolor)
-	{
-		InitLeaves();
-	}
-	void BuildTree();
-	void Write(const char *qsfile, const std::string &comments);
+	// The tree keeps its own copy of the leaves that are in use (i.e.,
+	// that are referenced and have nonzero size), so the array of
+	// QTree_Nodes can be freed as soon as this returns.  The nodes are
+	// allocated from the given arena, which must not be reset while the
+	// tree is around, or from an arena of the tree's own.
+	QTree(int _numleaves, const QTree_Node *leaves, bool _havecolor,
+	      bool _verbose = true, Arena *_arena = NULL);
+	~QTree();
+	// The tree normally comes from recursive midpoint splits.  If morton
+	// is true, the leaves are instead sorted along a Z-order curve and the
+	// tree is made from the bits of their positions along it, which is
+	// faster to build but gives a slightly different tree.
+	void BuildTree(bool morton = false);
+	bool Write(const char *qsfile, const std::string &comments);
+
+	// Write just the header and the nodes, as one fragment of a .qs file.
+	// The fragment is version 11 if it fits, otherwise version 12 (or
+	// version 13 if qsplat_make_simd is set, or 14 if
+	// qsplat_make_compress is).
+	bool WriteFragment(FILE *f);
+
+	// A .qs file is written under a temporary name, and only renamed to
+	// qsfile once it's complete.  CloseOutput() cleans up if !ok.
+	static FILE *OpenOutput(const char *qsfile, std::string &tmpname);
+	static bool CloseOutput(FILE *f, const char *qsfile,
+				const std::string &tmpname, bool ok = true);
 };
 
 #endif
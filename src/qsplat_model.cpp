@@ -10,6 +10,7 @@ Leland Stanford Junior University.  All Rights Reserved.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -19,6 +20,7 @@ Leland Stanford Junior University.  All Rights Reserved.
 #include "qsplat_normquant.h"
 #include "qsplat_spherequant.h"
 #include "qsplat_colorquant.h"
+#include "qsplat_lz.h"
 
 #ifdef WIN32
 # include <windows.h>
@@ -42,9 +44,16 @@ Leland Stanford Junior University.  All Rights Reserved.
 
 // A few random #defines
 #define QSPLAT_MAGIC "QSplat"
+#define QSPLAT_OPT_COMMENTS 2
+#define QSPLAT_OPT_INDEX 4
+#define QSPLAT_INDEX_TAG "QSix"
+#define QSPLAT_INDEX_TAG_WIDE "QSiX"
+#define FRAGMENTS_PER_NODE 4
 #define MINSIZE_MIN 1.0f
 #define MINSIZE_MAX 50.0f
 #define MINSIZE_REFINE_MULTIPLIER 0.7f
+#define PREFETCH_DEFAULT_MB 16
+#define QSPLAT_TREE_BLOCK_BITS 16	// 64KB blocks when reading with pread()
 
 
 // An error occurred while trying to open the file
@@ -110,22 +119,51 @@ QSplat_Model *QSplat_Model::Open(const char *modelfilename)
 	}
 #endif
 
+	// If QSPLAT_PREAD is set, the file isn't mapped at all: it's read
+	// with pread() through a block cache of that many MB.  We also end
+	// up doing that if the mmap doesn't work.
+	const char *cache_mb = getenv("QSPLAT_PREAD");
 	unsigned char *mem_start = NULL, *map_start = NULL;
-	if (!MapFile(fd, len, &mem_start, &map_start)) {
-		CloseHandle(fd);
-		return NULL;
+	if (!cache_mb && !MapFile(fd, len, &mem_start, &map_start)) {
+		Error("Couldn't map the file, so reading it instead: ",
+		      modelfilename);
+		cache_mb = "";
 	}
+	QSplat_ByteSource *source;
+	if (map_start)
+		source = new QSplat_MappedBytes(map_start);
+	else
+		source = new QSplat_FileBytes(fd);
 
 
 	// Build the new object
 	QSplat_Model *q = new QSplat_Model(std::string(modelfilename),
 					   mem_start, map_start,
-					   fd, len);
+					   fd, len, source);
+	q->blockcache.SetSource(source);
+	if (cache_mb && atoi(cache_mb) > 0)
+		q->blockcache.SetBudget((size_t) atoi(cache_mb) << 20);
 
 	if (!q->BuildFragmentList(modelfilename)) {
 		delete q;
 		return NULL;
 	}
+	if (map_start)
+		q->pagein = new QSplat_PageIn(map_start, len);
+
+	// QSPLAT_BUDGET says how many MB of the mapped file to keep in memory
+	// (by default, as much as the OS lets us)
+	const char *keep = getenv("QSPLAT_BUDGET");
+	if (q->pagein && keep && atoi(keep) > 0)
+		q->pagein->SetBudget((size_t) atoi(keep) << 20);
+
+	// Read in the top levels of the tree now, so that the first frames
+	// don't have to wait for them.  QSPLAT_PREFETCH says how many MB
+	// to read, and if QSPLAT_PREFETCH_LOCK is set they're kept in memory.
+	const char *prefetch = getenv("QSPLAT_PREFETCH");
+	size_t budget = prefetch ? max(atoi(prefetch), 0) : PREFETCH_DEFAULT_MB;
+	if (!q->Prefetch(budget << 20, getenv("QSPLAT_PREFETCH_LOCK") != NULL))
+		Error("Couldn't lock the top levels in memory for ", modelfilename);
 
 	return q;
 }
@@ -185,15 +223,41 @@ void QSplat_Model::stop_refine()
 }
 
 
-// Destructor - unmap the file
+// Have pages that draw() had to go without come in since we last asked?
+bool QSplat_Model::pages_arrived()
+{
+	return pagein && pagein->Arrived();
+}
+
+
+// Are we still waiting for pages?
+bool QSplat_Model::paging()
+{
+	return pagein && pagein->Busy();
+}
+
+
+// Destructor - unmap (or just close) the file
 QSplat_Model::~QSplat_Model()
 {
+	if (predictor.joinable()) {
+		{
+			std::lock_guard<std::mutex> l(predictlock);
+			predictquit = true;
+		}
+		predictwakeup.notify_one();
+		predictor.join();
+	}
 	fragments.clear();
+	delete pagein;
+	delete source;
+	if (map_start) {
 #ifdef WIN32
-	UnmapViewOfFile(map_start);
+		UnmapViewOfFile(map_start);
 #else
-	munmap((char *)map_start, len);
+		munmap((char *)map_start, len);
 #endif
+	}
 	if (mem_start)
 		delete [] mem_start;
 	CloseHandle(fd);
@@ -216,7 +280,7 @@ off_t QSplat_Model::FileLen(HFILE fd)
 	BY_HANDLE_FILE_INFORMATION fdInfo;
 	if (!GetFileInformationByHandle((HANDLE)fd, &fdInfo))
 		return -1;
-	return fdInfo.nFileSizeLow;
+	return ((off_t) fdInfo.nFileSizeHigh << 32) | fdInfo.nFileSizeLow;
 #else
 	struct stat statbuf;
 	if (fstat(fd, &statbuf) == -1)
@@ -243,7 +307,8 @@ bool QSplat_Model::MapFile(HANDLE fd, off_t len,
 			CloseHandle(fdMapping);
 		sprintf(mapName, "QSplat%d", mapNum++);
 		fdMapping = CreateFileMapping(fd, NULL, PAGE_READONLY,
-					      0, len, mapName);
+					      (DWORD) (len >> 32), (DWORD) len,
+					      mapName);
 	} while ((error = GetLastError()) == ERROR_ALREADY_EXISTS);
 
 	if (!fdMapping || error != NO_ERROR) {
@@ -254,7 +319,7 @@ bool QSplat_Model::MapFile(HANDLE fd, off_t len,
 	}
 
 	*map_start = (unsigned char *) MapViewOfFile(fdMapping, FILE_MAP_READ,
-						     0, 0, len);
+						     0, 0, (SIZE_T) len);
 	if (*map_start)
 		return true;
 
@@ -318,72 +383,448 @@ bool QSplat_Model::MapFile(HANDLE fd, off_t len,
 }
 
 
+// Helpers for reading the header fields of version 12 files, which might
+// not be aligned
+static inline long long get_longlong(const unsigned char *p)
+{
+	long long L;
+	memcpy(&L, p, 8);
+	FIX_LONGLONG(L);
+	return L;
+}
+
+static inline int get_int(const unsigned char *p)
+{
+	int I;
+	memcpy(&I, p, 4);
+	FIX_LONG(I);
+	return I;
+}
+
+static inline float get_float(const unsigned char *p)
+{
+	float F;
+	memcpy(&F, p, 4);
+	FIX_FLOAT(F);
+	return F;
+}
+
+
+// The version number of a fragment, from its magic number
+static inline int fragment_version(const unsigned char *here)
+{
+	return (here[6] - '0') * 10 + (here[7] - '0');
+}
+
+
+// Files with several fragments may end with an index of the fragments,
+// which lets us find them all without touching each one.  Returns false
+// if there's no index (or it doesn't make sense), in which case we have
+// to go looking for the fragments.  A version 12 index has 64-bit offsets
+// and counts, and a different tag at the end.
+bool QSplat_Model::ReadIndex(float *bmin, float *bmax)
+{
+	if (len < 56)
+		return false;
+	std::vector<unsigned char> buf;
+	const unsigned char *tail = source->Get(len - 12, 12, buf);
+	if (!tail)
+		return false;
+	bool wide;
+	if (strncmp((const char *)(tail+8), QSPLAT_INDEX_TAG, 4) == 0)
+		wide = false;
+	else if (strncmp((const char *)(tail+8), QSPLAT_INDEX_TAG_WIDE, 4) == 0)
+		wide = true;
+	else
+		return false;
+
+	// Header, count, comment length, and the start of the index
+	int countsize = wide ? 8 : 4;
+	int headerlen = wide ? 48 : 40;
+	int entrysize = 2*countsize + 16;
+	int fixedlen = headerlen + 4 + 4 + countsize + 4;
+
+	long long start = wide ? get_longlong(tail) : get_int(tail+4);
+	if (start < 0 || start > len - fixedlen || (start & 3))
+		return false;
+
+	// The index is small, so we just read all of it
+	const unsigned char *here = source->Get(start, len - start, buf);
+	if (!here)
+		return false;
+	if (strncmp((const char *)here, QSPLAT_MAGIC, 6) != 0 ||
+	    fragment_version(here) != (wide ? QSPLAT_FILE_VERSION_WIDE :
+					      QSPLAT_FILE_VERSION) ||
+	    !(here[wide ? 27 : 19] & QSPLAT_OPT_INDEX))
+		return false;
+	long long fraglen = wide ? get_longlong(here+8) : get_int(here+8);
+	int count = get_int(here+headerlen);
+	if (fraglen != len - start || count <= 0 ||
+	    count > (fraglen - fixedlen) / entrysize)
+		return false;
+	const unsigned char *entries = here + headerlen + 4;
+	int commentlen = get_int(entries + entrysize*count);
+	if (commentlen < 0 || commentlen > fraglen - fixedlen - entrysize*count)
+		return false;
+
+	// Make sure the fragments are all in the right place before we
+	// believe any of it
+	int i;
+	for (i = 0; i < count; i++) {
+		const unsigned char *e = entries + entrysize*i;
+		long long offset = wide ? get_longlong(e) : get_int(e);
+		if (offset < 0 || offset > start - 40 || (offset & 3))
+			return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		const unsigned char *e = entries + entrysize*i;
+		long long offset, points;
+		if (wide) {
+			offset = get_longlong(e);
+			points = get_longlong(e+8);
+		} else {
+			offset = get_int(e);
+			points = get_int(e+4);
+		}
+		e += 2*countsize;
+		float x = get_float(e);
+		float y = get_float(e+4);
+		float z = get_float(e+8);
+		float r = get_float(e+12);
+		leaf_points += points;
+		bmin[0] = min(bmin[0], x-r);  bmax[0] = max(bmax[0], x+r);
+		bmin[1] = min(bmin[1], y-r);  bmax[1] = max(bmax[1], y+r);
+		bmin[2] = min(bmin[2], z-r);  bmax[2] = max(bmax[2], z+r);
+		AddFragment(offset, x, y, z, r);
+	}
+	comments.append((const char *)(entries + entrysize*count + 4),
+			commentlen);
+
+	return true;
+}
+
+
+void QSplat_Model::AddFragment(long long offset,
+				float x, float y, float z, float r)
+{
+	Fragment f;
+	f.start = offset;
+	f.drawstart = NULL;
+	f.cx = x;  f.cy = y;  f.cz = z;  f.r = r;
+	f.numchildren = -1;
+	f.havecolor = f.wide = f.little = f.simd = false;
+	f.firstblock = -1;
+	f.blockbits = 0;
+	f.treelen = 0;
+	fragments.push_back(f);
+}
+
+
+// Read the rest of the header of a fragment, the first time it's drawn.
+// If the file is mapped, the tree is drawn straight out of the map unless
+// it's compressed.  Otherwise, it's read through the block cache.  A
+// fragment that can't be read is left with no children, so that it's
+// skipped from then on instead of being tried (and complained about) again
+// every frame.
+void QSplat_Model::ReadHeader(Fragment &f)
+{
+	f.numchildren = 0;
+	std::vector<unsigned char> buf;
+	int n = (int) min((long long) QSPLAT_FRAGMENT_HEADER_MAX,
+			  (long long) len - f.start);
+	const unsigned char *header = source->Get(f.start, n, buf);
+	if (!header) {
+		Error("Couldn't read header of ", filename.c_str());
+		return;
+	}
+
+	int numchildren;
+	bool compressed;
+	const unsigned char *tree = parse_header(header, &numchildren,
+						 &f.havecolor, &f.wide,
+						 &f.little, &f.simd,
+						 &compressed);
+	int headerlen = tree - header;
+	long long fraglen = f.wide ? get_longlong(header+8) : get_int(header+8);
+	if (!numchildren)
+		return;
+
+	// The top level is one group, so it has at most 8 nodes
+	bool ok = true;
+	if (numchildren < 0 || numchildren > 8)
+		ok = false;
+	else if (compressed)
+		ok = AddBlocks(f, fraglen, headerlen);
+	else if (map_start)
+		f.drawstart = map_start + f.start + headerlen;
+	else
+		AddTreeBlocks(f, fraglen, headerlen);
+	if (!ok) {
+		Error(filename.c_str(), compressed ?
+		      " has a corrupt compressed fragment" :
+		      " couldn't be read");
+		return;
+	}
+	f.numchildren = numchildren;
+}
+
+
+// Add the blocks of a compressed (version 14) fragment to the block cache.
+// Returns false if the list of them doesn't make sense.
+bool QSplat_Model::AddBlocks(Fragment &f, long long fraglen, int headerlen)
+{
+	long long dirstart = headerlen + 24;
+	if (fraglen < dirstart)
+		return false;
+	std::vector<unsigned char> buf;
+	const unsigned char *here = source->Get(f.start + headerlen, 24, buf);
+	if (!here)
+		return false;
+	int bits = get_int(here);
+	int overlap = get_int(here+4);
+	long long treelen = get_longlong(here+8);
+	int numblocks = get_int(here+16);
+	if (bits < 8 || bits > 24 || treelen <= 0 || numblocks <= 0 ||
+	    overlap < 8 + 4 * (f.havecolor ? 6 : 4) || overlap > (1 << bits) ||
+	    ((long long) (numblocks - 1) << bits) >= treelen ||
+	    ((long long) numblocks << bits) < treelen ||
+	    fraglen < dirstart + 8LL * (numblocks + 1))
+		return false;
+
+	const unsigned char *dir = source->Get(f.start + dirstart,
+					       8 * (numblocks + 1), buf);
+	if (!dir)
+		return false;
+	long long prev = dirstart + 8LL * (numblocks + 1);
+	for (int i = 0; i <= numblocks; i++) {
+		long long offset = get_longlong(dir + 8*i);
+		if (offset < prev || offset > fraglen ||
+		    (i && offset - prev > QSPLAT_LZ_BOUND(
+				(1 << bits) + overlap)))
+			return false;
+		prev = offset;
+	}
+
+	f.firstblock = blockcache.NumBlocks();
+	f.blockbits = bits;
+	f.treelen = treelen;
+	for (int i = 0; i < numblocks; i++) {
+		long long offset = get_longlong(dir + 8*i);
+		long long start = (long long) i << bits;
+		int len = (int) min((long long) (1 << bits) + overlap,
+				    treelen - start);
+		blockcache.AddBlock(f.start + offset,
+				    (int) (get_longlong(dir + 8*i+8) - offset),
+				    len, true);
+	}
+	return true;
+}
+
+
+// Cut the tree of a fragment that isn't mapped into blocks for the block
+// cache.  Like the blocks of compressed fragments, each one carries enough
+// of the next one that any group can be read from the block it starts in.
+// Version 13 groups are all the same size, so that's all they need.
+void QSplat_Model::AddTreeBlocks(Fragment &f, long long fraglen, int headerlen)
+{
+	int bits = QSPLAT_TREE_BLOCK_BITS;
+	int overlap = f.simd ? group8_size(f.havecolor) :
+			       8 + 4 * (f.havecolor ? 6 : 4);
+	long long treelen = fraglen - headerlen;
+
+	f.firstblock = blockcache.NumBlocks();
+	f.blockbits = bits;
+	f.treelen = treelen;
+	for (long long start = 0; start < treelen; start += (1 << bits)) {
+		int len = (int) min((long long) (1 << bits) + overlap,
+				    treelen - start);
+		blockcache.AddBlock(f.start + headerlen + start, len, len,
+				    false);
+	}
+}
+
+
+// Orders fragments by the position of their centers along one axis
+struct FragmentCompare {
+	int axis;
+	FragmentCompare(int axis_) : axis(axis_) {}
+	bool operator () (const QSplat_Model::Fragment &a,
+			  const QSplat_Model::Fragment &b) const
+	{
+		const float *ca = &a.cx, *cb = &b.cx;
+		return ca[axis] < cb[axis];
+	}
+};
+
+
+// Make a node of the fragment hierarchy covering count fragments starting
+// at first, and (if there are enough of them) split them in half along the
+// longest axis and make the children.  Returns the index of the node.
+int QSplat_Model::BuildFragmentTree(int first, int count)
+{
+	float bmin[3] = { 3.3e33f, 3.3e33f, 3.3e33f };
+	float bmax[3] = { -3.3e33f, -3.3e33f, -3.3e33f };
+	float cmin[3] = { 3.3e33f, 3.3e33f, 3.3e33f };
+	float cmax[3] = { -3.3e33f, -3.3e33f, -3.3e33f };
+	int i;
+	for (i = first; i < first+count; i++) {
+		const float *c = &fragments[i].cx;
+		float r = fragments[i].r;
+		for (int j = 0; j < 3; j++) {
+			bmin[j] = min(bmin[j], c[j]-r);
+			bmax[j] = max(bmax[j], c[j]+r);
+			cmin[j] = min(cmin[j], c[j]);
+			cmax[j] = max(cmax[j], c[j]);
+		}
+	}
+
+	// The sphere is centered on the bounding box, and big enough to
+	// hold all the fragments' spheres
+	FragmentNode n;
+	n.cx = 0.5f * (bmin[0] + bmax[0]);
+	n.cy = 0.5f * (bmin[1] + bmax[1]);
+	n.cz = 0.5f * (bmin[2] + bmax[2]);
+	n.r = 0.0f;
+	for (i = first; i < first+count; i++) {
+		const Fragment &f = fragments[i];
+		float d = sqrtf(sqr(f.cx-n.cx) + sqr(f.cy-n.cy) + sqr(f.cz-n.cz));
+		n.r = max(n.r, d + f.r);
+	}
+	n.first = first;
+	n.count = count;
+	n.right = 0;
+
+	int me = fragtree.size();
+	fragtree.push_back(n);
+	if (count <= FRAGMENTS_PER_NODE)
+		return me;
+
+	int axis = 0;
+	if (cmax[1]-cmin[1] > cmax[axis]-cmin[axis])
+		axis = 1;
+	if (cmax[2]-cmin[2] > cmax[axis]-cmin[axis])
+		axis = 2;
+	int half = count / 2;
+	std::nth_element(fragments.begin() + first,
+			 fragments.begin() + first + half,
+			 fragments.begin() + first + count,
+			 FragmentCompare(axis));
+
+	BuildFragmentTree(first, half);
+	int right = BuildFragmentTree(first + half, count - half);
+	fragtree[me].right = right;
+	return me;
+}
+
+
 // A single file can have multiple fragments - the file just looks like
 // the files for the individual fragments catted together
 bool QSplat_Model::BuildFragmentList(const char *filename)
 {
-	float xmin=3.3e33f, xmax=-3.3e33f;
-	float ymin=3.3e33f, ymax=-3.3e33f;
-	float zmin=3.3e33f, zmax=-3.3e33f;
+	float bmin[3] = { 3.3e33f, 3.3e33f, 3.3e33f };
+	float bmax[3] = { -3.3e33f, -3.3e33f, -3.3e33f };
 
 	comments = "File "; comments += filename; comments += "\n";
 
-	const unsigned char *here = map_start;
-	while (here < map_start+len) {
+	// With an index, there's no need to go through the fragments
+	long long here = 0;
+	if (ReadIndex(bmin, bmax))
+		here = len;
+	std::vector<unsigned char> headerbuf;
+	while (here < len) {
 
-		if (map_start+len-here < 40) {
+		if (len-here < 40) {
+			Error("Couldn't read header of ", filename);
+			return false;
+		}
+		int n = (int) min((long long) QSPLAT_FRAGMENT_HEADER_MAX,
+				  (long long) len-here);
+		const unsigned char *header = source->Get(here, n, headerbuf);
+		if (!header) {
 			Error("Couldn't read header of ", filename);
 			return false;
 		}
 
-		if (strncmp((const char *)here, QSPLAT_MAGIC, 6) != 0) {
+		if (strncmp((const char *)header, QSPLAT_MAGIC, 6) != 0) {
 			Error(filename, " is not a QSplat file");
 			return false;
 		}
-		char buf[3];
-		sprintf(buf, "%02d", QSPLAT_FILE_VERSION);
-		if (here[6] != buf[0] || here[7] != buf[1]) {
+		int version = fragment_version(header);
+		if (version != QSPLAT_FILE_VERSION &&
+		    version != QSPLAT_FILE_VERSION_WIDE &&
+		    version != QSPLAT_FILE_VERSION_SIMD &&
+		    version != QSPLAT_FILE_VERSION_COMPRESSED) {
 			Error(filename, " was made for a different version of QSplat");
 			return false;
 		}
 
-		int fraglen = * (int *)(here+8);
-		FIX_LONG(fraglen);
-		if (here+fraglen > map_start+len) {
+		// Version 12 to 14 headers have 64-bit lengths and numbers
+		// of points, so everything after them is 8 bytes further on
+		bool wide = (version != QSPLAT_FILE_VERSION);
+		long long fraglen, points;
+		if (wide) {
+			fraglen = get_longlong(header+8);
+			points = get_longlong(header+16);
+		} else {
+			fraglen = get_int(header+8);
+			points = get_int(header+12);
+		}
+		int optspos = wide ? 24 : 16;
+		const unsigned char *opts = header + optspos;
+		if (fraglen < optspos+4 || fraglen > len-here) {
 			Error(filename, " is truncated");
 			return false;
 		}
 
-		if ((*(unsigned char *)(here+19)) & 2) {
-			comments.append((const char *)(here+20), fraglen-20);
+		if (opts[3] & QSPLAT_OPT_COMMENTS) {
+			const unsigned char *c = source->Get(here + optspos+4,
+						fraglen - (optspos+4), headerbuf);
+			if (c)
+				comments.append((const char *)c,
+						fraglen - (optspos+4));
+			here += fraglen;
+			continue;
+		}
+
+		// An index that didn't get used, because more fragments
+		// were tacked on after it
+		if (opts[3] & QSPLAT_OPT_INDEX) {
 			here += fraglen;
 			continue;
 		}
 
-		int points = * (int *)(here+12);
-		FIX_LONG(points);
+		if (fraglen < optspos+24) {
+			Error(filename, " is truncated");
+			return false;
+		}
 		leaf_points += points;
 
-		float x = * (float *)(here+20); FIX_FLOAT(x);
-		float y = * (float *)(here+24); FIX_FLOAT(y);
-		float z = * (float *)(here+28); FIX_FLOAT(z);
-		float r = * (float *)(here+32); FIX_FLOAT(r);
-		xmin = min(xmin, x-r);  xmax = max(xmax, x+r);
-		ymin = min(ymin, y-r);  ymax = max(ymax, y+r);
-		zmin = min(zmin, z-r);  zmax = max(zmax, z+r);
+		float x = get_float(opts+4);
+		float y = get_float(opts+8);
+		float z = get_float(opts+12);
+		float r = get_float(opts+16);
+		bmin[0] = min(bmin[0], x-r);  bmax[0] = max(bmax[0], x+r);
+		bmin[1] = min(bmin[1], y-r);  bmax[1] = max(bmax[1], y+r);
+		bmin[2] = min(bmin[2], z-r);  bmax[2] = max(bmax[2], z+r);
 
-		fragments.push_back(here);
+		AddFragment(here, x, y, z, r);
 		here += fraglen;
 
 	}
 
-	center[0] = 0.5f * (xmin + xmax);
-	center[1] = 0.5f * (ymin + ymax);
-	center[2] = 0.5f * (zmin + zmax);
-	radius = 0.5f*sqrtf(sqr(xmax-xmin) + sqr(ymax-ymin) + sqr(zmax-zmin));
+	center[0] = 0.5f * (bmin[0] + bmax[0]);
+	center[1] = 0.5f * (bmin[1] + bmax[1]);
+	center[2] = 0.5f * (bmin[2] + bmax[2]);
+	radius = 0.5f*sqrtf(sqr(bmax[0]-bmin[0]) + sqr(bmax[1]-bmin[1]) +
+			    sqr(bmax[2]-bmin[2]));
+
+	fragtree.clear();
+	if (!fragments.empty())
+		BuildFragmentTree(0, fragments.size());
 
 	char buf[255];
-	sprintf(buf, "%d leaf points\n", leaf_points);
+	sprintf(buf, "%.0f leaf points\n", (double) leaf_points);
 	comments += buf;
 #ifndef WIN32
 	fprintf(stderr, buf);
@@ -15,39 +15,129 @@ Leland Stanford Junior University.  All Rights Reserved.
 # define WIN32_LEAN_AND_MEAN
 # include <windows.h>
 # include <commctrl.h>
-# define off_t int
+# define off_t __int64
 #else
 # define HANDLE int
 # define HFILE int
 #endif
 #include "qsplat_util.h"
+#include "qsplat_bytesource.h"
+#include "qsplat_blockcache.h"
+#include "qsplat_pagein.h"
 #include <vector>
 #include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// A view to read ahead for: the sides of its frustum and the plane of the
+// screen (as in draw()), and how small a node can get before it's drawn
+struct QSplat_View {
+	float frustum[4][4];
+	float zproj[4];
+	float pixels_per_radian;
+	float minsize;
+};
+
+// A group of sibling nodes the predictor will read, with its parent's sphere
+struct QSplat_PredictGroup {
+	int frag;
+	const unsigned char *p;
+	int numnodes;
+	bool leaves;	// No children, and so no offset in front of the nodes
+	float cx, cy, cz, r;
+};
 
 
 class QSplat_Model {
 private:
 	unsigned char *mem_start;
-	unsigned char *map_start;
+	unsigned char *map_start;	// NULL if we're using pread()
 	HANDLE fd;
 	off_t len;
+	QSplat_ByteSource *source;
 
 	static off_t FileLen(HFILE f);
 	static bool MapFile(HANDLE f, off_t len,
 			    unsigned char **, unsigned char **);
 
-	std::vector<const unsigned char *> fragments;
+	// Which pages of the map are in memory, so that drawing never has
+	// to wait for the rest
+	QSplat_PageIn *pagein;
+	bool Prefetch(size_t budget, bool lock);
+
+	// Each fragment's bounding sphere is known when the file is opened.
+	// The rest of its header is only read the first time it's drawn, so
+	// fragments that never get looked at never get paged in.
+	struct Fragment {
+		long long start;	// Where it is in the file
+		const unsigned char *drawstart;
+		float cx, cy, cz, r;
+		int numchildren;	// -1 until the header has been read,
+					// 0 if there's nothing to draw
+		bool havecolor;
+		bool wide;		// Version 12, with 64-bit offsets
+		bool little;		// Nodes are little-endian
+		bool simd;		// Version 13, with 8-wide groups
+		int firstblock;		// If the tree is read through blockcache
+		int blockbits;		// (version 14, or not mapped), the
+		long long treelen;	// number of its first block (else -1),
+					// the log2 of their size, and the
+					// length of the tree
+	};
+	std::vector<Fragment> fragments;
+	void AddFragment(long long offset, float x, float y, float z, float r);
+	void ReadHeader(Fragment &f);
+	bool AddBlocks(Fragment &f, long long fraglen, int headerlen);
+	void AddTreeBlocks(Fragment &f, long long fraglen, int headerlen);
+	QSplat_BlockCache blockcache;
+	bool ReadIndex(float *bmin, float *bmax);
 	bool BuildFragmentList(const char *filename);
 
+	// A hierarchy of bounding spheres over the fragments, so that whole
+	// groups of them can be culled at once.  Each node covers a run of
+	// (reordered) fragments; the children of an interior node are the
+	// node right after it and node "right".
+	struct FragmentNode {
+		float cx, cy, cz, r;
+		int first, count;
+		int right;		// 0 for a leaf
+	};
+	std::vector<FragmentNode> fragtree;
+	friend struct FragmentCompare;
+	int BuildFragmentTree(int first, int count);
+	void DrawFragments(int node, bool backfacecull, bool frustumcull);
+	void TraceFragments(int node, const float *pt, const float *dir,
+			    float cutoff, float &best);
+
+	// Reading ahead for a view the camera is expected to get to.  The
+	// fragments in it are found here; then a thread of its own goes down
+	// their trees a level at a time, reading the groups the view will
+	// draw from.  A new view replaces the one it's working on.
+	std::thread predictor;
+	std::mutex predictlock;
+	std::condition_variable predictwakeup;
+	std::vector<QSplat_PredictGroup> predictroots;
+	QSplat_View predictview;
+	std::atomic<bool> predictpending;
+	bool predictquit;
+	void PredictFragments(int node, const QSplat_View &v, bool frustumcull,
+			      std::vector<QSplat_PredictGroup> &roots);
+	void PredictLoop();
+
 	static void Init();
 	QSplat_Model(const std::string &filename_,
 		     unsigned char *mem_start_,
 		     unsigned char *map_start_,
 		     HANDLE fd_,
-		     off_t len_) :
+		     off_t len_,
+		     QSplat_ByteSource *source_) :
 		filename(filename_), leaf_points(0),
 		mem_start(mem_start_), map_start(map_start_),
-		fd(fd_), len(len_)
+		fd(fd_), len(len_), source(source_), pagein(NULL),
+		predictpending(false), predictquit(false)
 	{
 		Init();
 		reset_rate();
@@ -67,6 +157,15 @@ public:
 	void stop_refine();
 
 	bool draw();
+
+	// Start reading what drawing with these projection and modelview
+	// matrices and viewport will need, in the background
+	void predict(const float *P, const float *M, const float *V);
+
+	// Did the last draw() skip parts of the model that have since been
+	// read in?  And is anything still being read?
+	bool pages_arrived();
+	bool paging();
 	float traceray(int x, int y, float cutoff);
 
 	// Center and radius of all the fragments together
@@ -74,7 +173,7 @@ public:
 	float radius;
 
 	// Total number of points at the leaf nodes
-	int leaf_points;
+	long long leaf_points;
 
 	// Minimum splat size
 	float minsize;
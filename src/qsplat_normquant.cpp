@@ -98,8 +98,23 @@ void QSplat_NormQuant::Init()
 }
 
 
+#ifdef DITHER_NORMALS
+// Counter-based random numbers: the n-th number for a key is just a hash of
+// the two, in [-0.5 .. 0.5)
+static inline float dither(unsigned key, unsigned n)
+{
+	unsigned x = key + n * 0x9e3779b9u;
+	x ^= x >> 16;  x *= 0x7feb352du;
+	x ^= x >> 15;  x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return (float)(x >> 8) * (1.0f / 16777216.0f) - 0.5f;
+}
+#endif
+
+
 // Quantize a normal
-void QSplat_NormQuant::quantize(const float *norm, unsigned char *q)
+void QSplat_NormQuant::quantize(const float *norm, unsigned char *q,
+				unsigned key)
 {
 	static const float twoNths = 2.0f / (float)N;
 
@@ -108,9 +123,9 @@ void QSplat_NormQuant::quantize(const float *norm, unsigned char *q)
 	float z = norm[2];
 
 #ifdef DITHER_NORMALS
-	x += ((float)rand() / float(RAND_MAX) - 0.5f) * twoNths;
-	y += ((float)rand() / float(RAND_MAX) - 0.5f) * twoNths;
-	z += ((float)rand() / float(RAND_MAX) - 0.5f) * twoNths;
+	x += dither(key, 0) * twoNths;
+	y += dither(key, 1) * twoNths;
+	z += dither(key, 2) * twoNths;
 
 	float l = 1.0f / sqrtf(sqr(x) + sqr(y) + sqr(z));
 	x *= l;
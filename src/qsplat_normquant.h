@@ -48,13 +48,24 @@ private:
 public:
 	static void Init();
 
-	static void quantize(const float *norm, unsigned char *q);
+	// The noise used for dithering is a function of key, so a given node
+	// always comes out the same way, whatever order nodes are done in.
+	static void quantize(const float *norm, unsigned char *q, unsigned key);
 
 	static inline const float *lookup(const unsigned char *q)
 	{
-		unsigned short index = * (const unsigned short *) q;
-		FIX_SHORT(index);
-		return normquant_table + 3 * (index >> 2);
+		return lookup((unsigned(q[0]) << 8) | unsigned(q[1]));
+	}
+
+	// The same, given the 16 bits as a number
+	static inline const float *lookup(unsigned index)
+	{
+		return normquant_table + 3 * ((index & 0xffffu) >> 2);
+	}
+	// The table itself: 3 floats for each value of N
+	static inline const float *table()
+	{
+		return normquant_table;
 	}
 
 	static void quantize_cone(const float normcone, unsigned char *q)
@@ -66,7 +77,12 @@ public:
 
 	static inline float lookup_cone(const unsigned char *q)
 	{
-		return -0.0625f * (1 + (q[1] & 3)) * (1 + (q[1] & 3));
+		return lookup_cone(unsigned(q[1]));
+	}
+
+	static inline float lookup_cone(unsigned index)
+	{
+		return -0.0625f * (1 + (index & 3)) * (1 + (index & 3));
 	}
 };
 
@@ -0,0 +1,311 @@
+/*
+qsplat_pagein.cpp
+Reads in the pages of a mapped file in the background.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include "qsplat_pagein.h"
+#include <algorithm>
+#include <functional>
+
+#ifdef WIN32
+# define WIN32_LEAN_AND_MEAN
+# include <windows.h>
+#else
+# include <unistd.h>
+# include <sys/mman.h>
+#endif
+
+// How many frames Trim() waits after finding nothing it could give back
+#define TRIM_BACKOFF 30
+
+
+QSplat_PageIn::QSplat_PageIn(const unsigned char *start_, size_t len_) :
+	start(start_), len(len_), numresident(0),
+	inflight(0), quitting(false), arrived(false),
+	budget(0), frame(1), lastuse(NULL), numpinned(0), trimwait(0),
+	trimresident(0)
+{
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	size_t pagesize = si.dwPageSize;
+#else
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+#endif
+	pageshift = 0;
+	while ((size_t(1) << (pageshift+1)) <= pagesize)
+		pageshift++;
+	numpages = (len + (size_t(1) << pageshift) - 1) >> pageshift;
+
+	state = new std::atomic<unsigned char>[numpages];
+	pinned.resize(numpages);
+
+	// Find out what's already there.  Without mincore() we have to assume
+	// that nothing is, and pages that are really in memory will be "read"
+	// quickly enough.
+#ifdef WIN32
+	for (size_t i = 0; i < numpages; i++)
+		state[i] = NOT_RESIDENT;
+#else
+	std::vector<unsigned char> incore(numpages);
+	bool ok = (mincore((void *) start, len, &incore[0]) == 0);
+	for (size_t i = 0; i < numpages; i++)
+		state[i] = (ok && (incore[i] & 1)) ? RESIDENT : NOT_RESIDENT;
+#endif
+	for (size_t i = 0; i < numpages; i++)
+		if (state[i] == RESIDENT)
+			numresident++;
+
+	reader = std::thread(&QSplat_PageIn::ReaderLoop, this);
+}
+
+
+QSplat_PageIn::~QSplat_PageIn()
+{
+	{
+		std::lock_guard<std::mutex> l(lock);
+		quitting = true;
+	}
+	wakeup.notify_one();
+	reader.join();
+	delete [] state;
+	delete [] lastuse;
+}
+
+
+// Queue up the pages in [first..last] that aren't resident or queued already
+void QSplat_PageIn::Request(size_t first, size_t last)
+{
+	bool any = false;
+	std::lock_guard<std::mutex> l(lock);
+	for (size_t i = first; i <= last; i++) {
+		if (state[i].load(std::memory_order_relaxed) != NOT_RESIDENT)
+			continue;
+		state[i].store(QUEUED, std::memory_order_relaxed);
+		queue.push_back(i);
+		any = true;
+		// So that Trim() doesn't give it back before it's been used
+		if (budget)
+			lastuse[i].store(frame, std::memory_order_relaxed);
+	}
+	if (any)
+		wakeup.notify_one();
+}
+
+
+// A page has been read.  It might have been prefetched while it was queued,
+// so only count it once.
+void QSplat_PageIn::MarkResident(size_t page)
+{
+	if (state[page].exchange(RESIDENT) != RESIDENT)
+		numresident++;
+}
+
+
+// Read a byte from each of some pages, which doesn't return until the page
+// is in, and count it as resident.  The read is volatile so that it can't
+// be optimized away.  Whoever's drawing hears about each page as it comes.
+void QSplat_PageIn::TouchPages(const size_t *pages, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		(void) *(const volatile unsigned char *)
+			(start + (pages[i] << pageshift));
+		MarkResident(pages[i]);
+		arrived = true;
+	}
+}
+
+
+void QSplat_PageIn::AddPages(const unsigned char *p, size_t n,
+			     std::vector<size_t> &pages)
+{
+	size_t first = size_t(p - start) >> pageshift;
+	size_t last = size_t(p + n - 1 - start) >> pageshift;
+	if (last >= numpages)
+		return;
+	for (size_t i = first; i <= last; i++)
+		pages.push_back(i);
+}
+
+
+// Read in some pages now.  Runs of consecutive pages are handed to the OS
+// (and locked) together.
+bool QSplat_PageIn::ReadPages(const std::vector<size_t> &pages, bool lock)
+{
+	bool ok = true;
+	size_t n = pages.size();
+	for (size_t i = 0; i < n; ) {
+		size_t j = i + 1;
+		while (j < n && pages[j] <= pages[j-1] + 1)
+			j++;
+		void *p = (void *) (start + (pages[i] << pageshift));
+		size_t runlen = (pages[j-1] - pages[i] + 1) << pageshift;
+#ifdef WIN32
+		if (lock && !VirtualLock(p, runlen))
+			ok = false;
+#else
+		madvise(p, runlen, MADV_WILLNEED);
+		if (lock && mlock(p, runlen) != 0)
+			ok = false;
+#endif
+		i = j;
+	}
+
+	TouchPages(pages.data(), n);
+	return ok;
+}
+
+
+bool QSplat_PageIn::Prefetch(const std::vector<size_t> &pages, bool lock)
+{
+	bool ok = ReadPages(pages, lock);
+	for (size_t i = 0; i < pages.size(); i++) {
+		if (!pinned[pages[i]]) {
+			pinned[pages[i]] = true;
+			numpinned++;
+		}
+	}
+	return ok;
+}
+
+
+// Only the pages that aren't already in have to be read
+void QSplat_PageIn::Fetch(const std::vector<size_t> &pages)
+{
+	std::vector<size_t> missing;
+	unsigned now = frame;
+	for (size_t i = 0; i < pages.size(); i++) {
+		if (state[pages[i]].load(std::memory_order_relaxed) != RESIDENT)
+			missing.push_back(pages[i]);
+		if (budget)
+			lastuse[pages[i]].store(now, std::memory_order_relaxed);
+	}
+	if (missing.empty())
+		return;
+	ReadPages(missing, false);
+}
+
+
+void QSplat_PageIn::SetBudget(size_t budget_)
+{
+	budget = budget_;
+	if (budget && !lastuse) {
+		lastuse = new std::atomic<unsigned>[numpages];
+		for (size_t i = 0; i < numpages; i++)
+			lastuse[i] = 0;
+	}
+}
+
+
+// Give back the pages that were used longest ago until we're comfortably
+// under the budget, so that this doesn't have to happen every frame.  Pages
+// used in the frame just drawn, and pinned pages, stay.  We think of pages
+// as gone as soon as we've given them back, even though the OS may still
+// have them cached; if they're needed again they're read in the usual way.
+//
+// Finding the oldest pages means looking at all of them, so we don't if
+// there can't be any to give back: if everything that's in is pinned, or
+// if the last look found nothing and hardly any time has gone by or
+// nothing new has come in since.
+void QSplat_PageIn::Trim()
+{
+	size_t pagesize = PageSize();
+	size_t resident = numresident;
+	if (!budget || resident * pagesize <= budget || resident <= numpinned)
+		return;
+	if (trimwait > 0) {
+		trimwait--;
+		if (resident <= trimresident)
+			return;
+	}
+	size_t keep = (budget - budget / 8) >> pageshift;
+	size_t excess = resident - keep;
+
+	// The unpinned pages not used in the last frame, oldest first
+	std::vector< std::pair<unsigned, size_t> > cold;
+	for (size_t i = 0; i < numpages; i++) {
+		unsigned used = lastuse[i].load(std::memory_order_relaxed);
+		if (pinned[i] || used == frame ||
+		    state[i].load(std::memory_order_relaxed) != RESIDENT)
+			continue;
+		cold.push_back(std::make_pair(frame - used, i));
+	}
+	if (cold.size() > excess) {
+		std::nth_element(cold.begin(), cold.begin() + excess, cold.end(),
+				 std::greater< std::pair<unsigned, size_t> >());
+		cold.resize(excess);
+	}
+
+	std::vector<size_t> pages;
+	for (size_t i = 0; i < cold.size(); i++) {
+		unsigned char was = RESIDENT;
+		if (state[cold[i].second].compare_exchange_strong(was,
+							NOT_RESIDENT)) {
+			numresident--;
+			pages.push_back(cold[i].second);
+		}
+	}
+	std::sort(pages.begin(), pages.end());
+	if (pages.empty()) {
+		trimwait = TRIM_BACKOFF;
+		trimresident = resident;
+		return;
+	}
+	trimwait = 0;
+
+	// Runs of consecutive pages go back together
+	size_t n = pages.size();
+	for (size_t i = 0; i < n; ) {
+		size_t j = i + 1;
+		while (j < n && pages[j] == pages[j-1] + 1)
+			j++;
+		void *p = (void *) (start + (pages[i] << pageshift));
+		size_t runlen = (pages[j-1] - pages[i] + 1) << pageshift;
+#ifdef WIN32
+		// Takes unlocked pages out of the working set
+		VirtualUnlock(p, runlen);
+#else
+		madvise(p, runlen, MADV_DONTNEED);
+#endif
+		i = j;
+	}
+}
+
+
+bool QSplat_PageIn::Busy()
+{
+	std::lock_guard<std::mutex> l(lock);
+	return !queue.empty() || inflight;
+}
+
+
+// The reading thread.  It takes everything that's been queued up, tells the
+// OS about all of it (so the reads can overlap), and then touches each page,
+// which doesn't return until the page is in.
+void QSplat_PageIn::ReaderLoop()
+{
+	std::vector<size_t> batch;
+	while (1) {
+		{
+			std::unique_lock<std::mutex> l(lock);
+			inflight = 0;
+			while (queue.empty() && !quitting)
+				wakeup.wait(l);
+			if (quitting)
+				return;
+			batch.swap(queue);
+			inflight = batch.size();
+		}
+
+#ifndef WIN32
+		for (size_t i = 0; i < batch.size(); i++)
+			madvise((void *) (start + (batch[i] << pageshift)),
+				size_t(1) << pageshift, MADV_WILLNEED);
+#endif
+		TouchPages(&batch[0], batch.size());
+		batch.clear();
+	}
+}
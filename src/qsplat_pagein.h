@@ -0,0 +1,133 @@
+#ifndef QSPLAT_PAGEIN_H
+#define QSPLAT_PAGEIN_H
+/*
+qsplat_pagein.h
+Keeps track of which pages of a mapped file are in memory, and reads in the
+ones that aren't on a thread of its own.  The traversal asks whether the
+pages of a group are resident before it reads the group: if they aren't,
+they get queued up, and the traversal draws the parent instead of waiting
+for the disk.  Once they've been read, Arrived() says so, and the next
+frame can go deeper.
+
+We only know what we've been told: pages start out as whatever mincore()
+says, and after that we assume that anything we've read stays in memory.
+
+Prefetch() reads a set of pages right away, telling the OS about all of
+them first so that the reads can overlap.  The model uses it to read the
+top levels of the tree when it's opened.  Fetch() does the same for the
+model's predictor, which reads ahead for where the camera is going on a
+thread of its own.
+
+It can also keep the model to a memory budget.  Each page remembers the
+last frame that drew from it, and once more than the budget is resident,
+Trim() gives back the pages that have gone unused longest.  The coarse
+levels read by Prefetch() are never given back, so everything that goes
+comes from deeper down, and the overview is always there to come back to.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stddef.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+
+class QSplat_PageIn {
+public:
+	enum { NOT_RESIDENT, QUEUED, RESIDENT };
+
+private:
+	const unsigned char *start;
+	size_t len;
+	int pageshift;
+	size_t numpages;
+	std::atomic<unsigned char> *state;
+	std::atomic<size_t> numresident;
+
+	std::mutex lock;
+	std::condition_variable wakeup;
+	std::vector<size_t> queue;
+	int inflight;
+	bool quitting;
+	std::atomic<bool> arrived;
+	std::thread reader;
+
+	// For keeping to the budget.  The predictor's thread stamps the
+	// pages it reads, but everything else is only used by the thread
+	// that draws.
+	size_t budget;			// 0 if there isn't one
+	std::atomic<unsigned> frame;
+	std::atomic<unsigned> *lastuse;	// The frame each page was last used
+	std::vector<bool> pinned;	// Read by Prefetch()
+	size_t numpinned;		// Pinned pages are always resident
+	int trimwait;			// Frames until Trim() looks again,
+	size_t trimresident;		// unless more than this many are in
+
+	bool ReadPages(const std::vector<size_t> &pages, bool lock);
+
+	void Request(size_t first, size_t last);
+	void ReaderLoop();
+	void MarkResident(size_t page);
+	void TouchPages(const size_t *pages, size_t n);
+
+public:
+	QSplat_PageIn(const unsigned char *start_, size_t len_);
+	~QSplat_PageIn();
+
+	// Are all of the len bytes at p in memory?  If not, the missing pages
+	// are queued up to be read.
+	inline bool Resident(const unsigned char *p, size_t n)
+	{
+		size_t first = size_t(p - start) >> pageshift;
+		size_t last = size_t(p + n - 1 - start) >> pageshift;
+		if (last >= numpages)
+			return true;
+		for (size_t i = first; i <= last; i++) {
+			if (state[i].load(std::memory_order_relaxed) != RESIDENT) {
+				Request(first, last);
+				return false;
+			}
+			if (budget)
+				lastuse[i].store(frame, std::memory_order_relaxed);
+		}
+		return true;
+	}
+
+	// Have any pages been read in since the last time we asked?
+	bool Arrived() { return arrived.exchange(false); }
+
+	// Are there pages still waiting to be read?
+	bool Busy();
+
+	// Does the traversal need to ask?  Not if the whole file is in memory
+	// and we aren't keeping track of what it uses.
+	bool Watching() { return budget || numresident != numpages; }
+
+	// The pages that hold the n bytes at p are added to pages, which can
+	// then be sorted and passed to Prefetch()
+	size_t PageSize() { return size_t(1) << pageshift; }
+	void AddPages(const unsigned char *p, size_t n,
+		      std::vector<size_t> &pages);
+
+	// Read in a sorted list of pages (which may have repeats), and lock
+	// them in memory if asked to.  Returns false if they couldn't be
+	// locked.
+	bool Prefetch(const std::vector<size_t> &pages, bool lock);
+
+	// The same, from another thread, for pages that will probably be
+	// needed soon.  They aren't locked or pinned, but they count as used
+	// now, so Trim() leaves them alone for a while.
+	void Fetch(const std::vector<size_t> &pages);
+
+	// Keep to about this many bytes (0 for no limit).  NewFrame() is
+	// called before each frame is drawn, and Trim() after it.
+	void SetBudget(size_t budget_);
+	void NewFrame() { frame++; }
+	void Trim();
+};
+
+#endif
@@ -40,8 +40,15 @@ public:
 				  float pcx, float pcy, float pcz, float pr,
 				  float &mycx, float &mycy, float &mycz, float &myr)
 	{
-		unsigned short index = * (const unsigned short *)q;
-		FIX_SHORT(index);
+		lookup((unsigned(q[0]) << 8) | unsigned(q[1]),
+		       pcx, pcy, pcz, pr, mycx, mycy, mycz, myr);
+	}
+
+	// The same, given the 16 bits as a number
+	static inline void lookup(unsigned index,
+				  float pcx, float pcy, float pcz, float pr,
+				  float &mycx, float &mycy, float &mycz, float &myr)
+	{
 		float *r = (float *) (
 				(const unsigned char *)spherequant_table +
 				((unsigned(index) << 1) & 0x1fff0u));
@@ -50,6 +57,12 @@ public:
 		mycz = pcz + pr * (*r++);
 		myr  =       pr * (*r);
 	}
+
+	// The table itself: 4 floats (X, Y, Z, R) for each value of R
+	static inline const float *table()
+	{
+		return spherequant_table;
+	}
 };
 
 #endif
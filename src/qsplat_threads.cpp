@@ -0,0 +1,216 @@
+/*
+qsplat_threads.cpp
+A small work-stealing task pool.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdlib.h>
+#include "qsplat_threads.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+
+// A task, and the per-thread deque of tasks
+struct Task {
+	QSplat_TaskPool::TaskFunc f;
+	void *arg;
+	QSplat_TaskPool::TaskGroup *g;
+};
+
+struct TaskQueue {
+	std::mutex lock;
+	std::deque<Task> tasks;
+};
+
+// A piece of a ParallelFor
+struct RangeTask {
+	QSplat_TaskPool::RangeFunc f;
+	void *arg;
+	int begin, end;
+};
+
+
+// Local variables
+static std::vector<TaskQueue *> queues;
+static std::vector<std::thread> workers;
+static thread_local int my_queue = 0;
+static std::atomic<int> queued(0);
+static std::mutex sleep_lock;
+static std::condition_variable wakeup;
+static bool quitting = false;
+
+
+// Grab a task - first from the back of our own queue, else from the front of
+// somebody else's.  Returns false if there was nothing to do.
+static bool GetTask(int me, Task &t)
+{
+	int n = queues.size();
+	for (int i = 0; i < n; i++) {
+		TaskQueue *q = queues[(me + i) % n];
+		std::lock_guard<std::mutex> l(q->lock);
+		if (q->tasks.empty())
+			continue;
+		if (i == 0) {
+			t = q->tasks.back();
+			q->tasks.pop_back();
+		} else {
+			t = q->tasks.front();
+			q->tasks.pop_front();
+		}
+		queued--;
+		return true;
+	}
+	return false;
+}
+
+
+// Run one task, if there is one
+bool QSplat_TaskPool::RunOne()
+{
+	Task t;
+	if (!GetTask(my_queue, t))
+		return false;
+	t.f(t.arg);
+	t.g->pending--;
+	return true;
+}
+
+
+// The main loop of each worker thread
+void QSplat_TaskPool::WorkerLoop(int me)
+{
+	my_queue = me;
+	while (1) {
+		if (RunOne())
+			continue;
+		std::unique_lock<std::mutex> l(sleep_lock);
+		if (quitting)
+			return;
+		if (!queued)
+			wakeup.wait(l);
+	}
+}
+
+
+// Tell the workers to go away at exit time
+static void Shutdown()
+{
+	{
+		std::lock_guard<std::mutex> l(sleep_lock);
+		quitting = true;
+	}
+	wakeup.notify_all();
+	for (int i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+
+// Start up the worker threads
+void QSplat_TaskPool::Init(int nthreads /* = 0 */)
+{
+	if (!queues.empty())
+		return;
+
+	if (nthreads <= 0)
+		nthreads = std::thread::hardware_concurrency();
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	for (int i = 0; i < nthreads; i++)
+		queues.push_back(new TaskQueue);
+	for (int i = 1; i < nthreads; i++)
+		workers.push_back(std::thread(WorkerLoop, i));
+	atexit(Shutdown);
+}
+
+
+// How many threads (including the calling one) are working?
+int QSplat_TaskPool::NumThreads()
+{
+	return queues.empty() ? 1 : queues.size();
+}
+
+
+// Which thread are we?
+int QSplat_TaskPool::ThreadNum()
+{
+	return my_queue;
+}
+
+
+// Queue up a task
+void QSplat_TaskPool::Spawn(TaskGroup &g, TaskFunc f, void *arg)
+{
+	if (queues.empty())
+		Init();
+
+	Task t = { f, arg, &g };
+	g.pending++;
+	{
+		TaskQueue *q = queues[my_queue];
+		std::lock_guard<std::mutex> l(q->lock);
+		q->tasks.push_back(t);
+	}
+	queued++;
+	{
+		std::lock_guard<std::mutex> l(sleep_lock);
+	}
+	wakeup.notify_one();
+}
+
+
+// Wait for a group of tasks to finish, running tasks while we wait
+void QSplat_TaskPool::Wait(TaskGroup &g)
+{
+	while (g.pending) {
+		if (!RunOne())
+			std::this_thread::yield();
+	}
+}
+
+
+// Run a RangeTask on behalf of ParallelFor
+static void RunRange(void *arg)
+{
+	RangeTask *t = (RangeTask *) arg;
+	t->f(t->arg, t->begin, t->end);
+}
+
+
+// Split a loop into pieces, and run them in parallel
+void QSplat_TaskPool::ParallelFor(int begin, int end, int grain,
+				  RangeFunc f, void *arg)
+{
+	int n = end - begin;
+	if (n <= 0)
+		return;
+	if (grain < 1)
+		grain = 1;
+
+	// A few pieces per thread, to even out the load
+	int npieces = std::min(4 * NumThreads(), (n - 1) / grain + 1);
+	if (npieces <= 1) {
+		f(arg, begin, end);
+		return;
+	}
+
+	std::vector<RangeTask> tasks(npieces);
+	TaskGroup g;
+	for (int i = 0; i < npieces; i++) {
+		tasks[i].f = f;
+		tasks[i].arg = arg;
+		tasks[i].begin = begin + (int) ((long long) n * i / npieces);
+		tasks[i].end = begin + (int) ((long long) n * (i+1) / npieces);
+		if (i)
+			Spawn(g, RunRange, &tasks[i]);
+	}
+	RunRange(&tasks[0]);
+	Wait(g);
+}
+
@@ -0,0 +1,63 @@
+#ifndef QSPLAT_THREADS_H
+#define QSPLAT_THREADS_H
+/*
+qsplat_threads.h
+A small work-stealing task pool.  Each thread has its own deque of tasks:
+it pushes and pops new work at the back, and idle threads steal from the
+front of other threads' deques.  A thread waiting for a group of tasks to
+finish helps out by running tasks itself, so tasks may freely spawn and wait
+for subtasks.
+
+Sample usage:
+	QSplat_TaskPool::TaskGroup g;
+	QSplat_TaskPool::Spawn(g, func, arg1);
+	QSplat_TaskPool::Spawn(g, func, arg2);
+	func(arg3);
+	QSplat_TaskPool::Wait(g);
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <atomic>
+
+
+class QSplat_TaskPool {
+public:
+	typedef void (*TaskFunc)(void *arg);
+	typedef void (*RangeFunc)(void *arg, int begin, int end);
+
+	// A set of tasks that can be waited for
+	class TaskGroup {
+	private:
+		std::atomic<int> pending;
+		friend class QSplat_TaskPool;
+	public:
+		TaskGroup() : pending(0) {}
+	};
+
+	// Start up the worker threads.  If nthreads is 0, we use one thread
+	// per processor.  The calling thread counts as one of the threads.
+	static void Init(int nthreads = 0);
+	static int NumThreads();
+
+	// Which thread are we?  Returns a number in [0..NumThreads())
+	static int ThreadNum();
+
+	// Queue up f(arg) to be run by some thread
+	static void Spawn(TaskGroup &g, TaskFunc f, void *arg);
+
+	// Returns once every task in g has completed
+	static void Wait(TaskGroup &g);
+
+	// Run f(arg, b, e) on pieces [b..e) of [begin..end), in parallel, and
+	// wait for them all.  Pieces are at least grain long.
+	static void ParallelFor(int begin, int end, int grain,
+				RangeFunc f, void *arg);
+
+private:
+	static bool RunOne();
+	static void WorkerLoop(int me);
+};
+
+#endif
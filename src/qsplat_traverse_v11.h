@@ -20,7 +20,13 @@ Leland Stanford Junior University.  All Rights Reserved.
 */
 
 #define QSPLAT_FILE_VERSION 11
+#define QSPLAT_FILE_VERSION_WIDE 12	// Same, with 64-bit sizes and offsets
+#define QSPLAT_FILE_VERSION_COMPRESSED 14	// Same, compressed in blocks
 #define FAST_CUTOFF (2.3f*minsize)
+#define QSPLAT_FRAGMENT_HEADER_MAX 48	// Versions 12 and up
+
+#define QSPLAT_OPT_COLOR 1
+#define QSPLAT_OPT_LITTLE_ENDIAN 8
 
 
 // Local variables
@@ -34,17 +40,143 @@ static bool bail;
 static timestamp renderstarttime;
 static bool havecolor;
 static int nodesize;
+static int offsetshift;		// Child offsets are (4 << offsetshift) bytes
+static QSplat_BlockCache *blockcache;	// For trees that aren't mapped
+static int firstblock, blockbits;
+static long long treelen;
+static const unsigned char emptygroup[QSPLAT_BLOCKCACHE_SLACK] = { 0 };
+static QSplat_PageIn *pagein;		// NULL if we don't keep track
+
+
+// How the nodes of a fragment are stored.  Files are normally big-endian,
+// but a fragment can have its nodes and child offsets in little-endian
+// order instead (QSPLAT_OPT_LITTLE_ENDIAN), so that little-endian machines
+// can read them without swapping bytes.  The routines below are compiled
+// for both.
+struct BigEndianNodes {
+	// A 16-bit word of a node
+	static inline unsigned word(const unsigned char *p)
+		{ return (unsigned(p[0]) << 8) | unsigned(p[1]); }
+	// The low 8 bits of that word, which hold the flags
+	static inline unsigned flags(const unsigned char *p)
+		{ return p[1]; }
+	static inline int offset(const unsigned char *p)
+	{
+		int childoffset = UNALIGNED_DEREFERENCE_INT(p);
+		FIX_LONG(childoffset);
+		return childoffset;
+	}
+	static inline long long wideoffset(const unsigned char *p)
+	{
+		long long childoffset = UNALIGNED_DEREFERENCE_LONGLONG(p);
+		FIX_LONGLONG(childoffset);
+		return childoffset;
+	}
+};
+
+struct LittleEndianNodes {
+	static inline unsigned word(const unsigned char *p)
+		{ return unsigned(p[0]) | (unsigned(p[1]) << 8); }
+	static inline unsigned flags(const unsigned char *p)
+		{ return p[0]; }
+	static inline int offset(const unsigned char *p)
+	{
+		return int(unsigned(p[0]) | (unsigned(p[1]) << 8) |
+			   (unsigned(p[2]) << 16) | (unsigned(p[3]) << 24));
+	}
+	static inline long long wideoffset(const unsigned char *p)
+	{
+		return (long long) (unsigned) offset(p) |
+		       ((long long) offset(p+4) << 32);
+	}
+};
+
+
+// Where the tree of a fragment is.  Usually it's right there in the mapped
+// file, and a position in the tree is just a pointer.  The tree of a
+// compressed (version 14) fragment is in blocks that have to be
+// decompressed first, and when the file isn't mapped every tree is read a
+// block at a time, so then a position is the number of bytes from the
+// start of the tree, and a group has to be looked up in the block cache
+// before it can be read.  The routines below are compiled for both, and each of them
+// keeps its own Group for as long as it's reading it.  Since the blocks
+// aren't checked, a position outside the tree (which only a corrupt file
+// would have) reads as a group of nodes with no children.
+//
+// resident() says whether a group can be read without waiting for the disk.
+// If it can't, the pages it's on are queued up to be read in the
+// background, and the traversal draws the parent instead.  The blocks in
+// the block cache are small, and are read as they're needed.
+static inline bool resident(const unsigned char *p, int len)
+{
+	return !pagein || pagein->Resident(p, len);
+}
+
+struct MappedTree {
+	typedef const unsigned char *Pos;
+	class Group {
+		const unsigned char *p;
+	public:
+		Group(Pos pos) : p(pos) {}
+		operator const unsigned char *() const { return p; }
+	};
+	static inline bool resident(Pos pos, int len)
+		{ return ::resident(pos, len); }
+};
+
+struct CachedTree {
+	typedef long long Pos;
+	class Group {
+		int block;
+		const unsigned char *p;
+	public:
+		Group(Pos pos)
+		{
+			if (pos < 0 || pos >= treelen) {
+				block = -1;
+				p = emptygroup;
+				return;
+			}
+			block = firstblock + int(pos >> blockbits);
+			p = blockcache->Lock(block) +
+			    int(pos & ((1 << blockbits) - 1));
+		}
+		~Group() { if (block >= 0) blockcache->Unlock(block); }
+		operator const unsigned char *() const { return p; }
+	};
+	static inline bool resident(Pos, int) { return true; }
+};
+
+
+// Find the children of the group of nodes at pos, and skip here (the same
+// group, as read) over the offset to them
+template <class Nodes, class Pos>
+static inline Pos find_children(Pos pos, const unsigned char *&here)
+{
+	Pos there;
+	if (offsetshift) {
+		there = pos + Nodes::wideoffset(here);
+		here += 8;
+	} else {
+		there = pos + Nodes::offset(here);
+		here += 4;
+	}
+	return there;
+}
 
 
 // We've gotten to the lowest level of the hierarchy, and we're just going to
 // draw a bunch of leaf nodes without testing their sizes
-static inline void draw_hierarchy_leaves(const unsigned char *here, int numnodes,
+template <class Nodes, class Tree>
+static inline void draw_hierarchy_leaves(typename Tree::Pos pos, int numnodes,
 					 float cx, float cy, float cz, float r,
 					 float approx_splatsize_scale)
 {
+	typename Tree::Group group(pos);
+	const unsigned char *here = group;
 	for (int i=0; i < numnodes; i++, here += nodesize) {
 		float mycx, mycy, mycz, myr;
-		QSplat_SphereQuant::lookup(here,
+		QSplat_SphereQuant::lookup(Nodes::word(here),
 					   cx, cy, cz, r,
 					   mycx, mycy, mycz, myr);
 		float splatsize = approx_splatsize_scale ?
@@ -52,8 +184,8 @@ static inline void draw_hierarchy_leaves(const unsigned char *here, int numnodes
 				  minsize;
 		GUI->drawpoint(mycx, mycy, mycz,
 			       myr, splatsize,
-			       QSplat_NormQuant::lookup(here+2),
-			       havecolor?QSplat_ColorQuant::lookup(here+4):NULL);
+			       QSplat_NormQuant::lookup(Nodes::word(here+2)),
+			       havecolor?QSplat_ColorQuant::lookup(Nodes::word(here+4)):NULL);
 	}
 }
 
@@ -61,29 +193,29 @@ static inline void draw_hierarchy_leaves(const unsigned char *here, int numnodes
 // The fast version of the draw routine.  We switch to this when size gets
 // down to a few pixels.
 // See draw_hierarchy() for comments...
-static inline void draw_hierarchy_fast(const unsigned char *here, int numnodes,
+template <class Nodes, class Tree>
+static inline void draw_hierarchy_fast(typename Tree::Pos pos, int numnodes,
 				       float cx, float cy, float cz, float r)
 {
-	int childoffset = UNALIGNED_DEREFERENCE_INT(here);
-	FIX_LONG(childoffset);
-	const unsigned char *there = here + childoffset;
-	here += 4;
+	typename Tree::Group group(pos);
+	const unsigned char *here = group;
+	typename Tree::Pos there = find_children<Nodes>(pos, here);
 
 	int numchildren = 0;
 	int grandchildren = 0;
 
 	for (int i=0; i < numnodes; i++, here += nodesize, there += nodesize*numchildren + grandchildren) {
 
-		numchildren = here[1] & 3;
+		numchildren = Nodes::flags(here) & 3;
 		if (numchildren) {
 			numchildren++;
-			grandchildren = here[1] & 4;
+			grandchildren = (Nodes::flags(here) & 4) << offsetshift;
 		} else {
 			grandchildren = 0;
 		}
 
 		float mycx, mycy, mycz, myr;
-		QSplat_SphereQuant::lookup(here,
+		QSplat_SphereQuant::lookup(Nodes::word(here),
 					   cx, cy, cz, r,
 					   mycx, mycy, mycz, myr);
 
@@ -92,29 +224,31 @@ static inline void draw_hierarchy_fast(const unsigned char *here, int numnodes,
 		float splatsize_scale = 2.0f * pixels_per_radian / z;
 		float splatsize = myr * splatsize_scale;
 
-		if (!numchildren || (splatsize <= minsize)) {
+		if (!numchildren || (splatsize <= minsize) ||
+		    !Tree::resident(there, nodesize*numchildren + grandchildren)) {
 			GUI->drawpoint(mycx, mycy, mycz,
 				       myr, splatsize,
-				       QSplat_NormQuant::lookup(here+2),
-				       havecolor?QSplat_ColorQuant::lookup(here+4):NULL);
+				       QSplat_NormQuant::lookup(Nodes::word(here+2)),
+				       havecolor?QSplat_ColorQuant::lookup(Nodes::word(here+4)):NULL);
 		} else if (!grandchildren) {
-			draw_hierarchy_leaves(there, numchildren,
-					      mycx, mycy, mycz, myr,
-					      splatsize_scale);
+			draw_hierarchy_leaves<Nodes, Tree>(there, numchildren,
+							   mycx, mycy, mycz, myr,
+							   splatsize_scale);
 		} else if (splatsize <= FAST_CUTOFF) {
-			draw_hierarchy_leaves(there+4, numchildren,
-					      mycx, mycy, mycz, myr,
-					      0.0f);
+			draw_hierarchy_leaves<Nodes, Tree>(
+				there + (4 << offsetshift), numchildren,
+				mycx, mycy, mycz, myr, 0.0f);
 		} else {
-			draw_hierarchy_fast(there, numchildren,
-					    mycx, mycy, mycz, myr);
+			draw_hierarchy_fast<Nodes, Tree>(there, numchildren,
+							 mycx, mycy, mycz, myr);
 		}
 	}
 }
 
 
 // The main drawing routine
-static void draw_hierarchy(const unsigned char *here, int numnodes,
+template <class Nodes, class Tree>
+static void draw_hierarchy(typename Tree::Pos pos, int numnodes,
 			   float cx, float cy, float cz, float r,
 			   bool backfacecull, bool frustumcull)
 {
@@ -132,10 +266,9 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 
 
 	// Where are the children of these nodes stored?
-	int childoffset = UNALIGNED_DEREFERENCE_INT(here);
-	FIX_LONG(childoffset);
-	const unsigned char *there = here + childoffset;
-	here += 4;
+	typename Tree::Group group(pos);
+	const unsigned char *here = group;
+	typename Tree::Pos there = find_children<Nodes>(pos, here);
 
 
 	int numchildren = 0;
@@ -144,7 +277,7 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 	// For each node in this group of siblings
 	for (int i=0; i < numnodes; i++, here += nodesize, there += nodesize*numchildren + grandchildren) {
 		// Find number of children
-		numchildren = here[1] & 3;
+		numchildren = Nodes::flags(here) & 3;
 		if (numchildren) {
 			// Code: 0 really means no children, but since 1 child
 			// never happens, 1 really means 2 children and so on
@@ -155,9 +288,10 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 			// grandchildren, and hence has the extra pointer
 			// Note that because this uses bit 2, we automagically
 			// get the right increment to the child offset just by
-			// extracting this bit.
+			// extracting this bit (and shifting it for 64-bit
+			// offsets).
 
-			grandchildren = here[1] & 4;
+			grandchildren = (Nodes::flags(here) & 4) << offsetshift;
 
 		} else {
 			grandchildren = 0;
@@ -166,7 +300,7 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 
 		// Determine our position and radius
 		float mycx, mycy, mycz, myr;
-		QSplat_SphereQuant::lookup(here,
+		QSplat_SphereQuant::lookup(Nodes::word(here),
 					   cx, cy, cz, r,
 					   mycx, mycy, mycz, myr);
 
@@ -208,8 +342,8 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 					 // culling, this gets left set to a
 					 // safe value for the sake of code
 					 // later on.
-		if (backfacecull && ((here[3] & 3) != 3)) {
-			const float *norm = QSplat_NormQuant::lookup(here+2);
+		if (backfacecull && ((Nodes::flags(here+2) & 3) != 3)) {
+			const float *norm = QSplat_NormQuant::lookup(Nodes::word(here+2));
 			float camx = campos[0] - mycx;
 			float camy = campos[1] - mycy;
 			float camz = campos[2] - mycz;
@@ -218,13 +352,13 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 				     camz * norm[2];
 			if (camdotnorm < -myr) {
 				float camdist2 = sqr(camx) + sqr(camy) + sqr(camz);
-				float cone = QSplat_NormQuant::lookup_cone(here+2);
+				float cone = QSplat_NormQuant::lookup_cone(Nodes::word(here+2));
 				if (sqr(camdotnorm + myr) > camdist2 * sqr(cone)) {
 					continue;
 				}
 			} else if (camdotnorm > myr) {
 				float camdist2 = sqr(camx) + sqr(camy) + sqr(camz);
-				float cone = QSplat_NormQuant::lookup_cone(here+2);
+				float cone = QSplat_NormQuant::lookup_cone(Nodes::word(here+2));
 				if (sqr(camdotnorm - myr) > camdist2 * sqr(cone)) {
 					backfacecull_children = false;
 				}
@@ -235,20 +369,23 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 		float splatsize_scale = 2.0f * pixels_per_radian / z;
 		float splatsize = myr * splatsize_scale;
 
-		// Check whether we recurse...
-		if (!numchildren || ((z > 0.0f) && (splatsize <= minsize))) {
+		// Check whether we recurse...  The children of this node are
+		// nodesize*numchildren + grandchildren bytes long, and if
+		// they're not in memory yet we don't wait for them.
+		if (!numchildren || ((z > 0.0f) && (splatsize <= minsize)) ||
+		    !Tree::resident(there, nodesize*numchildren + grandchildren)) {
 			// No - draw now
 			if ((z > 0.0f) && (camdotnorm >= 0.0f)) {
 				GUI->drawpoint(mycx, mycy, mycz,
 					       myr, splatsize,
-					       QSplat_NormQuant::lookup(here+2),
-					       havecolor?QSplat_ColorQuant::lookup(here+4):NULL);
+					       QSplat_NormQuant::lookup(Nodes::word(here+2)),
+					       havecolor?QSplat_ColorQuant::lookup(Nodes::word(here+4)):NULL);
 			}
 		} else if (!grandchildren) {
 			// We recurse, but children are all leaf nodes
-			draw_hierarchy_leaves(there, numchildren,
-					      mycx, mycy, mycz, myr,
-					      splatsize_scale);
+			draw_hierarchy_leaves<Nodes, Tree>(there, numchildren,
+							   mycx, mycy, mycz, myr,
+							   splatsize_scale);
 		} else if ((!frustumcull_children && !backfacecull_children) ||
 			   ((splatsize <= FAST_CUTOFF) && (z > 0.0f))) {
 			// We recurse, but switch to fast mode
@@ -257,19 +394,21 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 				// of recursion is going to be awfully close to
 				// minsize, so we use the _leaves function
 				// to just draw the children...
-				draw_hierarchy_leaves(there+4, numchildren,
-						      mycx, mycy, mycz, myr,
-						      0.0f);
+				draw_hierarchy_leaves<Nodes, Tree>(
+					there + (4 << offsetshift),
+					numchildren,
+					mycx, mycy, mycz, myr,
+					0.0f);
 			} else {
-				draw_hierarchy_fast(there, numchildren,
-						    mycx, mycy, mycz, myr);
+				draw_hierarchy_fast<Nodes, Tree>(there,
+					numchildren, mycx, mycy, mycz, myr);
 			}
 		} else {
 			// Basic slow-mode recursion
-			draw_hierarchy(there, numchildren,
-				       mycx, mycy, mycz, myr,
-				       backfacecull_children,
-				       frustumcull_children);
+			draw_hierarchy<Nodes, Tree>(there, numchildren,
+						    mycx, mycy, mycz, myr,
+						    backfacecull_children,
+						    frustumcull_children);
 			if (bail)
 				return;
 		}
@@ -278,24 +417,190 @@ static void draw_hierarchy(const unsigned char *here, int numnodes,
 
 
 
+// Version 13 fragments are drawn by routines of their own
+#include "qsplat_traverse_v13.h"
+
+
 // Dig out the required information from the header of an individual fragment.
-// For V11 files, just returns center of the highest-level sphere.
-static inline void parse_header(const unsigned char *here,
-				const unsigned char **drawstart,
-				int *numchildren,
-				float *rootcx, float *rootcy,
-				float *rootcz, float *rootr)
+// For V11 files, the root sphere is kept in the fragment list, so this is
+// just the number of top-level nodes, whether there's color, what order the
+// nodes are in, and where they start (or, for V14, where the list of
+// compressed blocks starts).  V12, V13 and V14 headers are the same, but 8
+// bytes longer.
+static inline const unsigned char *parse_header(const unsigned char *here,
+						int *numchildren, bool *color,
+						bool *wide, bool *little,
+						bool *simd, bool *compressed)
 {
+	int version = (here[6] - '0') * 10 + (here[7] - '0');
+	*wide = (version != QSPLAT_FILE_VERSION);
+	*simd = (version == QSPLAT_FILE_VERSION_SIMD);
+	*compressed = (version == QSPLAT_FILE_VERSION_COMPRESSED);
+	if (*wide)
+		here += 8;
 	unsigned options = * (int *)(here+16);  FIX_LONG(options);
-	havecolor = options & 1;
-	nodesize = (havecolor ? 6 : 4);
-
-	*rootcx = * (float *)(here+20);  FIX_FLOAT(*rootcx);
-	*rootcy = * (float *)(here+24);  FIX_FLOAT(*rootcy);
-	*rootcz = * (float *)(here+28);  FIX_FLOAT(*rootcz);
-	*rootr  = * (float *)(here+32);  FIX_FLOAT(*rootr);
+	*color = options & QSPLAT_OPT_COLOR;
+	*little = options & QSPLAT_OPT_LITTLE_ENDIAN;
 	*numchildren = * (int *)(here+36);  FIX_LONG(*numchildren);
-	*drawstart = here+40;
+	return here+40;
+}
+
+
+// Where is a sphere relative to the view frustum fr, with screen plane zp?
+// Returns 0 if it's entirely outside, 2 if it's entirely inside, and 1
+// otherwise.
+static inline int frustum_test(const float fr[4][4], const float *zp,
+			       float cx, float cy, float cz, float r)
+{
+	float z = zp[0] * cx + zp[1] * cy + zp[2] * cz + zp[3];
+	if (z <= -r)
+		return 0;
+	bool inside = (z > r);
+	for (int i = 0; i < 4; i++) {
+		float d = cx*fr[i][0] + cy*fr[i][1] + cz*fr[i][2] + fr[i][3];
+		if (d <= -r)
+			return 0;
+		if (d < r)
+			inside = false;
+	}
+	return inside ? 2 : 1;
+}
+
+// The same, for the view being drawn
+static inline int frustum_test(float cx, float cy, float cz, float r)
+{
+	return frustum_test(frustum, zproj, cx, cy, cz, r);
+}
+
+
+// Draw the fragments under one node of the fragment hierarchy, skipping
+// groups of fragments that are entirely outside the frustum.  Once a group
+// is entirely inside, nothing under it needs frustum culling.
+void QSplat_Model::DrawFragments(int node, bool backfacecull, bool frustumcull)
+{
+	const FragmentNode &n = fragtree[node];
+	if (frustumcull) {
+		int in = frustum_test(n.cx, n.cy, n.cz, n.r);
+		if (!in)
+			return;
+		if (in == 2)
+			frustumcull = false;
+	}
+
+	if (n.right) {
+		DrawFragments(node+1, backfacecull, frustumcull);
+		if (!bail)
+			DrawFragments(n.right, backfacecull, frustumcull);
+		return;
+	}
+
+	for (int i = n.first; i < n.first + n.count && !bail; i++) {
+		Fragment &f = fragments[i];
+		bool frustumcull_children = frustumcull;
+		if (frustumcull) {
+			int in = frustum_test(f.cx, f.cy, f.cz, f.r);
+			if (!in)
+				continue;
+			if (in == 2)
+				frustumcull_children = false;
+		}
+		// The header and top-level nodes of a fragment that isn't in
+		// memory yet get read in the background, like everything else
+		::pagein = (pagein && pagein->Watching()) ? pagein : NULL;
+		if (f.numchildren < 0) {
+			if (map_start && !resident(map_start + f.start,
+						   QSPLAT_FRAGMENT_HEADER_MAX))
+				continue;
+			ReadHeader(f);
+		}
+		if (f.numchildren <= 0)
+			continue;
+		havecolor = f.havecolor;
+		nodesize = (havecolor ? 6 : 4);
+		offsetshift = f.wide ? 1 : 0;
+		if (f.firstblock < 0 &&
+		    !resident(f.drawstart, f.simd ? group8_size(havecolor) :
+				nodesize*f.numchildren + (4 << offsetshift)))
+			continue;
+		if (f.firstblock >= 0) {
+			::blockcache = &blockcache;
+			firstblock = f.firstblock;
+			blockbits = f.blockbits;
+			treelen = f.treelen;
+		}
+		if (f.simd) {
+			choose_decode_group8();
+			if (f.firstblock >= 0)
+				draw_group8<CachedTree>(0, f.numchildren,
+					f.cx, f.cy, f.cz, f.r,
+					backfacecull, frustumcull_children);
+			else
+				draw_group8<MappedTree>(f.drawstart,
+					f.numchildren, f.cx, f.cy, f.cz, f.r,
+					backfacecull, frustumcull_children);
+		} else if (f.firstblock >= 0) {
+			if (f.little)
+				draw_hierarchy<LittleEndianNodes, CachedTree>(
+					0, f.numchildren, f.cx, f.cy, f.cz, f.r,
+					backfacecull, frustumcull_children);
+			else
+				draw_hierarchy<BigEndianNodes, CachedTree>(
+					0, f.numchildren, f.cx, f.cy, f.cz, f.r,
+					backfacecull, frustumcull_children);
+		} else if (f.little)
+			draw_hierarchy<LittleEndianNodes, MappedTree>(f.drawstart,
+				f.numchildren, f.cx, f.cy, f.cz, f.r,
+				backfacecull, frustumcull_children);
+		else
+			draw_hierarchy<BigEndianNodes, MappedTree>(f.drawstart,
+				f.numchildren, f.cx, f.cy, f.cz, f.r,
+				backfacecull, frustumcull_children);
+	}
+}
+
+
+// The sides of the view frustum for projection P and modelview M, as planes
+// whose equations give the distance to them
+static void find_frustum(const float *P, const float *M, float fr[4][4])
+{
+	float PM[16];
+	MMult(P, M, PM);
+	fr[0][0] = PM[3]  - PM[1];
+	fr[0][1] = PM[7]  - PM[5];
+	fr[0][2] = PM[11] - PM[9];
+	fr[0][3] = PM[15] - PM[13];
+	float tmp = 1.0f / Len(&fr[0][0]);
+	fr[0][0] *= tmp;
+	fr[0][1] *= tmp;
+	fr[0][2] *= tmp;
+	fr[0][3] *= tmp;
+	fr[1][0] = PM[3]  + PM[1];
+	fr[1][1] = PM[7]  + PM[5];
+	fr[1][2] = PM[11] + PM[9];
+	fr[1][3] = PM[15] + PM[13];
+	tmp = 1.0f / Len(&fr[1][0]);
+	fr[1][0] *= tmp;
+	fr[1][1] *= tmp;
+	fr[1][2] *= tmp;
+	fr[1][3] *= tmp;
+	fr[2][0] = PM[3]  - PM[0];
+	fr[2][1] = PM[7]  - PM[4];
+	fr[2][2] = PM[11] - PM[8];
+	fr[2][3] = PM[15] - PM[12];
+	tmp = 1.0f / Len(&fr[2][0]);
+	fr[2][0] *= tmp;
+	fr[2][1] *= tmp;
+	fr[2][2] *= tmp;
+	fr[2][3] *= tmp;
+	fr[3][0] = PM[3]  + PM[0];
+	fr[3][1] = PM[7]  + PM[4];
+	fr[3][2] = PM[11] + PM[8];
+	fr[3][3] = PM[15] + PM[12];
+	tmp = 1.0f / Len(&fr[3][0]);
+	fr[3][0] *= tmp;
+	fr[3][1] *= tmp;
+	fr[3][2] *= tmp;
+	fr[3][3] *= tmp;
 }
 
 
@@ -325,44 +630,7 @@ bool QSplat_Model::draw()
 	zproj[2] = -M[10];
 	zproj[3] = -M[14];
 
-	float PM[16];
-	MMult(P, M, PM);
-	frustum[0][0] = PM[3]  - PM[1];
-	frustum[0][1] = PM[7]  - PM[5];
-	frustum[0][2] = PM[11] - PM[9];
-	frustum[0][3] = PM[15] - PM[13];
-	float tmp = 1.0f / Len(&frustum[0][0]);
-	frustum[0][0] *= tmp;
-	frustum[0][1] *= tmp;
-	frustum[0][2] *= tmp;
-	frustum[0][3] *= tmp;
-	frustum[1][0] = PM[3]  + PM[1];
-	frustum[1][1] = PM[7]  + PM[5];
-	frustum[1][2] = PM[11] + PM[9];
-	frustum[1][3] = PM[15] + PM[13];
-	tmp = 1.0f / Len(&frustum[1][0]);
-	frustum[1][0] *= tmp;
-	frustum[1][1] *= tmp;
-	frustum[1][2] *= tmp;
-	frustum[1][3] *= tmp;
-	frustum[2][0] = PM[3]  - PM[0];
-	frustum[2][1] = PM[7]  - PM[4];
-	frustum[2][2] = PM[11] - PM[8];
-	frustum[2][3] = PM[15] - PM[12];
-	tmp = 1.0f / Len(&frustum[2][0]);
-	frustum[2][0] *= tmp;
-	frustum[2][1] *= tmp;
-	frustum[2][2] *= tmp;
-	frustum[2][3] *= tmp;
-	frustum[3][0] = PM[3]  + PM[0];
-	frustum[3][1] = PM[7]  + PM[4];
-	frustum[3][2] = PM[11] + PM[8];
-	frustum[3][3] = PM[15] + PM[12];
-	tmp = 1.0f / Len(&frustum[3][0]);
-	frustum[3][0] *= tmp;
-	frustum[3][1] *= tmp;
-	frustum[3][2] *= tmp;
-	frustum[3][3] *= tmp;
+	find_frustum(P, M, frustum);
 
 	bool backfacecull = !!glIsEnabled(GL_CULL_FACE);
 	::minsize = minsize;
@@ -371,43 +639,39 @@ bool QSplat_Model::draw()
 	bail = false;
 	get_timestamp(renderstarttime);
 	GUI->start_drawing(havecolor);
+	if (pagein)
+		pagein->NewFrame();
 
 
-	// Draw each fragment
-	for (int f = 0; f < fragments.size(); f++) {
-		float cx, cy, cz, r;
-		int numchildren;
-		const unsigned char *drawstart;
-		parse_header(fragments[f], &drawstart, &numchildren,
-			     &cx, &cy, &cz, &r);
-		draw_hierarchy(drawstart, numchildren,
-			       cx, cy, cz, r,
-			       backfacecull, true);
-		if (bail)
-			break;
-	}
+	// Draw each fragment that might be visible
+	if (!fragtree.empty())
+		DrawFragments(0, backfacecull, true);
 
 	// That's all, folks
 	GUI->end_drawing(bail);
 
+	// Give back what this frame (and the ones before it) didn't need,
+	// if we're over the memory budget
+	if (pagein)
+		pagein->Trim();
+
 	return bail;
 }
 
 
 // Trace a ray through the hierarchy, and find distance to intersection.
-static void traceray_hierarchy(const unsigned char *here, int numnodes,
+template <class Nodes, class Tree>
+static void traceray_hierarchy(typename Tree::Pos pos, int numnodes,
 			       float cx, float cy, float cz, float r,
 			       bool leaves,
 			       const float *pt, const float *dir,
 			       float cutoff, float &best)
 {
-	const unsigned char *there = NULL;
-	if (!leaves) {
-		int childoffset = UNALIGNED_DEREFERENCE_INT(here);
-		FIX_LONG(childoffset);
-		there = here + childoffset;
-		here += 4;
-	}
+	typename Tree::Group group(pos);
+	const unsigned char *here = group;
+	typename Tree::Pos there = typename Tree::Pos();
+	if (!leaves)
+		there = find_children<Nodes>(pos, here);
 
 	int numchildren = 0;
 	int grandchildren = 0;
@@ -416,16 +680,16 @@ static void traceray_hierarchy(const unsigned char *here, int numnodes,
 	     i < numnodes;
 	     i++, here += nodesize, there += nodesize*numchildren + grandchildren) {
 
-		numchildren = here[1] & 3;
+		numchildren = Nodes::flags(here) & 3;
 		if (numchildren) {
 			numchildren++;
-			grandchildren = here[1] & 4;
+			grandchildren = (Nodes::flags(here) & 4) << offsetshift;
 		} else {
 			grandchildren = 0;
 		}
 
 		float mycx, mycy, mycz, myr;
-		QSplat_SphereQuant::lookup(here,
+		QSplat_SphereQuant::lookup(Nodes::word(here),
 					   cx, cy, cz, r,
 					   mycx, mycy, mycz, myr);
 
@@ -451,12 +715,90 @@ static void traceray_hierarchy(const unsigned char *here, int numnodes,
 				best = t;
 		} else {
 			// Recursive case
-			traceray_hierarchy(there, numchildren,
-					   mycx, mycy, mycz, myr,
-					   !grandchildren,
-					   pt, dir,
-					   cutoff, best);
+			traceray_hierarchy<Nodes, Tree>(there, numchildren,
+							mycx, mycy, mycz, myr,
+							!grandchildren,
+							pt, dir,
+							cutoff, best);
+		}
+	}
+}
+
+
+// Does a ray hit a sphere before distance best?  Same test as in
+// traceray_hierarchy().
+static inline bool ray_hits_sphere(float cx, float cy, float cz, float r,
+				   const float *pt, const float *dir, float best)
+{
+	vec x = { cx-pt[0], cy-pt[1], cz-pt[2] };
+	float t = Dot(x, dir);
+	if ((t < -r) || (t-r > best))
+		return false;
+	float idist2 = sqr(x[0] - t * dir[0]) +
+		       sqr(x[1] - t * dir[1]) +
+		       sqr(x[2] - t * dir[2]);
+	return (idist2 <= sqr(r));
+}
+
+
+// Trace a ray through the fragments under one node of the fragment
+// hierarchy
+void QSplat_Model::TraceFragments(int node, const float *pt, const float *dir,
+				  float cutoff, float &best)
+{
+	const FragmentNode &n = fragtree[node];
+	if (!ray_hits_sphere(n.cx, n.cy, n.cz, n.r, pt, dir, best))
+		return;
+
+	if (n.right) {
+		TraceFragments(node+1, pt, dir, cutoff, best);
+		TraceFragments(n.right, pt, dir, cutoff, best);
+		return;
+	}
+
+	for (int i = n.first; i < n.first + n.count; i++) {
+		Fragment &f = fragments[i];
+		if (!ray_hits_sphere(f.cx, f.cy, f.cz, f.r, pt, dir, best))
+			continue;
+		if (f.numchildren < 0)
+			ReadHeader(f);
+		if (f.numchildren <= 0)
+			continue;
+		havecolor = f.havecolor;
+		nodesize = (havecolor ? 6 : 4);
+		offsetshift = f.wide ? 1 : 0;
+		if (f.firstblock >= 0) {
+			::blockcache = &blockcache;
+			firstblock = f.firstblock;
+			blockbits = f.blockbits;
+			treelen = f.treelen;
 		}
+		if (f.simd) {
+			if (f.firstblock >= 0)
+				traceray_group8<CachedTree>(0,
+					f.numchildren, f.cx, f.cy, f.cz, f.r,
+					pt, dir, cutoff, best);
+			else
+				traceray_group8<MappedTree>(f.drawstart,
+					f.numchildren, f.cx, f.cy, f.cz, f.r,
+					pt, dir, cutoff, best);
+		} else if (f.firstblock >= 0) {
+			if (f.little)
+				traceray_hierarchy<LittleEndianNodes, CachedTree>(
+					0, f.numchildren, f.cx, f.cy, f.cz, f.r,
+					false, pt, dir, cutoff, best);
+			else
+				traceray_hierarchy<BigEndianNodes, CachedTree>(
+					0, f.numchildren, f.cx, f.cy, f.cz, f.r,
+					false, pt, dir, cutoff, best);
+		} else if (f.little)
+			traceray_hierarchy<LittleEndianNodes, MappedTree>(
+				f.drawstart, f.numchildren, f.cx, f.cy, f.cz,
+				f.r, false, pt, dir, cutoff, best);
+		else
+			traceray_hierarchy<BigEndianNodes, MappedTree>(
+				f.drawstart, f.numchildren, f.cx, f.cy, f.cz,
+				f.r, false, pt, dir, cutoff, best);
 	}
 }
 
@@ -493,22 +835,406 @@ float QSplat_Model::traceray(int x, int y, float cutoff)
 
 	float t = 3.3e33f;
 
-	for (int f = 0; f < fragments.size(); f++) {
-		float cx, cy, cz, r;
-		int numchildren;
-		const unsigned char *drawstart;
-		parse_header(fragments[f], &drawstart, &numchildren,
-			     &cx, &cy, &cz, &r);
-		traceray_hierarchy(drawstart, numchildren,
-				   cx, cy, cz, r,
-				   false,
-				   campos, raydir,
-				   cc, t);
-	}
+	if (!fragtree.empty())
+		TraceFragments(0, campos, raydir, cc, t);
 	if (t == 3.3e33f)
 		return 0;
 	else
 		return t;
 }
 
+
+// Reading in the top of the tree when the model is opened.  We go down the
+// trees of all the fragments a level at a time: each level is read in all
+// at once, so the OS can overlap the reads, and then its nodes say where
+// the next level is.  The groups of one level are mostly next to each other
+// in the file, so this also reads fewer pages than faulting them in one by
+// one would.
+struct PrefetchGroup {
+	int frag;
+	const unsigned char *p;
+	int numnodes;
+	bool leaves;	// No children, and so no offset in front of the nodes
+};
+
+
+// Go through the numnodes nodes of the group at p (which has children), and
+// call visit(node, children, numchildren, leaves) for each node that has
+// children of its own.  This takes the node size and offset size rather than
+// using the traversal's, so the predictor's thread can use it too.
+template <class Nodes, class Visitor>
+static inline void walk_children(const unsigned char *p, int numnodes,
+				 int nodesize, int offsetshift,
+				 Visitor &visit)
+{
+	const unsigned char *here = p;
+	const unsigned char *there;
+	if (offsetshift) {
+		there = p + Nodes::wideoffset(here);
+		here += 8;
+	} else {
+		there = p + Nodes::offset(here);
+		here += 4;
+	}
+
+	int numchildren = 0;
+	int grandchildren = 0;
+
+	for (int i=0; i < numnodes; i++, here += nodesize, there += nodesize*numchildren + grandchildren) {
+		numchildren = Nodes::flags(here) & 3;
+		if (numchildren) {
+			numchildren++;
+			grandchildren = (Nodes::flags(here) & 4) << offsetshift;
+			visit(here, there, numchildren, !grandchildren);
+		} else {
+			grandchildren = 0;
+		}
+	}
+}
+
+
+// Add the groups of the children of the nodes in group g
+struct PrefetchVisitor {
+	const PrefetchGroup &g;
+	std::vector<PrefetchGroup> &next;
+	PrefetchVisitor(const PrefetchGroup &g_,
+			std::vector<PrefetchGroup> &next_) : g(g_), next(next_)
+		{}
+	void operator () (const unsigned char *, const unsigned char *there,
+			  int numchildren, bool leaves)
+	{
+		PrefetchGroup c = { g.frag, there, numchildren, leaves };
+		next.push_back(c);
+	}
+};
+
+template <class Nodes>
+static void prefetch_children(const PrefetchGroup &g,
+			      std::vector<PrefetchGroup> &next)
+{
+	if (g.leaves)
+		return;
+	PrefetchVisitor visit(g, next);
+	walk_children<Nodes>(g.p, g.numnodes, nodesize, offsetshift, visit);
+}
+
+
+// The same, for version 13
+static void prefetch_children8(const PrefetchGroup &g,
+			       std::vector<PrefetchGroup> &next)
+{
+	int groupsize = group8_size(havecolor);
+	const unsigned char *info = group8_info(g.p, havecolor);
+	const unsigned char *there = g.p + LittleEndianNodes::wideoffset(info + 8);
+	for (int i = 0; i < g.numnodes; i++) {
+		int numchildren = info[i] & 0x7f;
+		if (!numchildren)
+			continue;
+		PrefetchGroup c = { g.frag, there, numchildren, false };
+		next.push_back(c);
+		there += groupsize;
+	}
+}
+
+
+// Read in a level's worth of pages, if it fits in what's left of the budget
+static bool prefetch_pages(QSplat_PageIn *pagein, std::vector<size_t> &pages,
+			   size_t budget, bool lock, size_t &total,
+			   bool &locked)
+{
+	std::sort(pages.begin(), pages.end());
+	pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+	size_t bytes = pages.size() * pagein->PageSize();
+	if (total + bytes > budget)
+		return false;
+	if (!pagein->Prefetch(pages, lock))
+		locked = false;
+	total += bytes;
+	return true;
+}
+
+
+// Read in as many levels from the top of the tree as fit in budget bytes,
+// and lock them in memory if asked to.  The headers of the fragments count
+// as the first level.  Returns false if the pages couldn't be locked.
+// Trees that are read through the block cache are left to it.
+bool QSplat_Model::Prefetch(size_t budget, bool lock)
+{
+	if (!pagein)
+		return true;
+
+	size_t total = 0;
+	bool locked = true;
+	std::vector<size_t> pages;
+	for (int i = 0; i < fragments.size(); i++)
+		pagein->AddPages(map_start + fragments[i].start,
+				 QSPLAT_FRAGMENT_HEADER_MAX, pages);
+	if (!prefetch_pages(pagein, pages, budget, lock, total, locked))
+		return locked;
+
+	std::vector<PrefetchGroup> level, next;
+	for (int i = 0; i < fragments.size(); i++) {
+		Fragment &f = fragments[i];
+		if (f.numchildren < 0)
+			ReadHeader(f);
+		if (f.firstblock < 0 && f.numchildren > 0) {
+			PrefetchGroup g = { i, f.drawstart, f.numchildren,
+					    false };
+			level.push_back(g);
+		}
+	}
+
+	while (!level.empty()) {
+		pages.clear();
+		for (int i = 0; i < level.size(); i++) {
+			const PrefetchGroup &g = level[i];
+			const Fragment &f = fragments[g.frag];
+			havecolor = f.havecolor;
+			nodesize = (havecolor ? 6 : 4);
+			offsetshift = f.wide ? 1 : 0;
+			size_t len = f.simd ? group8_size(havecolor) :
+				nodesize * g.numnodes +
+				(g.leaves ? 0 : (4 << offsetshift));
+			pagein->AddPages(g.p, len, pages);
+		}
+		if (!prefetch_pages(pagein, pages, budget, lock, total, locked))
+			break;
+
+		next.clear();
+		for (int i = 0; i < level.size(); i++) {
+			const PrefetchGroup &g = level[i];
+			const Fragment &f = fragments[g.frag];
+			havecolor = f.havecolor;
+			nodesize = (havecolor ? 6 : 4);
+			offsetshift = f.wide ? 1 : 0;
+			if (f.simd)
+				prefetch_children8(g, next);
+			else if (f.little)
+				prefetch_children<LittleEndianNodes>(g, next);
+			else
+				prefetch_children<BigEndianNodes>(g, next);
+		}
+		level.swap(next);
+	}
+
+	return locked;
+}
+
+
+// Reading ahead for where the camera is going.  This goes down the trees the
+// same way as Prefetch(), a level at a time, but only into the nodes that
+// the predicted view would recurse into: ones that are in its frustum, and
+// bigger than minsize on its screen.  There's no backface culling, so this
+// errs on the side of reading too much.  It runs on the predictor's thread,
+// so it can't use the traversal's variables, and it only reads the mapped
+// file, which is never written.
+#define PREDICT_MAX_MB 8	// How much each prediction may read
+
+
+// Does the predicted view recurse into a node with children?
+static inline bool predict_node(const QSplat_View &v, float cx, float cy,
+				float cz, float r)
+{
+	if (!frustum_test(v.frustum, v.zproj, cx, cy, cz, r))
+		return false;
+	float z = v.zproj[0] * cx + v.zproj[1] * cy + v.zproj[2] * cz +
+		  v.zproj[3];
+	return (z <= 0.0f) || (r * 2.0f * v.pixels_per_radian / z > v.minsize);
+}
+
+
+// Add the groups of the children of the nodes in group g that the view
+// recurses into
+template <class Nodes>
+struct PredictVisitor {
+	const QSplat_View &v;
+	const QSplat_PredictGroup &g;
+	std::vector<QSplat_PredictGroup> &next;
+	PredictVisitor(const QSplat_View &v_, const QSplat_PredictGroup &g_,
+		       std::vector<QSplat_PredictGroup> &next_) :
+		v(v_), g(g_), next(next_)
+		{}
+	void operator () (const unsigned char *node,
+			  const unsigned char *there, int numchildren,
+			  bool leaves)
+	{
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(Nodes::word(node),
+					   g.cx, g.cy, g.cz, g.r,
+					   mycx, mycy, mycz, myr);
+		if (!predict_node(v, mycx, mycy, mycz, myr))
+			return;
+		QSplat_PredictGroup c = { g.frag, there, numchildren, leaves,
+					  mycx, mycy, mycz, myr };
+		next.push_back(c);
+	}
+};
+
+template <class Nodes>
+static void predict_children(const QSplat_View &v, const QSplat_PredictGroup &g,
+			     int nodesize, int offsetshift,
+			     std::vector<QSplat_PredictGroup> &next)
+{
+	if (g.leaves)
+		return;
+	PredictVisitor<Nodes> visit(v, g, next);
+	walk_children<Nodes>(g.p, g.numnodes, nodesize, offsetshift, visit);
+}
+
+
+// The same, for version 13
+static void predict_children8(const QSplat_View &v, const QSplat_PredictGroup &g,
+			      bool color,
+			      std::vector<QSplat_PredictGroup> &next)
+{
+	int groupsize = group8_size(color);
+	const unsigned char *info = group8_info(g.p, color);
+	const unsigned char *there = g.p + LittleEndianNodes::wideoffset(info + 8);
+	PredictVisitor<LittleEndianNodes> visit(v, g, next);
+	for (int i = 0; i < g.numnodes; i++) {
+		int numchildren = info[i] & 0x7f;
+		if (!numchildren)
+			continue;
+		visit(g.p + 2*i, there, numchildren, false);
+		there += groupsize;
+	}
+}
+
+
+// Find the fragments under one node of the fragment hierarchy that are in
+// view v, and add their top-level groups to roots.  This runs on the thread
+// that draws, so it can read the headers of fragments that haven't been
+// drawn yet.  Compressed fragments, and ones that aren't mapped, are left
+// to the block cache.
+void QSplat_Model::PredictFragments(int node, const QSplat_View &v,
+				    bool frustumcull,
+				    std::vector<QSplat_PredictGroup> &roots)
+{
+	const FragmentNode &n = fragtree[node];
+	if (frustumcull) {
+		int in = frustum_test(v.frustum, v.zproj, n.cx, n.cy, n.cz, n.r);
+		if (!in)
+			return;
+		if (in == 2)
+			frustumcull = false;
+	}
+
+	if (n.right) {
+		PredictFragments(node+1, v, frustumcull, roots);
+		PredictFragments(n.right, v, frustumcull, roots);
+		return;
+	}
+
+	for (int i = n.first; i < n.first + n.count; i++) {
+		Fragment &f = fragments[i];
+		if (frustumcull &&
+		    !frustum_test(v.frustum, v.zproj, f.cx, f.cy, f.cz, f.r))
+			continue;
+		if (f.numchildren < 0) {
+			if (!pagein->Resident(map_start + f.start,
+					      QSPLAT_FRAGMENT_HEADER_MAX))
+				continue;
+			ReadHeader(f);
+		}
+		if (f.numchildren <= 0 || f.firstblock >= 0)
+			continue;
+		QSplat_PredictGroup g = { i, f.drawstart, f.numchildren, false,
+					  f.cx, f.cy, f.cz, f.r };
+		roots.push_back(g);
+	}
+}
+
+
+void QSplat_Model::predict(const float *P, const float *M, const float *V)
+{
+	if (!pagein || fragtree.empty())
+		return;
+
+	QSplat_View v;
+	find_frustum(P, M, v.frustum);
+	v.zproj[0] = -M[2];
+	v.zproj[1] = -M[6];
+	v.zproj[2] = -M[10];
+	v.zproj[3] = -M[14];
+	v.pixels_per_radian = 0.5f * V[2] * P[0];
+	v.minsize = minsize;
+
+	std::vector<QSplat_PredictGroup> roots;
+	PredictFragments(0, v, true, roots);
+
+	{
+		std::lock_guard<std::mutex> l(predictlock);
+		predictroots.swap(roots);
+		predictview = v;
+		predictpending = true;
+		if (!predictor.joinable())
+			predictor = std::thread(&QSplat_Model::PredictLoop,
+						this);
+	}
+	predictwakeup.notify_one();
+}
+
+
+// The predictor's thread.  It stops going down as soon as there's a newer
+// view to work on, or when it has read PREDICT_MAX_MB.
+void QSplat_Model::PredictLoop()
+{
+	std::vector<QSplat_PredictGroup> level, next;
+	std::vector<size_t> pages;
+	QSplat_View v;
+	while (1) {
+		{
+			std::unique_lock<std::mutex> l(predictlock);
+			while (!predictpending && !predictquit)
+				predictwakeup.wait(l);
+			if (predictquit)
+				return;
+			level.swap(predictroots);
+			predictroots.clear();
+			v = predictview;
+			predictpending = false;
+		}
+
+		size_t total = 0;
+		while (!level.empty() && !predictpending) {
+			pages.clear();
+			for (int i = 0; i < level.size(); i++) {
+				const QSplat_PredictGroup &g = level[i];
+				const Fragment &f = fragments[g.frag];
+				int nodesize = f.havecolor ? 6 : 4;
+				size_t len = f.simd ? group8_size(f.havecolor) :
+					nodesize * g.numnodes +
+					(g.leaves ? 0 : (4 << (f.wide ? 1 : 0)));
+				pagein->AddPages(g.p, len, pages);
+			}
+			std::sort(pages.begin(), pages.end());
+			pages.erase(std::unique(pages.begin(), pages.end()),
+				    pages.end());
+			total += pages.size() * pagein->PageSize();
+			if (total > ((size_t) PREDICT_MAX_MB << 20))
+				break;
+			pagein->Fetch(pages);
+
+			next.clear();
+			for (int i = 0; i < level.size(); i++) {
+				const QSplat_PredictGroup &g = level[i];
+				const Fragment &f = fragments[g.frag];
+				int nodesize = f.havecolor ? 6 : 4;
+				int offsetshift = f.wide ? 1 : 0;
+				if (f.simd)
+					predict_children8(v, g, f.havecolor,
+							  next);
+				else if (f.little)
+					predict_children<LittleEndianNodes>(v,
+						g, nodesize, offsetshift, next);
+				else
+					predict_children<BigEndianNodes>(v,
+						g, nodesize, offsetshift, next);
+			}
+			level.swap(next);
+		}
+		level.clear();
+	}
+}
+
 #endif
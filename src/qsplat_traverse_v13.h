@@ -0,0 +1,415 @@
+#ifndef QSPLAT_TRAVERSE_V13_H
+#define QSPLAT_TRAVERSE_V13_H
+/*
+qsplat_traverse_v13.h
+Traverse a version-13 (8-wide bsphere hierarchy, fixed-size groups of
+siblings) QSplat fragment.  Each group holds the sphere words of its 8
+nodes side by side, then their normal words, then their color words, so
+the positions, sizes and culling tests of a whole group are worked out at
+once - with AVX2 if the processor has it - before we decide what to do with
+each node.
+
+This is included by qsplat_traverse_v11.h, and uses the same camera
+parameters and the same calls to the GUI.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define QSPLAT_HAVE_AVX2
+# include <immintrin.h>
+#endif
+
+#define QSPLAT_FILE_VERSION_SIMD 13
+
+
+// What we know about the nodes of a group once it has been decoded
+struct QSplat_Group8 {
+	float cx[8], cy[8], cz[8], r[8];
+	float z[8];			// Perpendicular distance to screen
+	float splatsize_scale[8];
+	float camdotnorm[8];		// 0 if there was no backface test
+	unsigned cull;			// Bit i set if node i can't be seen,
+	unsigned inside;		// if it's entirely inside the frustum,
+	unsigned facing;		// or if all its children face us
+};
+
+
+// The parts of a group: the words of each kind, the number of children of
+// each node, and the offset to the groups of the children.  These don't use
+// havecolor, so the predictor's thread can call them too.
+static inline int group8_size(bool color)
+	{ return color ? 64 : 48; }
+static inline const unsigned char *group8_info(const unsigned char *g,
+					       bool color)
+	{ return g + (color ? 48 : 32); }
+
+
+// Decode the first numnodes nodes of group g, whose parent is the sphere
+// (cx, cy, cz, r), and test them against the view frustum and for
+// backfaces.  This is the same arithmetic as in draw_hierarchy(), one node
+// at a time.
+static void decode_group8_scalar(const unsigned char *g, int numnodes,
+				 float cx, float cy, float cz, float r,
+				 bool backfacecull, bool frustumcull,
+				 QSplat_Group8 &o)
+{
+	o.cull = o.inside = o.facing = 0;
+	for (int i = 0; i < numnodes; i++) {
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(LittleEndianNodes::word(g + 2*i),
+					   cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+		o.cx[i] = mycx;  o.cy[i] = mycy;  o.cz[i] = mycz;  o.r[i] = myr;
+
+		float z = zproj[0] * mycx + zproj[1] * mycy +
+			  zproj[2] * mycz + zproj[3];
+		o.z[i] = z;
+		o.splatsize_scale[i] = 2.0f * pixels_per_radian / z;
+		o.camdotnorm[i] = 0.0f;
+
+		if (frustumcull) {
+			bool inside = (z > myr);
+			bool outside = (z <= -myr);
+			for (int j = 0; j < 4; j++) {
+				float d = mycx*frustum[j][0] + mycy*frustum[j][1] +
+					  mycz*frustum[j][2] + frustum[j][3];
+				if (d <= -myr)
+					outside = true;
+				if (d < myr)
+					inside = false;
+			}
+			if (outside) {
+				o.cull |= 1u << i;
+				continue;
+			}
+			if (inside)
+				o.inside |= 1u << i;
+		}
+
+		unsigned normword = LittleEndianNodes::word(g + 16 + 2*i);
+		if (backfacecull && ((normword & 3) != 3)) {
+			const float *norm = QSplat_NormQuant::lookup(normword);
+			float camx = campos[0] - mycx;
+			float camy = campos[1] - mycy;
+			float camz = campos[2] - mycz;
+			float camdotnorm = camx * norm[0] +
+					   camy * norm[1] +
+					   camz * norm[2];
+			o.camdotnorm[i] = camdotnorm;
+			if (camdotnorm < -myr) {
+				float camdist2 = sqr(camx) + sqr(camy) + sqr(camz);
+				float cone = QSplat_NormQuant::lookup_cone(normword);
+				if (sqr(camdotnorm + myr) > camdist2 * sqr(cone))
+					o.cull |= 1u << i;
+			} else if (camdotnorm > myr) {
+				float camdist2 = sqr(camx) + sqr(camy) + sqr(camz);
+				float cone = QSplat_NormQuant::lookup_cone(normword);
+				if (sqr(camdotnorm - myr) > camdist2 * sqr(cone))
+					o.facing |= 1u << i;
+			}
+		}
+	}
+}
+
+
+#ifdef QSPLAT_HAVE_AVX2
+
+// The same thing, for all 8 nodes at once.  The operations are done in the
+// same order as above, so the results are exactly the same.  Empty slots
+// have all-zero words, which still index valid table entries, so they're
+// decoded along with the rest and then masked off.
+__attribute__((target("avx2")))
+static void decode_group8_avx2(const unsigned char *g, int numnodes,
+			       float cx, float cy, float cz, float r,
+			       bool backfacecull, bool frustumcull,
+			       QSplat_Group8 &o)
+{
+	unsigned valid = (1u << numnodes) - 1;
+
+	// Sphere words index 4 floats each: X, Y, Z, R
+	__m256i sphereword = _mm256_cvtepu16_epi32(
+		_mm_loadu_si128((const __m128i *) g));
+	__m256i si = _mm256_srli_epi32(_mm256_and_si256(sphereword,
+		_mm256_set1_epi32(0xfff8)), 1);
+	const float *stab = QSplat_SphereQuant::table();
+	__m256 pr = _mm256_set1_ps(r);
+	__m256 mycx = _mm256_add_ps(_mm256_set1_ps(cx), _mm256_mul_ps(pr,
+		_mm256_i32gather_ps(stab, si, 4)));
+	__m256 mycy = _mm256_add_ps(_mm256_set1_ps(cy), _mm256_mul_ps(pr,
+		_mm256_i32gather_ps(stab + 1, si, 4)));
+	__m256 mycz = _mm256_add_ps(_mm256_set1_ps(cz), _mm256_mul_ps(pr,
+		_mm256_i32gather_ps(stab + 2, si, 4)));
+	__m256 myr = _mm256_mul_ps(pr, _mm256_i32gather_ps(stab + 3, si, 4));
+	__m256 negr = _mm256_sub_ps(_mm256_setzero_ps(), myr);
+	_mm256_storeu_ps(o.cx, mycx);
+	_mm256_storeu_ps(o.cy, mycy);
+	_mm256_storeu_ps(o.cz, mycz);
+	_mm256_storeu_ps(o.r, myr);
+
+	__m256 z = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+		_mm256_mul_ps(_mm256_set1_ps(zproj[0]), mycx),
+		_mm256_mul_ps(_mm256_set1_ps(zproj[1]), mycy)),
+		_mm256_mul_ps(_mm256_set1_ps(zproj[2]), mycz)),
+		_mm256_set1_ps(zproj[3]));
+	_mm256_storeu_ps(o.z, z);
+	_mm256_storeu_ps(o.splatsize_scale, _mm256_div_ps(
+		_mm256_set1_ps(2.0f * pixels_per_radian), z));
+
+	unsigned cull = 0, inside = 0, facing = 0;
+	if (frustumcull) {
+		__m256 out = _mm256_cmp_ps(z, negr, _CMP_LE_OQ);
+		__m256 in = _mm256_cmp_ps(z, myr, _CMP_GT_OQ);
+		for (int j = 0; j < 4; j++) {
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(mycx, _mm256_set1_ps(frustum[j][0])),
+				_mm256_mul_ps(mycy, _mm256_set1_ps(frustum[j][1]))),
+				_mm256_mul_ps(mycz, _mm256_set1_ps(frustum[j][2]))),
+				_mm256_set1_ps(frustum[j][3]));
+			out = _mm256_or_ps(out, _mm256_cmp_ps(d, negr, _CMP_LE_OQ));
+			in = _mm256_and_ps(in, _mm256_cmp_ps(d, myr, _CMP_GE_OQ));
+		}
+		cull = _mm256_movemask_ps(out);
+		inside = _mm256_movemask_ps(in) & ~cull;
+	}
+
+	__m256 camdotnorm = _mm256_setzero_ps();
+	if (backfacecull) {
+		// Normal words index 3 floats each; a cone of 3 means the
+		// normals point every which way, so there's no test
+		__m256i normword = _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *) (g + 16)));
+		__m256i ni = _mm256_srli_epi32(normword, 2);
+		ni = _mm256_add_epi32(ni, _mm256_add_epi32(ni, ni));
+		__m256i conebits = _mm256_and_si256(normword,
+						    _mm256_set1_epi32(3));
+		__m256 tested = _mm256_castsi256_ps(_mm256_xor_si256(
+			_mm256_cmpeq_epi32(conebits, _mm256_set1_epi32(3)),
+			_mm256_set1_epi32(-1)));
+		const float *ntab = QSplat_NormQuant::table();
+		__m256 camx = _mm256_sub_ps(_mm256_set1_ps(campos[0]), mycx);
+		__m256 camy = _mm256_sub_ps(_mm256_set1_ps(campos[1]), mycy);
+		__m256 camz = _mm256_sub_ps(_mm256_set1_ps(campos[2]), mycz);
+		camdotnorm = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(camx, _mm256_i32gather_ps(ntab, ni, 4)),
+			_mm256_mul_ps(camy, _mm256_i32gather_ps(ntab + 1, ni, 4))),
+			_mm256_mul_ps(camz, _mm256_i32gather_ps(ntab + 2, ni, 4)));
+		camdotnorm = _mm256_and_ps(camdotnorm, tested);
+
+		__m256 camdist2 = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(camx, camx), _mm256_mul_ps(camy, camy)),
+			_mm256_mul_ps(camz, camz));
+		__m256 c1 = _mm256_cvtepi32_ps(_mm256_add_epi32(conebits,
+						_mm256_set1_epi32(1)));
+		__m256 cone = _mm256_mul_ps(_mm256_mul_ps(
+			_mm256_set1_ps(-0.0625f), c1), c1);
+		__m256 limit = _mm256_mul_ps(camdist2, _mm256_mul_ps(cone, cone));
+		__m256 back = _mm256_add_ps(camdotnorm, myr);
+		__m256 front = _mm256_sub_ps(camdotnorm, myr);
+		__m256 culled = _mm256_and_ps(_mm256_and_ps(tested,
+			_mm256_cmp_ps(camdotnorm, negr, _CMP_LT_OQ)),
+			_mm256_cmp_ps(_mm256_mul_ps(back, back), limit, _CMP_GT_OQ));
+		__m256 allfacing = _mm256_and_ps(_mm256_and_ps(tested,
+			_mm256_cmp_ps(camdotnorm, myr, _CMP_GT_OQ)),
+			_mm256_cmp_ps(_mm256_mul_ps(front, front), limit, _CMP_GT_OQ));
+		cull |= _mm256_movemask_ps(culled);
+		facing = _mm256_movemask_ps(allfacing);
+	}
+	_mm256_storeu_ps(o.camdotnorm, camdotnorm);
+
+	o.cull = cull & valid;
+	o.inside = inside & valid;
+	o.facing = facing & valid;
+}
+
+#endif
+
+
+// Which of the above to use, depending on what the processor can do
+typedef void (*QSplat_DecodeGroup8)(const unsigned char *g, int numnodes,
+				    float cx, float cy, float cz, float r,
+				    bool backfacecull, bool frustumcull,
+				    QSplat_Group8 &o);
+static QSplat_DecodeGroup8 decode_group8 = NULL;
+
+static inline void choose_decode_group8()
+{
+	if (decode_group8)
+		return;
+	decode_group8 = decode_group8_scalar;
+#ifdef QSPLAT_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		decode_group8 = decode_group8_avx2;
+#endif
+}
+
+
+// Does any node of a group have children?
+template <class Tree>
+static inline bool group8_has_children(typename Tree::Pos pos)
+{
+	typename Tree::Group group(pos);
+	const unsigned char *info = group8_info(group, havecolor);
+	for (int i = 0; i < 8; i++)
+		if (info[i] & 0x7f)
+			return true;
+	return false;
+}
+
+
+// Draw the nodes of a group without testing them, as in
+// draw_hierarchy_leaves()
+template <class Tree>
+static inline void draw_group8_leaves(typename Tree::Pos pos, int numnodes,
+				      float cx, float cy, float cz, float r,
+				      float approx_splatsize_scale)
+{
+	typename Tree::Group group(pos);
+	const unsigned char *g = group;
+	for (int i = 0; i < numnodes; i++) {
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(LittleEndianNodes::word(g + 2*i),
+					   cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+		float splatsize = approx_splatsize_scale ?
+				  myr * approx_splatsize_scale :
+				  minsize;
+		GUI->drawpoint(mycx, mycy, mycz,
+			       myr, splatsize,
+			       QSplat_NormQuant::lookup(LittleEndianNodes::word(g + 16 + 2*i)),
+			       havecolor?QSplat_ColorQuant::lookup(LittleEndianNodes::word(g + 32 + 2*i)):NULL);
+	}
+}
+
+
+// The drawing routine for version 13.  It makes the same decisions as
+// draw_hierarchy(), but a group at a time: the whole group is decoded and
+// tested, and then we go through its nodes deciding which to draw and which
+// to recurse into.  Like draw_hierarchy(), it draws from the map or
+// through the block cache, depending on Tree.
+template <class Tree>
+static void draw_group8(typename Tree::Pos pos, int numnodes,
+			float cx, float cy, float cz, float r,
+			bool backfacecull, bool frustumcull)
+{
+ 	// Check for events, but not too often
+	static unsigned counter = 0;
+	if (!(counter++ & 0xff)) {
+		timestamp now;
+		get_timestamp(now);
+		float elapsed = now - renderstarttime;
+		if (GUI->abort_drawing(elapsed)) {
+			bail = true;
+			return;
+		}
+	}
+
+	typename Tree::Group group(pos);
+	const unsigned char *g = group;
+	QSplat_Group8 o;
+	decode_group8(g, numnodes, cx, cy, cz, r,
+		      backfacecull, frustumcull, o);
+
+	// The groups of the children are in the same order as the nodes
+	// that have children
+	int groupsize = group8_size(havecolor);
+	const unsigned char *info = group8_info(g, havecolor);
+	typename Tree::Pos there = pos + LittleEndianNodes::wideoffset(info + 8);
+
+	for (int i = 0; i < numnodes; i++) {
+		int numchildren = info[i] & 0x7f;
+		typename Tree::Pos children = there;
+		if (numchildren)
+			there += groupsize;
+		if (o.cull & (1u << i))
+			continue;
+
+		float z = o.z[i];
+		float splatsize = o.r[i] * o.splatsize_scale[i];
+		if (!numchildren || ((z > 0.0f) && (splatsize <= minsize)) ||
+		    !Tree::resident(children, groupsize)) {
+			// Draw now
+			if ((z > 0.0f) && (o.camdotnorm[i] >= 0.0f)) {
+				GUI->drawpoint(o.cx[i], o.cy[i], o.cz[i],
+					       o.r[i], splatsize,
+					       QSplat_NormQuant::lookup(LittleEndianNodes::word(g + 16 + 2*i)),
+					       havecolor?QSplat_ColorQuant::lookup(LittleEndianNodes::word(g + 32 + 2*i)):NULL);
+			}
+		} else if (!group8_has_children<Tree>(children)) {
+			// Children are all leaf nodes
+			draw_group8_leaves<Tree>(children, numchildren,
+					   o.cx[i], o.cy[i], o.cz[i], o.r[i],
+					   o.splatsize_scale[i]);
+		} else if ((z > 0.0f) && (splatsize <= FAST_CUTOFF)) {
+			// Close enough to minsize that the children can
+			// just be drawn
+			draw_group8_leaves<Tree>(children, numchildren,
+					   o.cx[i], o.cy[i], o.cz[i], o.r[i],
+					   0.0f);
+		} else {
+			draw_group8<Tree>(children, numchildren,
+				    o.cx[i], o.cy[i], o.cz[i], o.r[i],
+				    backfacecull && !(o.facing & (1u << i)),
+				    frustumcull && !(o.inside & (1u << i)));
+			if (bail)
+				return;
+		}
+	}
+}
+
+
+// Trace a ray through a version 13 fragment.  This is rare enough that the
+// nodes are just done one at a time.
+template <class Tree>
+static void traceray_group8(typename Tree::Pos pos, int numnodes,
+			    float cx, float cy, float cz, float r,
+			    const float *pt, const float *dir,
+			    float cutoff, float &best)
+{
+	typename Tree::Group group(pos);
+	const unsigned char *g = group;
+	int groupsize = group8_size(havecolor);
+	const unsigned char *info = group8_info(g, havecolor);
+	typename Tree::Pos there = pos + LittleEndianNodes::wideoffset(info + 8);
+
+	for (int i = 0; i < numnodes; i++) {
+		int numchildren = info[i] & 0x7f;
+		typename Tree::Pos children = there;
+		if (numchildren)
+			there += groupsize;
+
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(LittleEndianNodes::word(g + 2*i),
+					   cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+
+		vec x = { mycx-pt[0], mycy-pt[1], mycz-pt[2] };
+
+		float t = Dot(x, dir);
+		if ((t < -myr) || (t-myr > best))
+			continue;
+		point ipoint = { pt[0] + t * dir[0],
+				 pt[1] + t * dir[1],
+				 pt[2] + t * dir[2] };
+
+		float idist2 = sqr(mycx - ipoint[0]) +
+			       sqr(mycy - ipoint[1]) +
+			       sqr(mycz - ipoint[2]);
+
+		if (idist2 > sqr(myr))
+			continue;
+
+		if ((myr < t * cutoff) || !numchildren) {
+			if ((t > 0) && (t < best))
+				best = t;
+		} else {
+			traceray_group8<Tree>(children, numchildren,
+					mycx, mycy, mycz, myr,
+					pt, dir, cutoff, best);
+		}
+	}
+}
+
+#endif
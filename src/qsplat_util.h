@@ -31,7 +31,9 @@ using std::swap;
 
 
 // Endianness stuff
-#if defined(i386) || defined(WIN32)
+#if defined(i386) || defined(__i386__) || defined(__x86_64__) || \
+    defined(WIN32) || defined(_M_IX86) || defined(_M_X64) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
 #define WE_ARE_LITTLE_ENDIAN
 #endif
 
@@ -47,10 +49,17 @@ using std::swap;
 # define FIX_LONG(x) (*(unsigned *)&(x) = \
 			SWAP_LONG(*(unsigned *)&(x)))
 # define FIX_FLOAT(x) FIX_LONG(x)
+# define FIX_LONGLONG(x) do { \
+			unsigned *_w = (unsigned *)&(x); \
+			unsigned _t = SWAP_LONG(_w[0]); \
+			_w[0] = SWAP_LONG(_w[1]); \
+			_w[1] = _t; \
+		} while (0)
 #else
 # define FIX_SHORT(x) do {} while (0)
 # define FIX_LONG(x) do {} while (0)
 # define FIX_FLOAT(x) do {} while (0)
+# define FIX_LONGLONG(x) do {} while (0)
 #endif
 
 
@@ -63,8 +72,12 @@ using std::swap;
 // XXXXXX - assumes p has 2-byte alignment, and assumes big endian
 #define UNALIGNED_DEREFERENCE_INT(p) (int( \
 	(*((unsigned short *)(p)) << 16) | *(((unsigned short *)(p))+1)))
+#define UNALIGNED_DEREFERENCE_LONGLONG(p) ( \
+	((long long) UNALIGNED_DEREFERENCE_INT(p) << 32) | \
+	(unsigned) UNALIGNED_DEREFERENCE_INT(((unsigned short *)(p))+2) )
 #else
 #define UNALIGNED_DEREFERENCE_INT(p) ( * (int *)(p) )
+#define UNALIGNED_DEREFERENCE_LONGLONG(p) ( * (long long *)(p) )
 #endif
 
 
@@ -0,0 +1,600 @@
+/*
+qsplat_zoombench.cpp
+Counts the pages of .qs files that get touched as the viewer zooms in on
+spots of the model, to compare the layouts qsplat_make can write.
+
+Each zoom path picks a leaf of the tree, and moves the camera towards it
+in steps, halving its distance each time.  At every step, the tree is
+traversed the way the viewer would: a node is refined if it's in view and
+bigger than a pixel.  We count the distinct pages read in each frame, and
+the pages read for the first time along the path (which is what an
+uncached file would have to fault in).  Where the OS lets us drop the file
+from the cache, the major page faults are measured as well.  Finally, we
+count the pages it takes to pick each spot with a ray from the camera (as
+the viewer does to find the point under the mouse), starting from a cold
+cache - that is, a descent all the way down a narrow part of the tree.
+The trees of compressed (version 14) fragments are decompressed up front,
+and reading a group counts as reading the compressed block it's in.
+
+Unix only, since it wants mmap and getrusage.
+
+Copyright (c) 1999-2000 The Board of Trustees of the
+Leland Stanford Junior University.  All Rights Reserved.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "qsplat_util.h"
+#include "qsplat_spherequant.h"
+#include "qsplat_lz.h"
+#include <vector>
+
+
+#define QSPLAT_MAGIC "QSplat"
+#define QSPLAT_FILE_VERSION_WIDE 12
+#define QSPLAT_FILE_VERSION_SIMD 13
+#define QSPLAT_FILE_VERSION_COMPRESSED 14
+#define QSPLAT_OPT_COLOR 1
+#define QSPLAT_OPT_COMMENTS 2
+#define QSPLAT_OPT_INDEX 4
+#define QSPLAT_OPT_LITTLE_ENDIAN 8
+
+// The camera: tan of half the field of view
+#define HALF_FOV_TAN 0.577f
+
+
+// A fragment of the file
+struct Fragment {
+	const unsigned char *tree;	// The top-level group
+	float cx, cy, cz, r;
+	int numchildren, nodesize;
+	bool wide, little;
+	bool simd;			// Version 13: fixed-size 8-wide groups
+	int groupsize;
+	const unsigned char *blocks;	// Version 14: the offsets of the
+	const unsigned char *start;	// compressed blocks from the start of
+	int blockbits;			// the fragment (NULL if not compressed)
+};
+
+
+// The file we're looking at, and which of its pages have been touched
+static const unsigned char *filestart;
+static size_t pagesize;
+static std::vector<int> pageframe;	// Last frame each page was read in
+static std::vector<int> pagepath;	// Last path each page was read in
+static int frame, path;
+static long long framepages, newpages;
+static volatile unsigned char pagesum;
+
+// The current view
+static float campos[3], target[3], viewradius;
+static float pixels_per_radian = 1000.0f;
+static bool picking;			// Following a ray instead
+
+
+// Note that the bytes [p..p+len) were read.  Pages are read for real the
+// first time in each path, so that they get faulted in.
+static void touch(const unsigned char *p, long long len)
+{
+	size_t first = (p - filestart) / pagesize;
+	size_t last = (p + len - 1 - filestart) / pagesize;
+	for (size_t i = first; i <= last; i++) {
+		if (pageframe[i] != frame) {
+			pageframe[i] = frame;
+			framepages++;
+		}
+		if (pagepath[i] != path) {
+			pagepath[i] = path;
+			newpages++;
+			pagesum += filestart[i * pagesize];
+		}
+	}
+}
+
+
+// A big-endian 64-bit number in the file
+static inline long long get_longlong(const unsigned char *p)
+{
+	long long L = 0;
+	for (int i = 0; i < 8; i++)
+		L = (L << 8) | p[i];
+	return L;
+}
+
+
+// Note that a group at p in the tree of f, len bytes long, was read.  In a
+// compressed fragment, that takes the whole block it starts in.
+static void touch_group(const Fragment &f, const unsigned char *p, int len)
+{
+	if (!f.blocks) {
+		touch(p, len);
+		return;
+	}
+	const unsigned char *o = f.blocks + 8 * ((p - f.tree) >> f.blockbits);
+	long long begin = get_longlong(o), end = get_longlong(o+8);
+	touch(f.start + begin, end - begin);
+}
+
+
+// The first 16-bit word of a node, and its flags
+static inline unsigned node_word(const Fragment &f, const unsigned char *p)
+{
+	return f.little ? (unsigned(p[0]) | (unsigned(p[1]) << 8)) :
+			  ((unsigned(p[0]) << 8) | unsigned(p[1]));
+}
+
+static inline unsigned node_flags(const Fragment &f, const unsigned char *p)
+{
+	return f.little ? p[0] : p[1];
+}
+
+
+// Follow the child offset at the start of a group
+static const unsigned char *find_children(const Fragment &f,
+					  const unsigned char *&here)
+{
+	int bytes = f.wide ? 8 : 4;
+	long long offset = 0;
+	for (int i = 0; i < bytes; i++)
+		offset = (offset << 8) | here[f.little ? bytes - 1 - i : i];
+	if (!f.wide)
+		offset = (int) offset;
+	const unsigned char *there = here + offset;
+	here += bytes;
+	return there;
+}
+
+
+// Is this sphere in view, and big enough to refine?  When picking, is it
+// hit by the ray from the camera through the target?
+static bool refine(float cx, float cy, float cz, float r)
+{
+	if (picking)
+		return sqr(cx - target[0]) + sqr(cy - target[1]) <= sqr(r);
+	float tdist2 = sqr(cx - target[0]) + sqr(cy - target[1]) +
+		       sqr(cz - target[2]);
+	if (tdist2 > sqr(viewradius + r))
+		return false;
+	float camdist2 = sqr(cx - campos[0]) + sqr(cy - campos[1]) +
+			 sqr(cz - campos[2]);
+	return sqr(2.0f * r * pixels_per_radian) > camdist2;
+}
+
+
+// In a version 13 fragment, the number of children of each node of a group
+// is in a byte of its own, and the group ends with the offset to the groups
+// of the children
+static inline const unsigned char *group8_info(const Fragment &f,
+					       const unsigned char *g)
+{
+	return g + f.groupsize - 16;
+}
+
+static inline const unsigned char *group8_children(const Fragment &f,
+						   const unsigned char *g)
+{
+	const unsigned char *p = g + f.groupsize - 8;
+	long long offset = 0;
+	for (int i = 7; i >= 0; i--)
+		offset = (offset << 8) | p[i];
+	return g + offset;
+}
+
+
+// Traverse a group of a version 13 fragment for the current view
+static void traverse8(const Fragment &f, const unsigned char *g,
+		      int numnodes, float cx, float cy, float cz, float r)
+{
+	touch_group(f, g, f.groupsize);
+	const unsigned char *info = group8_info(f, g);
+	const unsigned char *there = group8_children(f, g);
+	for (int i = 0; i < numnodes; i++) {
+		int numchildren = info[i] & 0x7f;
+		if (!numchildren)
+			continue;
+		const unsigned char *children = there;
+		there += f.groupsize;
+
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(node_word(f, g + 2*i), cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+		if (refine(mycx, mycy, mycz, myr))
+			traverse8(f, children, numchildren,
+				  mycx, mycy, mycz, myr);
+	}
+}
+
+
+// Traverse a group of siblings for the current view
+static void traverse(const Fragment &f, const unsigned char *here,
+		     int numnodes, float cx, float cy, float cz, float r,
+		     bool hasoffset)
+{
+	if (f.simd) {
+		traverse8(f, here, numnodes, cx, cy, cz, r);
+		return;
+	}
+	int offsetsize = f.wide ? 8 : 4;
+	touch_group(f, here,
+		    numnodes * f.nodesize + (hasoffset ? offsetsize : 0));
+	const unsigned char *there = hasoffset ? find_children(f, here) : NULL;
+	for (int i = 0; i < numnodes; i++, here += f.nodesize) {
+		unsigned flags = node_flags(f, here);
+		if (!(flags & 3))
+			continue;
+		int numchildren = (flags & 3) + 1;
+		bool grandchildren = flags & 4;
+		const unsigned char *children = there;
+		there += numchildren * f.nodesize +
+			 (grandchildren ? offsetsize : 0);
+
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(node_word(f, here), cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+		if (refine(mycx, mycy, mycz, myr))
+			traverse(f, children, numchildren,
+				 mycx, mycy, mycz, myr, grandchildren);
+	}
+}
+
+
+// Pick a leaf of a version 13 fragment at random, and return its position
+static void pick_target8(const Fragment &f, float *pos)
+{
+	const unsigned char *here = f.tree;
+	int numnodes = f.numchildren;
+	float cx = f.cx, cy = f.cy, cz = f.cz, r = f.r;
+	while (1) {
+		const unsigned char *info = group8_info(f, here);
+		const unsigned char *there = group8_children(f, here);
+		int which = rand() % numnodes;
+		for (int i = 0; i < which; i++)
+			if (info[i] & 0x7f)
+				there += f.groupsize;
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(node_word(f, here + 2*which),
+					   cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+		cx = mycx;  cy = mycy;  cz = mycz;  r = myr;
+		numnodes = info[which] & 0x7f;
+		if (!numnodes)
+			break;
+		here = there;
+	}
+	pos[0] = cx;  pos[1] = cy;  pos[2] = cz;
+}
+
+
+// Pick a leaf of a fragment at random, and return its position
+static void pick_target(const Fragment &f, float *pos)
+{
+	if (f.simd) {
+		pick_target8(f, pos);
+		return;
+	}
+	const unsigned char *here = f.tree;
+	int numnodes = f.numchildren;
+	bool hasoffset = true;
+	float cx = f.cx, cy = f.cy, cz = f.cz, r = f.r;
+	int offsetsize = f.wide ? 8 : 4;
+	while (1) {
+		const unsigned char *there = NULL;
+		if (hasoffset)
+			there = find_children(f, here);
+		int which = rand() % numnodes;
+		for (int i = 0; i < which; i++, here += f.nodesize) {
+			unsigned flags = node_flags(f, here);
+			if (flags & 3)
+				there += ((flags & 3) + 1) * f.nodesize +
+					 ((flags & 4) ? offsetsize : 0);
+		}
+		float mycx, mycy, mycz, myr;
+		QSplat_SphereQuant::lookup(node_word(f, here), cx, cy, cz, r,
+					   mycx, mycy, mycz, myr);
+		cx = mycx;  cy = mycy;  cz = mycz;  r = myr;
+		unsigned flags = node_flags(f, here);
+		if (!(flags & 3))
+			break;
+		here = there;
+		numnodes = (flags & 3) + 1;
+		hasoffset = flags & 4;
+	}
+	pos[0] = cx;  pos[1] = cy;  pos[2] = cz;
+}
+
+
+// Decompress the tree of a version 14 fragment, whose header ends at p.
+// Returns false if it's corrupt.
+static bool decompress_tree(Fragment &f, const unsigned char *p)
+{
+	int bits = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+	int overlap = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+	long long treelen = get_longlong(p+8);
+	if (bits < 8 || bits > 24 || overlap < 0 || treelen <= 0)
+		return false;
+	int numblocks = (int) ((treelen + (1 << bits) - 1) >> bits);
+	unsigned char *tree = new unsigned char[treelen + overlap];
+	f.tree = tree;
+	f.blocks = p + 24;
+	f.blockbits = bits;
+	for (int i = 0; i < numblocks; i++) {
+		long long start = (long long) i << bits;
+		int len = (int) min((long long) (1 << bits) + overlap,
+				    treelen - start);
+		long long begin = get_longlong(f.blocks + 8*i);
+		long long end = get_longlong(f.blocks + 8*i + 8);
+		if (!qsplat_lz_decompress(f.start + begin, (int) (end - begin),
+					  tree + start, len))
+			return false;
+	}
+	return true;
+}
+
+
+// Find the fragments of a file
+static bool read_fragments(const unsigned char *map, size_t len,
+			   std::vector<Fragment> &fragments)
+{
+	size_t pos = 0;
+	while (pos + 40 <= len) {
+		const unsigned char *here = map + pos;
+		if (strncmp((const char *)here, QSPLAT_MAGIC, 6))
+			return false;
+		Fragment f;
+		int version = (here[6] - '0') * 10 + (here[7] - '0');
+		f.simd = (version == QSPLAT_FILE_VERSION_SIMD);
+		f.wide = (version >= QSPLAT_FILE_VERSION_WIDE);
+		f.start = here;
+		f.blocks = NULL;
+		long long fraglen;
+		if (f.wide) {
+			fraglen = UNALIGNED_DEREFERENCE_LONGLONG(here+8);
+			FIX_LONGLONG(fraglen);
+			here += 8;
+		} else {
+			int l = UNALIGNED_DEREFERENCE_INT(here+8);
+			FIX_LONG(l);
+			fraglen = l;
+		}
+		int options = UNALIGNED_DEREFERENCE_INT(here+16);
+		FIX_LONG(options);
+		if (fraglen <= 0 || pos + fraglen > len)
+			return false;
+		pos += fraglen;
+		if (options & (QSPLAT_OPT_COMMENTS | QSPLAT_OPT_INDEX))
+			continue;
+
+		float *sphere = (float *) (here+20);
+		f.cx = sphere[0];  FIX_FLOAT(f.cx);
+		f.cy = sphere[1];  FIX_FLOAT(f.cy);
+		f.cz = sphere[2];  FIX_FLOAT(f.cz);
+		f.r = sphere[3];  FIX_FLOAT(f.r);
+		f.numchildren = UNALIGNED_DEREFERENCE_INT(here+36);
+		FIX_LONG(f.numchildren);
+		f.nodesize = (options & QSPLAT_OPT_COLOR) ? 6 : 4;
+		f.little = options & QSPLAT_OPT_LITTLE_ENDIAN;
+		f.groupsize = (options & QSPLAT_OPT_COLOR) ? 64 : 48;
+		f.tree = here + 40;
+		if (f.numchildren <= 0)
+			continue;
+		if (version == QSPLAT_FILE_VERSION_COMPRESSED &&
+		    !decompress_tree(f, here + 40)) {
+			delete [] f.tree;
+			return false;
+		}
+		fragments.push_back(f);
+	}
+	return !fragments.empty();
+}
+
+
+// Free the decompressed trees of compressed fragments
+static void free_trees(std::vector<Fragment> &fragments)
+{
+	for (int i = 0; i < fragments.size(); i++)
+		if (fragments[i].blocks)
+			delete [] fragments[i].tree;
+	fragments.clear();
+}
+
+
+// Is any of the file still in memory?
+static bool any_resident(unsigned char *map, size_t len)
+{
+	size_t syspage = sysconf(_SC_PAGESIZE);
+	std::vector<unsigned char> resident((len + syspage - 1) / syspage);
+	if (mincore(map, len, &resident[0]))
+		return true;
+	for (size_t i = 0; i < resident.size(); i++)
+		if (resident[i] & 1)
+			return true;
+	return false;
+}
+
+
+// Throw the file out of the page cache, so that we can count the faults
+// that bring it back.  Returns false if we can't.
+static bool drop_cache(int fd, unsigned char *map, size_t len)
+{
+#if defined(MADV_DONTNEED) && defined(POSIX_FADV_DONTNEED)
+	if (madvise(map, len, MADV_DONTNEED))
+		return false;
+	if (posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED))
+		return false;
+	return !any_resident(map, len);
+#else
+	return false;
+#endif
+}
+
+
+static long major_faults()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_majflt;
+}
+
+
+// Run the zoom paths over one file
+static bool bench(const char *filename, int numpaths, int steps)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't open %s\n", filename);
+		return false;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	size_t len = st.st_size;
+	unsigned char *map = (unsigned char *)
+		mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map %s\n", filename);
+		close(fd);
+		return false;
+	}
+#ifdef MADV_RANDOM
+	// Otherwise, readahead hides the faults we're trying to count
+	madvise(map, len, MADV_RANDOM);
+#endif
+
+	std::vector<Fragment> fragments;
+	if (!read_fragments(map, len, fragments)) {
+		fprintf(stderr, "%s isn't a .qs file\n", filename);
+		free_trees(fragments);
+		munmap(map, len);
+		close(fd);
+		return false;
+	}
+
+	// A sphere around the whole model, to start zooming from
+	float modelradius = 0.0f;
+	for (int i = 0; i < fragments.size(); i++) {
+		float d = sqrtf(sqr(fragments[i].cx - fragments[0].cx) +
+				sqr(fragments[i].cy - fragments[0].cy) +
+				sqr(fragments[i].cz - fragments[0].cz));
+		modelradius = max(modelradius, d + fragments[i].r);
+	}
+
+	filestart = map;
+	pageframe.assign(len / pagesize + 1, -1);
+	pagepath.assign(len / pagesize + 1, -1);
+	framepages = newpages = 0;
+	long long faults = 0;
+	bool measured = true;
+	srand(1);
+	for (path = 0; path < numpaths; path++) {
+		const Fragment &tf = fragments[rand() % fragments.size()];
+		pick_target(tf, target);
+		if (measured)
+			measured = drop_cache(fd, map, len);
+		long startfaults = major_faults();
+
+		float dist = 2.0f * modelradius / HALF_FOV_TAN;
+		for (int step = 0; step < steps; step++, dist *= 0.5f) {
+			frame = path * steps + step;
+			campos[0] = target[0];
+			campos[1] = target[1];
+			campos[2] = target[2] + dist;
+			viewradius = dist * HALF_FOV_TAN;
+			for (int i = 0; i < fragments.size(); i++) {
+				const Fragment &f = fragments[i];
+				if (!refine(f.cx, f.cy, f.cz, f.r))
+					continue;
+				traverse(f, f.tree, f.numchildren,
+					 f.cx, f.cy, f.cz, f.r, true);
+			}
+		}
+		faults += major_faults() - startfaults;
+	}
+	double pagesperframe = (double) framepages / (numpaths * steps);
+	double pagesperpath = (double) newpages / numpaths;
+
+	// Pick the same spots, each with nothing cached
+	srand(1);
+	picking = true;
+	framepages = 0;
+	for (int i = 0; i < numpaths; i++, path++) {
+		const Fragment &tf = fragments[rand() % fragments.size()];
+		pick_target(tf, target);
+		frame = numpaths * steps + i;
+		for (int j = 0; j < fragments.size(); j++) {
+			const Fragment &f = fragments[j];
+			if (refine(f.cx, f.cy, f.cz, f.r))
+				traverse(f, f.tree, f.numchildren,
+					 f.cx, f.cy, f.cz, f.r, true);
+		}
+	}
+	picking = false;
+
+	printf("%-30s %10.1f %10.1f", filename, pagesperframe, pagesperpath);
+	if (measured)
+		printf(" %10.1f", (double) faults / numpaths);
+	else
+		printf(" %10s", "-");
+	printf(" %10.1f\n", (double) framepages / numpaths);
+
+	free_trees(fragments);
+	munmap(map, len);
+	close(fd);
+	return true;
+}
+
+
+static void usage(const char *myname)
+{
+	fprintf(stderr, "Usage: %s [-n paths] [-s steps] [-r resolution] [-p pagesize] in.qs [in2.qs ...]\n", myname);
+	fprintf(stderr, "  Zooms in on random spots of each file (the same spots, if the files were made\n");
+	fprintf(stderr, "  from the same mesh), and counts the pages read per frame and per path.\n");
+	fprintf(stderr, "  -r  pixels per radian of the view (default 1000)\n");
+	fprintf(stderr, "  Major faults are only counted if the files can be dropped from the cache\n");
+	fprintf(stderr, "  (they mustn't have unwritten data - run sync first).\n");
+	exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+	int numpaths = 20, steps = 16;
+	pagesize = sysconf(_SC_PAGESIZE);
+	int i = 1;
+	while (i < argc && argv[i][0] == '-') {
+		if (!strcmp(argv[i], "-n") && i+1 < argc) {
+			numpaths = max(atoi(argv[i+1]), 1);
+			i += 2;
+		} else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+			steps = max(atoi(argv[i+1]), 1);
+			i += 2;
+		} else if (!strcmp(argv[i], "-r") && i+1 < argc) {
+			pixels_per_radian = max((float) atof(argv[i+1]), 1.0f);
+			i += 2;
+		} else if (!strcmp(argv[i], "-p") && i+1 < argc) {
+			pagesize = max(atoi(argv[i+1]), 64);
+			i += 2;
+		} else {
+			usage(argv[0]);
+		}
+	}
+	if (i == argc)
+		usage(argv[0]);
+
+	QSplat_SphereQuant::Init();
+	printf("%d zoom paths of %d steps, %d-byte pages\n\n", numpaths, steps,
+	       (int) pagesize);
+	printf("%-30s %10s %10s %10s %10s\n", "file", "pages/frm",
+	       "new/path", "flts/path", "pages/pick");
+	bool ok = true;
+	for ( ; i < argc; i++)
+		if (!bench(argv[i], numpaths, steps))
+			ok = false;
+	return ok ? 0 : 1;
+}